@@ -0,0 +1,284 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "crc32c.h"
+
+/* Castagnoli polynomial, bit-reversed */
+#define CRC32C_POLY 0x82f63b78
+
+/* Castagnoli polynomial, x^32 included */
+#define CRC32C_POLY_FULL 0x11edc6f41ULL
+
+/* Bytes of each of the streams the crc32 instruction is given at once */
+#define CRC32C_STREAM 256
+
+/* Bytes the carry-less kernel folds at once, in four 512-bit registers */
+#define CRC32C_FOLD 256
+
+/* CRC of each byte followed by 0 to 7 zero bytes, for slicing by 8 */
+static uint32_t crc_table[8][256];
+
+/* Effect of CRC32C_STREAM zero bytes on each byte of a CRC */
+static uint32_t shift_table[4][256];
+
+/* Set 1 if the processor has the crc32 instruction */
+static int use_hw;
+
+/* Set 1 if it also has 512-bit carry-less multiplication */
+static int use_clmul;
+
+/*
+ * Constants that move 128 bits of data 256 bytes, 64, 48, 32 and 16 bytes
+ * further in the message: the one for their low half, then for their high half
+ */
+static uint64_t fold_256[2], fold_64[2], fold_48[2], fold_32[2], fold_16[2];
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint64_t load64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * x^@n modulo the polynomial, bit-reflected and shifted by one, the form in
+ * which a carry-less product by it lines up with the reflected data
+ */
+static uint64_t xpow_mod(int n)
+{
+	uint64_t r = 1, k = 0;
+	int i;
+
+	while (n--) {
+		r <<= 1;
+		if (r >> 32)
+			r ^= CRC32C_POLY_FULL;
+	}
+	for (i = 0; i < 32; i++)
+		if (r >> i & 1)
+			k |= 1ULL << (32 - i);
+
+	return k;
+}
+
+/* Constants in @k that move 128 bits of data @bytes further */
+static void fold_init(uint64_t *k, int bytes)
+{
+	k[0] = xpow_mod(8 * bytes + 32);
+	k[1] = xpow_mod(8 * bytes - 32);
+}
+
+static void crc_init(void)
+{
+	uint32_t c;
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		c = n;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc_table[0][n] = c;
+	}
+	for (n = 0; n < 256; n++)
+		for (k = 1; k < 8; k++)
+			crc_table[k][n] = crc_table[k - 1][n] >> 8 ^
+				crc_table[0][crc_table[k - 1][n] & 0xff];
+
+	for (k = 0; k < 4; k++) {
+		for (n = 0; n < 256; n++) {
+			c = (uint32_t)n << (8 * k);
+			for (int i = 0; i < CRC32C_STREAM; i++)
+				c = crc_table[0][c & 0xff] ^ c >> 8;
+			shift_table[k][n] = c;
+		}
+	}
+
+#if defined(__x86_64__)
+	use_hw = __builtin_cpu_supports("sse4.2") != 0;
+	use_clmul = use_hw && __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("vpclmulqdq");
+#endif
+	fold_init(fold_256, CRC32C_FOLD);
+	fold_init(fold_64, 64);
+	fold_init(fold_48, 48);
+	fold_init(fold_32, 32);
+	fold_init(fold_16, 16);
+}
+
+/*
+ * CRC register @c, pre- and post-conditioning apart, once CRC32C_STREAM zero
+ * bytes have gone through it
+ */
+static uint32_t crc_shift(uint32_t c)
+{
+	return shift_table[0][c & 0xff] ^ shift_table[1][c >> 8 & 0xff] ^
+		shift_table[2][c >> 16 & 0xff] ^ shift_table[3][c >> 24];
+}
+
+static uint32_t crc_sw(uint32_t c, const uint8_t *p, size_t len)
+{
+	uint64_t w;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = crc_table[0][(c ^ *p++) & 0xff] ^ c >> 8;
+		len--;
+	}
+
+	/* Eight bytes at a time, the first one being the least significant */
+	for (; len >= 8; p += 8, len -= 8) {
+		w = load64(p) ^ c;
+		c = crc_table[7][w & 0xff] ^ crc_table[6][w >> 8 & 0xff] ^
+			crc_table[5][w >> 16 & 0xff] ^ crc_table[4][w >> 24 & 0xff] ^
+			crc_table[3][w >> 32 & 0xff] ^ crc_table[2][w >> 40 & 0xff] ^
+			crc_table[1][w >> 48 & 0xff] ^ crc_table[0][w >> 56];
+	}
+
+	while (len--)
+		c = crc_table[0][(c ^ *p++) & 0xff] ^ c >> 8;
+
+	return c;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t c, const uint8_t *p, size_t len)
+{
+	uint64_t c0, c1, c2;
+	const uint8_t *end;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+
+	/*
+	 * Each instruction waits for the one before on the same stream: three
+	 * streams are computed side by side, the last two from 0, and the CRC
+	 * of the first one is carried over the other two
+	 */
+	while (len >= 3 * CRC32C_STREAM) {
+		c0 = c;
+		c1 = 0;
+		c2 = 0;
+		for (end = p + CRC32C_STREAM; p < end; p += 8) {
+			c0 = _mm_crc32_u64(c0, load64(p));
+			c1 = _mm_crc32_u64(c1, load64(p + CRC32C_STREAM));
+			c2 = _mm_crc32_u64(c2, load64(p + 2 * CRC32C_STREAM));
+		}
+		c = crc_shift(c0) ^ c1;
+		c = crc_shift(c) ^ c2;
+		p += 2 * CRC32C_STREAM;
+		len -= 3 * CRC32C_STREAM;
+	}
+
+	for (; len >= 8; p += 8, len -= 8)
+		c = _mm_crc32_u64(c, load64(p));
+	while (len--)
+		c = _mm_crc32_u8(c, *p++);
+
+	return c;
+}
+
+#define CLMUL_TARGET "avx512f,vpclmulqdq,pclmul,sse4.2"
+
+/* The four lanes of @z moved as constants @k tell, xored with @data */
+__attribute__((target(CLMUL_TARGET)))
+static inline __m512i fold512(__m512i z, __m512i k, __m512i data)
+{
+	return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(z, k, 0x00),
+					 _mm512_clmulepi64_epi128(z, k, 0x11),
+					 data, 0x96);
+}
+
+/* 128 bits @x moved as constants @k tell */
+__attribute__((target(CLMUL_TARGET)))
+static inline __m128i fold128(__m128i x, const uint64_t *k)
+{
+	__m128i kk = _mm_set_epi64x(k[1], k[0]);
+
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, kk, 0x00),
+			     _mm_clmulepi64_si128(x, kk, 0x11));
+}
+
+/*
+ * Same as crc_hw(), for @len of CRC32C_FOLD bytes at least. The data is folded
+ * 128 bits at a time, 16 lanes side by side: each lane is multiplied by the
+ * power of x that moves it as far as the next data it is xored with, modulo
+ * the polynomial. The 128 bits left are congruent to all the data folded, and
+ * go through the crc32 instruction along with the last bytes.
+ */
+__attribute__((target(CLMUL_TARGET)))
+static uint32_t crc_clmul(uint32_t c, const uint8_t *p, size_t len)
+{
+	__m512i z0, z1, z2, z3, k;
+	__m128i x;
+	uint64_t lo, hi;
+
+	z0 = _mm512_loadu_si512(p);
+	z1 = _mm512_loadu_si512(p + 64);
+	z2 = _mm512_loadu_si512(p + 128);
+	z3 = _mm512_loadu_si512(p + 192);
+	z0 = _mm512_xor_si512(z0, _mm512_inserti32x4(_mm512_setzero_si512(),
+						    _mm_cvtsi32_si128(c), 0));
+	p += CRC32C_FOLD;
+	len -= CRC32C_FOLD;
+
+	k = _mm512_broadcast_i32x4(_mm_set_epi64x(fold_256[1], fold_256[0]));
+	for (; len >= CRC32C_FOLD; p += CRC32C_FOLD, len -= CRC32C_FOLD) {
+		z0 = fold512(z0, k, _mm512_loadu_si512(p));
+		z1 = fold512(z1, k, _mm512_loadu_si512(p + 64));
+		z2 = fold512(z2, k, _mm512_loadu_si512(p + 128));
+		z3 = fold512(z3, k, _mm512_loadu_si512(p + 192));
+	}
+
+	/* Down to one register, then to one lane */
+	k = _mm512_broadcast_i32x4(_mm_set_epi64x(fold_64[1], fold_64[0]));
+	z1 = fold512(z0, k, z1);
+	z2 = fold512(z1, k, z2);
+	z0 = fold512(z2, k, z3);
+	for (; len >= 64; p += 64, len -= 64)
+		z0 = fold512(z0, k, _mm512_loadu_si512(p));
+	x = _mm_xor_si128(fold128(_mm512_extracti32x4_epi32(z0, 0), fold_48),
+			  fold128(_mm512_extracti32x4_epi32(z0, 1), fold_32));
+	x = _mm_xor_si128(x, fold128(_mm512_extracti32x4_epi32(z0, 2),
+				     fold_16));
+	x = _mm_xor_si128(x, _mm512_extracti32x4_epi32(z0, 3));
+	for (; len >= 16; p += 16, len -= 16)
+		x = _mm_xor_si128(fold128(x, fold_16),
+				  _mm_loadu_si128((const __m128i *)p));
+
+	lo = _mm_cvtsi128_si64(x);
+	hi = _mm_extract_epi64(x, 1);
+	c = _mm_crc32_u64(_mm_crc32_u64(0, lo), hi);
+
+	return crc_hw(c, p, len);
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, crc_init);
+
+#if defined(__x86_64__)
+	if (use_clmul && len >= CRC32C_FOLD)
+		return ~crc_clmul(~crc, buf, len);
+	if (use_hw)
+		return ~crc_hw(~crc, buf, len);
+#endif
+	return ~crc_sw(~crc, buf, len);
+}
+
+int crc32c_accelerated(void)
+{
+	pthread_once(&crc_once, crc_init);
+
+	return use_clmul ? 2 : use_hw;
+}
@@ -0,0 +1,33 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint32_t definition */
+
+/**
+ * crc32c - Compute a CRC32C
+ * @crc: CRC32C of the data that comes before @buf, 0 if none
+ * @buf: Data to checksum
+ * @len: Length of @buf in bytes
+ *
+ * Extend @crc with the @len bytes of @buf, using the Castagnoli polynomial
+ * (iSCSI, ext4, Btrfs). If the processor has 512-bit carry-less multiplication
+ * (AVX-512 VPCLMULQDQ), buffers of 256 bytes or more are folded 64 bytes per
+ * instruction. Otherwise the SSE4.2 crc32 instruction is used if the processor
+ * has it, with three streams in flight to hide its latency, and a table-driven
+ * implementation if not.
+ *
+ * Return: the CRC32C of the data before @buf followed by @buf.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_accelerated - Tell how crc32c() is computed
+ *
+ * Return: 2 if crc32c() also uses carry-less multiplication, 1 if it uses the
+ * crc32 instruction of the processor only, 0 if it uses the table-driven
+ * implementation.
+ */
+int crc32c_accelerated(void);
+
+#endif /* _CRC32C_H */
@@ -1,11 +1,22 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+/* <linux/fs.h>, pulled in by <linux/io_uring.h>, has its own BLOCK_SIZE */
+#undef BLOCK_SIZE
 #include "disk.h"
+#include "crc32c.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
@@ -13,28 +24,1055 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Largest number of buffers taken by preadv()/pwritev() (Linux' value) */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Cached copy of a disk block */
+struct cache_entry {
+	/* Index of the cached block */
+	size_t block;
+	/* Entry holds a block, and that block differs from the disk */
+	int valid, dirty;
+	/* Next entry in the same hash bucket */
+	struct cache_entry *hnext;
+	/* Neighbours in the LRU list */
+	struct cache_entry *prev, *next;
+	/* Block content */
+	char *data;
+};
+
+/* Largest run of blocks read by a single prefetch call */
+#define PREFETCH_RUN 64
+
+/* Number of requests an io_uring instance keeps in flight */
+#define URING_ENTRIES 64
+
+/* Microseconds between two looks at the completions of a broken io_uring */
+#define URING_POLL_US 1000
+
+/* Number of workers of the thread pool engine */
+#define POOL_THREADS 4
+
+/* Queued asynchronous block request */
+struct block_request {
+	/* Target block */
+	size_t block;
+	/* Set 1 for a write, 0 for a read */
+	int write;
+	/* Data buffer */
+	struct iovec iov;
+	/* Outcome: 0 on success, -1 on failure */
+	int result;
+};
+
+/* io_uring instance, set up with raw system calls */
+struct uring {
+	int fd;
+	/* Submission ring */
+	void *sq_ptr;
+	size_t sq_len;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	/* Completion ring */
+	void *cq_ptr;
+	size_t cq_len;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Number of submission entries */
+	unsigned entries;
+};
+
+/* Thread pool performing blocking I/O on behalf of the submitter */
+struct pool {
+	pthread_t threads[POOL_THREADS];
+	int nthreads;
+	pthread_mutex_t lock;
+	/* Signaled when a batch is posted, and when the batch completes */
+	pthread_cond_t work, done;
+	/* Current batch: next request to pick, size, requests not done */
+	struct block_request *reqs;
+	size_t next, n, pending;
+	/* Set 1 to make the workers exit */
+	int stop;
+	/* Disk the requests are performed on */
+	struct disk *disk;
+};
+
+/* Asynchronous engine operations */
+struct engine_ops {
+	/* BLOCK_ENGINE_* identifier */
+	int id;
+	/* Set the engine up for the disk being opened */
+	int (*init)(void);
+	/* Perform a batch of requests, filling in their outcome */
+	void (*run)(struct block_request *reqs, size_t n);
+	/* Tear the engine down */
+	void (*fini)(void);
+};
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
-	/* Block count */
+	/* Block count and size */
 	size_t bcount;
+	size_t bsize;
+	/* Mapping of the whole disk file (mmap backend only) */
+	char *map;
+	/* Buffer cache entries (none if the cache is disabled), and the
+	 * content of their blocks */
+	struct cache_entry *entries;
+	size_t nentries;
+	char *slab;
+	/* Hash table of valid entries, indexed by block number */
+	struct cache_entry **buckets;
+	size_t nbuckets;
+	/* LRU list sentinel: lru.next is the most recently used entry */
+	struct cache_entry lru;
+	/* Cache counters */
+	struct block_cache_stats stats;
+	/* Bumped by every write to the disk, write-through or write-back, so
+	 * that a racing read does not cache what it read before */
+	unsigned long wgen;
+	/* Checksum area: first block (0 if blocks are not checksummed) and
+	 * number of blocks, CRC32C of each block below it, and a byte per block
+	 * of the area, set if it differs from the disk. A block of room to write
+	 * it, used with the lock held */
+	size_t csum_start, csum_count;
+	uint32_t *csums;
+	uint8_t *csum_dirty;
+	uint32_t *csum_buf;
+	/* Writes in flight without the lock to each block below the area, whose
+	 * checksum is only updated once they are over, and signalled then */
+	uint16_t *csum_busy;
+	pthread_cond_t csum_cond;
+	/* Set while blocks that do not match their checksums are read anyway */
+	int csum_lenient;
+	/* Protects the cache and its counters. I/O on blocks that are not
+	 * cached is performed without holding it */
+	pthread_mutex_t lock;
+	/* Asynchronous engine (NULL if requests are performed synchronously) */
+	const struct engine_ops *engine;
+	/* Serializes the batches submitted to the engine */
+	pthread_mutex_t engine_lock;
+	/* Engine state */
+	struct uring uring;
+	struct pool pool;
+	/* Cache size, asynchronous engine and block size used the next time
+	 * it is opened */
+	size_t cache_size;
+	int engine_choice;
+	size_t bsize_choice;
+};
+
+/* Disk used by the callers that never select one (invalid by default) */
+static struct disk default_disk = {
+	.fd = INVALID_FD,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.engine_lock = PTHREAD_MUTEX_INITIALIZER,
+	.csum_cond = PTHREAD_COND_INITIALIZER,
+	.cache_size = BLOCK_CACHE_DEFAULT,
+	.engine_choice = BLOCK_ENGINE_SYNC,
+	.bsize_choice = BLOCK_SIZE,
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Disk the calling thread works on */
+static __thread struct disk *disk = &default_disk;
+
+/* Requests queued by the calling thread until its next block_submit() */
+static __thread struct block_request *queue;
+static __thread size_t nqueued, queue_cap;
+
+static void lru_unlink(struct cache_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_push_front(struct cache_entry *e)
+{
+	e->next = disk->lru.next;
+	e->prev = &disk->lru;
+	disk->lru.next->prev = e;
+	disk->lru.next = e;
+}
+
+static void lru_push_back(struct cache_entry *e)
+{
+	e->prev = disk->lru.prev;
+	e->next = &disk->lru;
+	disk->lru.prev->next = e;
+	disk->lru.prev = e;
+}
+
+static size_t cache_hash(size_t block)
+{
+	return block % disk->nbuckets;
+}
+
+static struct cache_entry *cache_lookup(size_t block)
+{
+	struct cache_entry *e;
+
+	if (!disk->nentries)
+		return NULL;
+
+	for (e = disk->buckets[cache_hash(block)]; e; e = e->hnext)
+		if (e->block == block)
+			return e;
+
+	return NULL;
+}
+
+static void cache_unhash(struct cache_entry *e)
+{
+	struct cache_entry **pp = &disk->buckets[cache_hash(e->block)];
+
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+	e->valid = 0;
+}
+
+/* Drop @e and make it the first candidate for reuse */
+static void cache_invalidate(struct cache_entry *e)
+{
+	cache_unhash(e);
+	lru_unlink(e);
+	lru_push_back(e);
+}
+
+/*
+ * Update the cached copy of @block, about to be written from @buf around the
+ * cache, so that an older dirty copy can no longer be written back over the
+ * new content. Must be called with the lock held.
+ */
+static void cache_refresh(size_t block, const void *buf)
+{
+	struct cache_entry *e = cache_lookup(block);
+
+	if (e) {
+		memcpy(e->data, buf, disk->bsize);
+		e->dirty = 0;
+	}
+}
+
+/*
+ * Drop a copy of @block cached while it was written from @buf: a miss read in
+ * the meantime may hold the older content. Copies dirtied since are more
+ * recent and stay, unless the write failed (@err) and left the disk unknown.
+ * Must be called with the lock held, before the write generation is bumped.
+ */
+static void cache_settle(size_t block, const void *buf, int err)
+{
+	struct cache_entry *e = cache_lookup(block);
+
+	if (e && (err || (!e->dirty && memcmp(e->data, buf, disk->bsize))))
+		cache_invalidate(e);
+}
+
+/*
+ * Record the checksum of @buf, just written to @block. Must be called with the
+ * lock held.
+ */
+static void csum_update(size_t block, const void *buf)
+{
+	if (block >= disk->csum_start)
+		return;
+
+	/* Readers compare against it without the lock */
+	__atomic_store_n(&disk->csums[block], crc32c(0, buf, disk->bsize),
+			 __ATOMIC_RELAXED);
+	disk->csum_dirty[block * sizeof(uint32_t) / disk->bsize] = 1;
+}
+
+/*
+ * Note that @count blocks from @block are about to be written without the
+ * lock. Until csum_end(), what they hold may not match their checksums. Must
+ * be called with the lock held.
+ */
+static void csum_begin(size_t block, size_t count)
+{
+	for (; count && block < disk->csum_start; block++, count--)
+		disk->csum_busy[block]++;
+}
+
+/*
+ * Record the checksums of the @count blocks of @iov, written at @block unless
+ * @err is set, and wake up the readers waiting for them. Must be called with
+ * the lock held.
+ */
+static void csum_end(size_t block, size_t count, const struct iovec *iov,
+		     int err)
+{
+	size_t i;
+
+	for (i = 0; i < count && block + i < disk->csum_start; i++) {
+		if (!err)
+			csum_update(block + i, iov[i].iov_base);
+		disk->csum_busy[block + i]--;
+	}
+	if (i)
+		pthread_cond_broadcast(&disk->csum_cond);
+}
+
+/*
+ * Check @buf, just read from @block, against the block's checksum. The block
+ * may have been written in the meantime: once its writes are over and their
+ * checksums recorded, it is read again with the lock held before it is
+ * reported corrupt. Must be called without the lock.
+ */
+static int csum_check(size_t block, void *buf)
+{
+	ssize_t ret;
+	int ok;
+
+	if (block >= disk->csum_start ||
+	    crc32c(0, buf, disk->bsize) ==
+	    __atomic_load_n(&disk->csums[block], __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&disk->lock);
+	while (disk->csum_busy[block])
+		pthread_cond_wait(&disk->csum_cond, &disk->lock);
+	ret = pread(disk->fd, buf, disk->bsize, block * disk->bsize);
+	ok = ret == (ssize_t)disk->bsize &&
+		(disk->csum_lenient ||
+		 crc32c(0, buf, disk->bsize) == disk->csums[block]);
+	if (!ok)
+		disk->stats.corrupt++;
+	pthread_mutex_unlock(&disk->lock);
+
+	if (!ok) {
+		block_error("block %zu does not match its checksum", block);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int disk_pwrite(size_t block, const void *buf)
+{
+	ssize_t ret;
+
+	if (disk->map) {
+		memcpy(disk->map + block * disk->bsize, buf, disk->bsize);
+		return 0;
+	}
+
+	/* Write at the block's position, leaving the file offset alone */
+	ret = pwrite(disk->fd, buf, disk->bsize, block * disk->bsize);
+	if (ret < 0) {
+		perror("pwrite");
+		return -1;
+	}
+	if ((size_t)ret != disk->bsize) {
+		block_error("short write at block %zu", block);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int disk_pread(size_t block, void *buf)
+{
+	if (disk->map) {
+		memcpy(buf, disk->map + block * disk->bsize, disk->bsize);
+		return 0;
+	}
+
+	/* Read at the block's position, leaving the file offset alone */
+	if (pread(disk->fd, buf, disk->bsize, block * disk->bsize) < 0) {
+		perror("pread");
+		return -1;
+	}
+
+	return csum_check(block, buf);
+}
+
+static int disk_pwritev(size_t block, size_t count, const struct iovec *iov)
+{
+	ssize_t ret;
+	size_t n;
+
+	if (disk->map) {
+		for (n = 0; n < count; n++)
+			disk_pwrite(block + n, iov[n].iov_base);
+		return 0;
+	}
+
+	/*
+	 * A single call cannot take more than IOV_MAX buffers. One that stops
+	 * short, past the limit of the size of files for instance, fails
+	 */
+	for (; count; block += n, iov += n, count -= n) {
+		n = count < IOV_MAX ? count : IOV_MAX;
+		ret = pwritev(disk->fd, iov, n, block * disk->bsize);
+		if (ret < 0) {
+			perror("pwritev");
+			return -1;
+		}
+		if ((size_t)ret != n * disk->bsize) {
+			block_error("short write at block %zu", block);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int disk_preadv(size_t block, size_t count, const struct iovec *iov)
+{
+	size_t n, k;
+
+	if (disk->map) {
+		for (n = 0; n < count; n++)
+			disk_pread(block + n, iov[n].iov_base);
+		return 0;
+	}
+
+	for (; count; block += n, iov += n, count -= n) {
+		n = count < IOV_MAX ? count : IOV_MAX;
+		if (preadv(disk->fd, iov, n, block * disk->bsize) < 0) {
+			perror("preadv");
+			return -1;
+		}
+		for (k = 0; k < n; k++)
+			if (csum_check(block + k, iov[k].iov_base))
+				return -1;
+	}
+
+	return 0;
+}
+
+static int cache_writeback(struct cache_entry *e)
+{
+	if (!e->dirty)
+		return 0;
+
+	if (disk_pwrite(e->block, e->data))
+		return -1;
+	csum_update(e->block, e->data);
+
+	/*
+	 * The entry may be evicted next, and a miss on its block that started
+	 * before this write must not bring the old content back
+	 */
+	e->dirty = 0;
+	disk->wgen++;
+	disk->stats.writebacks++;
+
+	return 0;
+}
+
+/*
+ * Get an entry to hold @block: the least recently used one is recycled, after
+ * its content is written back if needed.
+ */
+static struct cache_entry *cache_alloc(size_t block)
+{
+	struct cache_entry *e = disk->lru.prev;
+	size_t h;
+
+	if (e->valid) {
+		if (cache_writeback(e))
+			return NULL;
+		cache_unhash(e);
+		disk->stats.evictions++;
+	}
+
+	e->block = block;
+	e->valid = 1;
+	e->dirty = 0;
+	h = cache_hash(block);
+	e->hnext = disk->buckets[h];
+	disk->buckets[h] = e;
+
+	lru_unlink(e);
+	lru_push_front(e);
+
+	return e;
+}
+
+static void cache_destroy(void)
+{
+	free(disk->entries);
+	free(disk->buckets);
+	free(disk->slab);
+	disk->entries = NULL;
+	disk->buckets = NULL;
+	disk->slab = NULL;
+	disk->nentries = 0;
+	disk->nbuckets = 0;
+}
+
+static int cache_create(size_t nentries)
+{
+	size_t i;
+
+	disk->lru.next = disk->lru.prev = &disk->lru;
+	memset(&disk->stats, 0, sizeof(disk->stats));
+	if (!nentries)
+		return 0;
+
+	disk->entries = calloc(nentries, sizeof(struct cache_entry));
+	/* Twice as many buckets as entries keeps the chains short */
+	disk->nbuckets = 2 * nentries;
+	disk->buckets = calloc(disk->nbuckets, sizeof(struct cache_entry *));
+	disk->slab = malloc(nentries * disk->bsize);
+	if (!disk->entries || !disk->buckets || !disk->slab) {
+		block_error("cannot allocate %zu cache entries", nentries);
+		cache_destroy();
+		return -1;
+	}
+
+	disk->nentries = nentries;
+	for (i = 0; i < nentries; i++) {
+		disk->entries[i].data = disk->slab + i * disk->bsize;
+		lru_push_front(&disk->entries[i]);
+	}
+
+	return 0;
+}
+
+/*
+ * Write the blocks of the checksum area modified since they were last written.
+ * Called with the lock held
+ */
+static int csum_writeback(void)
+{
+	size_t per_block = disk->bsize / sizeof(uint32_t);
+	size_t i;
+
+	for (i = 0; i < disk->csum_count; i++) {
+		if (!disk->csum_dirty[i])
+			continue;
+		memcpy(disk->csum_buf, &disk->csums[i * per_block], disk->bsize);
+		if (disk_pwrite(disk->csum_start + i, disk->csum_buf))
+			return -1;
+		disk->csum_dirty[i] = 0;
+	}
+
+	return 0;
+}
+
+static void csum_destroy(void)
+{
+	free(disk->csums);
+	free(disk->csum_dirty);
+	free(disk->csum_buf);
+	free(disk->csum_busy);
+	disk->csums = NULL;
+	disk->csum_dirty = NULL;
+	disk->csum_buf = NULL;
+	disk->csum_busy = NULL;
+	disk->csum_start = 0;
+	disk->csum_count = 0;
+	disk->csum_lenient = 0;
+}
+
+/* Check the checksum area to be, and make room for it */
+static int csum_create(size_t start, size_t count)
+{
+	if (disk->fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* Blocks of a mapping are modified without the checksums knowing */
+	if (disk->map) {
+		block_error("cannot checksum a mapped disk");
+		return -1;
+	}
+
+	if (disk->csums) {
+		block_error("blocks already checksummed");
+		return -1;
+	}
+
+	if (start > disk->bcount || count > disk->bcount - start ||
+	    count * (disk->bsize / sizeof(uint32_t)) < start) {
+		block_error("invalid checksum area (%zu+%zu/%zu)",
+			    start, count, disk->bcount);
+		return -1;
+	}
+
+	disk->csums = calloc(count, disk->bsize);
+	disk->csum_dirty = calloc(count, 1);
+	disk->csum_buf = malloc(disk->bsize);
+	disk->csum_busy = calloc(start ? start : 1, sizeof(uint16_t));
+	if (!disk->csums || !disk->csum_dirty || !disk->csum_buf ||
+	    !disk->csum_busy) {
+		block_error("cannot allocate checksum area");
+		csum_destroy();
+		return -1;
+	}
+	disk->csum_count = count;
+
+	return 0;
+}
+
+/* Perform a single request synchronously */
+static int request_perform(struct block_request *req)
+{
+	ssize_t ret;
+
+	if (req->write)
+		ret = pwrite(disk->fd, req->iov.iov_base, disk->bsize,
+			     req->block * disk->bsize);
+	else
+		ret = pread(disk->fd, req->iov.iov_base, disk->bsize,
+			    req->block * disk->bsize);
+
+	if (ret != (ssize_t)disk->bsize) {
+		perror(req->write ? "pwrite" : "pread");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(unsigned to_submit, unsigned min_complete)
+{
+	return syscall(__NR_io_uring_enter, disk->uring.fd, to_submit,
+		       min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static void uring_fini(void)
+{
+	struct uring *r = &disk->uring;
+
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	if (r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_len);
+	if (r->fd >= 0)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+	r->fd = INVALID_FD;
+}
+
+static int uring_init(void)
+{
+	struct uring *r = &disk->uring;
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = uring_setup(URING_ENTRIES, &p);
+	if (r->fd < 0) {
+		/* Not an error as long as another engine can take over */
+		r->fd = INVALID_FD;
+		return -1;
+	}
+
+	r->entries = p.sq_entries;
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		goto fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = NULL;
+			goto fail;
+		}
+	}
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	sq = r->sq_ptr;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq = r->cq_ptr;
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+fail:
+	perror("mmap");
+	uring_fini();
+	return -1;
+}
+
+static void uring_run(struct block_request *reqs, size_t n)
+{
+	struct uring *r = &disk->uring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	size_t submitted = 0, i;
+	unsigned inflight = 0, tail, head, idx;
+	int ret, failed = 0, broken = 0;
+
+	/* Requests fail unless their own completion says otherwise */
+	for (i = 0; i < n; i++)
+		reqs[i].result = -1;
+
+	/* The ring is gone if it could not be set up again */
+	if (r->fd == INVALID_FD)
+		return;
+
+	while (inflight || (!failed && submitted < n)) {
+		/* Fill the submission ring with as many requests as it takes */
+		tail = *r->sq_tail;
+		while (!failed && submitted < n && inflight < r->entries) {
+			idx = tail & *r->sq_mask;
+			sqe = &r->sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = reqs[submitted].write ?
+				IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = disk->fd;
+			sqe->addr = (unsigned long)&reqs[submitted].iov;
+			sqe->len = 1;
+			sqe->off = reqs[submitted].block * disk->bsize;
+			sqe->user_data = submitted;
+			r->sq_array[idx] = idx;
+			tail++;
+			submitted++;
+			inflight++;
+		}
+		__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+		/* Submit what the kernel has not taken yet, and wait for a
+		 * completion. Interrupted or short of resources, it is simply
+		 * tried again */
+		if (broken) {
+			usleep(URING_POLL_US);
+			ret = 0;
+		} else {
+			ret = uring_enter(tail - __atomic_load_n(r->sq_head,
+							__ATOMIC_ACQUIRE), 1);
+		}
+		if (ret < 0 && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY) {
+			perror("io_uring_enter");
+			if (failed) {
+				/*
+				 * Completions cannot even be waited for. The
+				 * requests in flight still point at the
+				 * callers' buffers, so the completion ring,
+				 * where they are posted all the same, is
+				 * polled until they are all in
+				 */
+				broken = 1;
+				continue;
+			}
+			/*
+			 * The requests the kernel did not take are withdrawn.
+			 * The ones it took point at the callers' buffers, and
+			 * are waited for before returning
+			 */
+			failed = 1;
+			head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+			inflight -= tail - head;
+			__atomic_store_n(r->sq_tail, head, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		/* Reap whatever completed, each outcome going to its request */
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &r->cqes[head & *r->cq_mask];
+			if (cqe->user_data < n)
+				reqs[cqe->user_data].result =
+					cqe->res == (int)disk->bsize ? 0 : -1;
+			head++;
+			inflight--;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	/* Nothing is in flight anymore: a new ring replaces the broken one */
+	if (broken) {
+		uring_fini();
+		uring_init();
+	}
+}
+
+static void *pool_worker(void *arg)
+{
+	struct pool *pl = arg;
+	struct block_request *req;
+
+	disk = pl->disk;
+	pthread_mutex_lock(&pl->lock);
+	while (1) {
+		while (!pl->stop && pl->next == pl->n)
+			pthread_cond_wait(&pl->work, &pl->lock);
+		if (pl->stop)
+			break;
+
+		req = &pl->reqs[pl->next++];
+		pthread_mutex_unlock(&pl->lock);
+		req->result = request_perform(req);
+		pthread_mutex_lock(&pl->lock);
+
+		if (--pl->pending == 0)
+			pthread_cond_signal(&pl->done);
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	return NULL;
+}
+
+static void pool_fini(void)
+{
+	struct pool *pl = &disk->pool;
+	int i;
+
+	pthread_mutex_lock(&pl->lock);
+	pl->stop = 1;
+	pthread_cond_broadcast(&pl->work);
+	pthread_mutex_unlock(&pl->lock);
+
+	for (i = 0; i < pl->nthreads; i++)
+		pthread_join(pl->threads[i], NULL);
+
+	pthread_cond_destroy(&pl->done);
+	pthread_cond_destroy(&pl->work);
+	pthread_mutex_destroy(&pl->lock);
+	memset(pl, 0, sizeof(*pl));
+}
+
+static int pool_init(void)
+{
+	struct pool *pl = &disk->pool;
+
+	memset(pl, 0, sizeof(*pl));
+	pl->disk = disk;
+	pthread_mutex_init(&pl->lock, NULL);
+	pthread_cond_init(&pl->work, NULL);
+	pthread_cond_init(&pl->done, NULL);
+
+	for (pl->nthreads = 0; pl->nthreads < POOL_THREADS; pl->nthreads++) {
+		if (pthread_create(&pl->threads[pl->nthreads], NULL,
+				   pool_worker, pl)) {
+			block_error("cannot create I/O thread");
+			pool_fini();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void pool_run(struct block_request *reqs, size_t n)
+{
+	struct pool *pl = &disk->pool;
+
+	pthread_mutex_lock(&pl->lock);
+	pl->reqs = reqs;
+	pl->next = 0;
+	pl->n = n;
+	pl->pending = n;
+	pthread_cond_broadcast(&pl->work);
+	while (pl->pending)
+		pthread_cond_wait(&pl->done, &pl->lock);
+	pl->n = pl->next = 0;
+	pthread_mutex_unlock(&pl->lock);
+}
+
+static const struct engine_ops uring_engine = {
+	.id = BLOCK_ENGINE_IO_URING,
+	.init = uring_init,
+	.run = uring_run,
+	.fini = uring_fini,
+};
+
+static const struct engine_ops pool_engine = {
+	.id = BLOCK_ENGINE_THREADS,
+	.init = pool_init,
+	.run = pool_run,
+	.fini = pool_fini,
+};
+
+/* Set up the engine requested for the disk being opened */
+static int engine_create(int choice)
+{
+	disk->engine = NULL;
+
+	if (choice == BLOCK_ENGINE_IO_URING || choice == BLOCK_ENGINE_AUTO) {
+		if (!uring_engine.init()) {
+			disk->engine = &uring_engine;
+			return 0;
+		}
+		if (choice == BLOCK_ENGINE_IO_URING) {
+			block_error("io_uring is not available");
+			return -1;
+		}
+	}
+
+	if (choice == BLOCK_ENGINE_THREADS || choice == BLOCK_ENGINE_AUTO) {
+		if (pool_engine.init())
+			return -1;
+		disk->engine = &pool_engine;
+	}
+
+	return 0;
+}
+
+static void engine_destroy(void)
+{
+	if (disk->engine)
+		disk->engine->fini();
+	disk->engine = NULL;
+	free(queue);
+	queue = NULL;
+	nqueued = queue_cap = 0;
+}
+
+struct disk *block_disk_new(void)
+{
+	struct disk *d = calloc(1, sizeof(*d));
+
+	if (!d) {
+		block_error("cannot allocate disk");
+		return NULL;
+	}
+
+	d->fd = INVALID_FD;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_mutex_init(&d->engine_lock, NULL);
+	pthread_cond_init(&d->csum_cond, NULL);
+	d->cache_size = BLOCK_CACHE_DEFAULT;
+	d->engine_choice = BLOCK_ENGINE_SYNC;
+	d->bsize_choice = BLOCK_SIZE;
+
+	return d;
+}
+
+int block_disk_free(struct disk *d)
+{
+	if (!d || d == &default_disk) {
+		block_error("invalid disk");
+		return -1;
+	}
+
+	if (d->fd != INVALID_FD) {
+		block_error("disk still open");
+		return -1;
+	}
+
+	pthread_mutex_destroy(&d->lock);
+	pthread_mutex_destroy(&d->engine_lock);
+	pthread_cond_destroy(&d->csum_cond);
+	free(d);
+
+	return 0;
+}
+
+struct disk *block_disk_select(struct disk *d)
+{
+	struct disk *prev = disk;
+
+	disk = d ? d : &default_disk;
+
+	return prev == &default_disk ? NULL : prev;
+}
+
+int block_disk_create(const char *diskname, size_t count)
+{
+	return block_disk_create_mode(diskname, count, BLOCK_CREATE_SPARSE);
+}
+
+int block_disk_create_mode(const char *diskname, size_t count, int mode)
+{
+	int fd, err;
+	off_t size = (off_t)count * disk->bsize_choice;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if (mode != BLOCK_CREATE_SPARSE && mode != BLOCK_CREATE_PREALLOC) {
+		block_error("invalid mode '%d'", mode);
+		return -1;
+	}
+
+	if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Blocks never written read back as zeroes, and take no space */
+	if (mode == BLOCK_CREATE_SPARSE && ftruncate(fd, size)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	/* Reserved blocks read back as zeroes as well */
+	if (mode == BLOCK_CREATE_PREALLOC &&
+	    size > 0 && (err = posix_fallocate(fd, 0, size))) {
+		errno = err;
+		perror("posix_fallocate");
+		close(fd);
+		return -1;
+	}
+
+	if (close(fd)) {
+		perror("close");
+		return -1;
+	}
+
+	return 0;
+}
 
 int block_disk_open(const char *diskname)
+{
+	return block_disk_open_backend(diskname, BLOCK_BACKEND_FD);
+}
+
+int block_disk_open_backend(const char *diskname, int backend)
 {
 	int fd;
 	struct stat st;
+	char *map = NULL;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
+	if (disk->fd != INVALID_FD) {
 		block_error("disk already open");
 		return -1;
 	}
@@ -50,94 +1088,737 @@ int block_disk_open(const char *diskname)
 	}
 
 	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	if (st.st_size % disk->bsize_choice != 0) {
+		block_error("size '%zu' is not multiple of '%zu'",
+			    st.st_size, disk->bsize_choice);
+		close(fd);
+		return -1;
+	}
+	disk->bsize = disk->bsize_choice;
+
+	if (backend == BLOCK_BACKEND_MMAP && st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			return -1;
+		}
+	}
+
+	/* The page cache already plays the buffer cache's part for mappings */
+	if (cache_create(map ? 0 : disk->cache_size)) {
+		if (map)
+			munmap(map, st.st_size);
+		close(fd);
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk->map = map;
+	disk->fd = fd;
+
+	/* Copies from a mapping gain nothing from being asynchronous */
+	if (engine_create(map ? BLOCK_ENGINE_SYNC : disk->engine_choice)) {
+		cache_destroy();
+		if (map)
+			munmap(map, st.st_size);
+		close(fd);
+		disk->map = NULL;
+		disk->fd = INVALID_FD;
+		return -1;
+	}
+	disk->bcount = st.st_size / disk->bsize;
 
 	return 0;
 }
 
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	int ret;
+
+	if (disk->fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	/* Dirty blocks must reach the disk before it goes away */
+	ret = block_cache_flush();
+	cache_destroy();
+	csum_destroy();
+	engine_destroy();
 
-	disk.fd = INVALID_FD;
+	if (disk->map) {
+		munmap(disk->map, disk->bcount * disk->bsize);
+		disk->map = NULL;
+	}
 
-	return 0;
+	close(disk->fd);
+
+	disk->fd = INVALID_FD;
+
+	return ret;
 }
 
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (disk->fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	return disk->bcount;
 }
 
 int block_write(size_t block, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	struct cache_entry *e;
+	struct iovec iov;
+	int ret;
+
+	if (disk->fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (block >= disk->bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block, disk->bcount);
+		return -1;
+	}
+
+	if (!disk->nentries) {
+		iov.iov_base = (void *)buf;
+		iov.iov_len = disk->bsize;
+		pthread_mutex_lock(&disk->lock);
+		csum_begin(block, 1);
+		pthread_mutex_unlock(&disk->lock);
+		ret = disk_pwrite(block, buf);
+		pthread_mutex_lock(&disk->lock);
+		csum_end(block, 1, &iov, ret);
+		pthread_mutex_unlock(&disk->lock);
+		return ret;
+	}
+
+	pthread_mutex_lock(&disk->lock);
+
+	/* Whole blocks are written, so a miss never needs to read the disk */
+	e = cache_lookup(block);
+	if (e) {
+		disk->stats.hits++;
+		lru_unlink(e);
+		lru_push_front(e);
+	} else {
+		disk->stats.misses++;
+		e = cache_alloc(block);
+		if (!e) {
+			pthread_mutex_unlock(&disk->lock);
+			return -1;
+		}
+	}
+
+	memcpy(e->data, buf, disk->bsize);
+	e->dirty = 1;
+
+	pthread_mutex_unlock(&disk->lock);
+
+	return 0;
+}
+
+int block_read(size_t block, void *buf)
+{
+	struct cache_entry *e;
+	unsigned long wgen;
+
+	if (disk->fd == INVALID_FD) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (block >= disk->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk->bcount);
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (!disk->nentries)
+		return disk_pread(block, buf);
+
+	pthread_mutex_lock(&disk->lock);
+
+	e = cache_lookup(block);
+	if (e) {
+		disk->stats.hits++;
+		lru_unlink(e);
+		lru_push_front(e);
+		memcpy(buf, e->data, disk->bsize);
+		pthread_mutex_unlock(&disk->lock);
+		return 0;
+	}
+	disk->stats.misses++;
+	wgen = disk->wgen;
+
+	/* Misses are read without the lock, so that they proceed in parallel */
+	pthread_mutex_unlock(&disk->lock);
+	if (disk_pread(block, buf))
 		return -1;
+	pthread_mutex_lock(&disk->lock);
+
+	e = cache_lookup(block);
+	if (e) {
+		/* Cached in the meantime, with content at least as recent */
+		lru_unlink(e);
+		lru_push_front(e);
+		memcpy(buf, e->data, disk->bsize);
+	} else if (wgen == disk->wgen) {
+		e = cache_alloc(block);
+		if (e)
+			memcpy(e->data, buf, disk->bsize);
 	}
 
+	pthread_mutex_unlock(&disk->lock);
+
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+/* Check that @count blocks starting at @block can be accessed */
+static int check_run(size_t block, size_t count, const struct iovec *iov)
+{
+	size_t i;
+
+	if (disk->fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= disk->bcount || count > disk->bcount - block) {
+		block_error("block run out of bounds (%zu+%zu/%zu)",
+			    block, count, disk->bcount);
+		return -1;
+	}
+
+	if (count && !iov) {
+		block_error("invalid buffer array");
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (iov[i].iov_len != disk->bsize) {
+			block_error("buffer %zu is not one block long", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int block_writev(size_t block, size_t count, const struct iovec *iov)
+{
+	size_t i;
+	int ret;
+
+	if (check_run(block, count, iov))
+		return -1;
+
+	pthread_mutex_lock(&disk->lock);
+	for (i = 0; i < count; i++)
+		cache_refresh(block + i, iov[i].iov_base);
+	csum_begin(block, count);
+	pthread_mutex_unlock(&disk->lock);
+
+	ret = disk_pwritev(block, count, iov);
+
+	pthread_mutex_lock(&disk->lock);
+	for (i = 0; i < count; i++)
+		cache_settle(block + i, iov[i].iov_base, ret);
+	csum_end(block, count, iov, ret);
+	disk->wgen++;
+	pthread_mutex_unlock(&disk->lock);
+
+	return ret;
+}
+
+int block_readv(size_t block, size_t count, const struct iovec *iov)
+{
+	struct cache_entry *e;
+	size_t i = 0, n;
+	int ret = 0;
+
+	if (check_run(block, count, iov))
+		return -1;
+
+	/*
+	 * Runs go around the cache so that streaming through a large file does
+	 * not evict hot blocks, but cached copies are more recent than the
+	 * disk and take precedence. They are copied while the lock is held,
+	 * since a dirty copy evicted in the meantime would leave nothing but
+	 * the older content read from the disk.
+	 */
+	pthread_mutex_lock(&disk->lock);
+	while (i < count) {
+		e = cache_lookup(block + i);
+		if (e) {
+			memcpy(iov[i].iov_base, e->data, disk->bsize);
+			disk->stats.hits++;
+			i++;
+			continue;
+		}
+
+		/* Read the blocks up to the next cached one in a single call */
+		for (n = 1; i + n < count && !cache_lookup(block + i + n); n++)
+			;
+		disk->stats.misses += n;
+		pthread_mutex_unlock(&disk->lock);
+		ret = disk_preadv(block + i, n, &iov[i]);
+		pthread_mutex_lock(&disk->lock);
+		if (ret)
+			break;
+		i += n;
+	}
+	pthread_mutex_unlock(&disk->lock);
+
+	return ret;
+}
+
+int block_cache_flush(void)
+{
+	size_t i;
+	int ret = 0;
+
+	if (disk->fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (disk->map && msync(disk->map, disk->bcount * disk->bsize, MS_SYNC)) {
+		perror("msync");
+		return -1;
+	}
+
+	pthread_mutex_lock(&disk->lock);
+	for (i = 0; i < disk->nentries; i++)
+		if (disk->entries[i].valid && cache_writeback(&disk->entries[i]))
+			ret = -1;
+	/* The checksums of the blocks just written back come last */
+	if (csum_writeback())
+		ret = -1;
+	pthread_mutex_unlock(&disk->lock);
+
+	return ret;
+}
+
+int block_sync(void)
+{
+	if (block_cache_flush())
+		return -1;
+
+	/* A mapping was already synchronized by block_cache_flush() */
+	if (!disk->map && fdatasync(disk->fd)) {
+		perror("fdatasync");
+		return -1;
+	}
+
+	return 0;
+}
+
+int block_write_sync(size_t block, const void *buf)
+{
+	struct iovec iov;
+	uint32_t old = 0;
+	int ret = 0;
+
+	if (disk->fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= disk->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk->bcount);
+		return -1;
+	}
+
+	/*
+	 * Readers of the block from the disk wait until it matches the
+	 * checksum written ahead of it
+	 */
+	iov.iov_base = (void *)buf;
+	iov.iov_len = disk->bsize;
+	pthread_mutex_lock(&disk->lock);
+	if (block < disk->csum_start) {
+		old = disk->csums[block];
+		csum_begin(block, 1);
+		csum_update(block, buf);
+		ret = csum_writeback();
+	}
+	pthread_mutex_unlock(&disk->lock);
+	if (!ret && block < disk->csum_start && fdatasync(disk->fd)) {
+		perror("fdatasync");
+		ret = -1;
+	}
+
+	if (!ret)
+		ret = block_write(block, buf) || block_sync() ? -1 : 0;
+
+	pthread_mutex_lock(&disk->lock);
+	if (block < disk->csum_start) {
+		/* A failed write most likely left the block as it was */
+		if (ret) {
+			__atomic_store_n(&disk->csums[block], old,
+					 __ATOMIC_RELAXED);
+			disk->csum_dirty[block * sizeof(uint32_t) / disk->bsize] = 1;
+		}
+		csum_end(block, 1, &iov, ret);
+	}
+	pthread_mutex_unlock(&disk->lock);
+
+	return ret;
+}
+
+int block_prefetch(size_t block, size_t count)
 {
-	if (disk.fd == INVALID_FD) {
+	struct cache_entry *e;
+	struct iovec iov[PREFETCH_RUN];
+	char *buf = NULL;
+	unsigned long wgen;
+	size_t i, k, n;
+	int ret = 0;
+
+	if (disk->fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (block >= disk->bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block, disk->bcount);
+		return -1;
+	}
+
+	if (count > disk->bcount - block)
+		count = disk->bcount - block;
+
+	/* Leave at least half of the cache to the blocks actually in use */
+	if (count > disk->nentries / 2)
+		count = disk->nentries / 2;
+
+	if (count)
+		buf = malloc(PREFETCH_RUN * disk->bsize);
+	if (count && !buf)
+		return -1;
+
+	pthread_mutex_lock(&disk->lock);
+	for (i = 0; i < count; i += n) {
+		if (cache_lookup(block + i)) {
+			n = 1;
+			continue;
+		}
+
+		/* Each run of missing blocks is read with a single call */
+		for (n = 0; n < PREFETCH_RUN && i + n < count; n++) {
+			if (cache_lookup(block + i + n))
+				break;
+			iov[n].iov_base = buf + n * disk->bsize;
+			iov[n].iov_len = disk->bsize;
+		}
+		wgen = disk->wgen;
+		pthread_mutex_unlock(&disk->lock);
+		ret = disk_preadv(block + i, n, iov);
+		pthread_mutex_lock(&disk->lock);
+		if (ret)
+			break;
+
+		/* Blocks cached or written in the meantime are more recent */
+		for (k = 0; k < n && wgen == disk->wgen; k++) {
+			if (cache_lookup(block + i + k))
+				continue;
+			e = cache_alloc(block + i + k);
+			if (!e)
+				break;
+			memcpy(e->data, iov[k].iov_base, disk->bsize);
+			disk->stats.readahead++;
+		}
+	}
+	pthread_mutex_unlock(&disk->lock);
+
+	free(buf);
+
+	return ret;
+}
+
+void *block_ptr(size_t block)
+{
+	if (disk->fd == INVALID_FD || !disk->map || block >= disk->bcount)
+		return NULL;
+
+	return disk->map + block * disk->bsize;
+}
+
+int block_cache_set_size(size_t nblocks)
+{
+	if (disk->fd != INVALID_FD) {
+		block_error("cannot resize the cache of an open disk");
+		return -1;
+	}
+
+	disk->cache_size = nblocks;
+
+	return 0;
+}
+
+int block_cache_stats(struct block_cache_stats *stats)
+{
+	if (disk->fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (!stats) {
+		block_error("invalid stats buffer");
+		return -1;
+	}
+
+	pthread_mutex_lock(&disk->lock);
+	*stats = disk->stats;
+	pthread_mutex_unlock(&disk->lock);
+
+	return 0;
+}
+
+int block_checksum_create(size_t start, size_t count)
+{
+	uint32_t crc;
+	char *zero;
+	size_t i;
+
+	if (csum_create(start, count))
+		return -1;
+
+	zero = calloc(1, disk->bsize);
+	if (!zero) {
+		block_error("cannot allocate checksum area");
+		csum_destroy();
+		return -1;
+	}
+	crc = crc32c(0, zero, disk->bsize);
+	free(zero);
+
+	for (i = 0; i < start; i++)
+		disk->csums[i] = crc;
+	memset(disk->csum_dirty, 1, count);
+	disk->csum_start = start;
+
+	return 0;
+}
+
+int block_checksum_enable(size_t start, size_t count)
+{
+	struct cache_entry *e;
+	size_t i;
+	int ret = 0;
+
+	if (csum_create(start, count))
+		return -1;
+
+	/* Blocks of the area are read as is, checksums being off until then */
+	for (i = 0; i < count; i++) {
+		if (disk_pread(start + i, (char *)disk->csums + i * disk->bsize)) {
+			csum_destroy();
+			return -1;
+		}
+	}
+	disk->csum_start = start;
+
+	/* Cached blocks were read without being checked */
+	pthread_mutex_lock(&disk->lock);
+	for (i = 0; i < disk->nentries; i++) {
+		e = &disk->entries[i];
+		if (!e->valid || e->dirty || e->block >= start ||
+		    disk->csum_lenient ||
+		    crc32c(0, e->data, disk->bsize) == disk->csums[e->block])
+			continue;
+		block_error("block %zu does not match its checksum", e->block);
+		disk->stats.corrupt++;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&disk->lock);
+
+	if (ret)
+		csum_destroy();
+
+	return ret;
+}
+
+int block_checksum_lenient(int on)
+{
+	if (disk->fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	pthread_mutex_lock(&disk->lock);
+	disk->csum_lenient = on;
+	pthread_mutex_unlock(&disk->lock);
+
+	return 0;
+}
+
+int block_size_set(size_t size)
+{
+	if (size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX ||
+	    (size & (size - 1))) {
+		block_error("invalid block size %zu", size);
+		return -1;
+	}
+
+	disk->bsize_choice = size;
+
+	return 0;
+}
+
+int block_size(void)
+{
+	if (disk->fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	return disk->bsize;
+}
+
+int block_engine_set(int engine)
+{
+	if (disk->fd != INVALID_FD) {
+		block_error("cannot change the engine of an open disk");
+		return -1;
+	}
+
+	if (engine < BLOCK_ENGINE_SYNC || engine > BLOCK_ENGINE_AUTO) {
+		block_error("invalid engine '%d'", engine);
+		return -1;
+	}
+
+	disk->engine_choice = engine;
+
+	return 0;
+}
+
+int block_engine(void)
+{
+	if (disk->fd == INVALID_FD) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return disk->engine ? disk->engine->id : BLOCK_ENGINE_SYNC;
+}
+
+static int block_queue(size_t block, void *buf, int write)
+{
+	struct block_request *req;
+	struct cache_entry *e;
+	size_t cap;
+
+	if (disk->fd == INVALID_FD) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (block >= disk->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk->bcount);
 		return -1;
 	}
 
+	/* Without an engine, or for cached blocks, there is nothing to wait */
+	pthread_mutex_lock(&disk->lock);
+	e = cache_lookup(block);
+	if (disk->engine && !e)
+		disk->stats.misses++;
+	pthread_mutex_unlock(&disk->lock);
+	if (!disk->engine || e)
+		return write ? block_write(block, buf) : block_read(block, buf);
+
+	if (nqueued == queue_cap) {
+		cap = queue_cap ? 2 * queue_cap : URING_ENTRIES;
+		req = realloc(queue, cap * sizeof(*req));
+		if (!req) {
+			block_error("cannot queue request");
+			return -1;
+		}
+		queue = req;
+		queue_cap = cap;
+	}
+
+	req = &queue[nqueued++];
+	req->block = block;
+	req->write = write;
+	req->iov.iov_base = buf;
+	req->iov.iov_len = disk->bsize;
+	req->result = 0;
+
 	return 0;
 }
+
+int block_queue_read(size_t block, void *buf)
+{
+	return block_queue(block, buf, 0);
+}
+
+int block_queue_write(size_t block, const void *buf)
+{
+	return block_queue(block, (void *)buf, 1);
+}
+
+int block_submit(void)
+{
+	size_t i, writes = 0;
+	int ret = 0;
+
+	if (disk->fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (!nqueued)
+		return 0;
+
+	/* Queued writes go around the cache, just like block_writev() */
+	pthread_mutex_lock(&disk->lock);
+	for (i = 0; i < nqueued; i++) {
+		if (queue[i].write) {
+			cache_refresh(queue[i].block, queue[i].iov.iov_base);
+			csum_begin(queue[i].block, 1);
+			writes++;
+		}
+	}
+	pthread_mutex_unlock(&disk->lock);
+
+	pthread_mutex_lock(&disk->engine_lock);
+	disk->engine->run(queue, nqueued);
+	pthread_mutex_unlock(&disk->engine_lock);
+
+	if (writes) {
+		pthread_mutex_lock(&disk->lock);
+		for (i = 0; i < nqueued; i++) {
+			if (!queue[i].write)
+				continue;
+			cache_settle(queue[i].block, queue[i].iov.iov_base,
+				     queue[i].result);
+			csum_end(queue[i].block, 1, &queue[i].iov,
+				 queue[i].result);
+		}
+		disk->wgen++;
+		pthread_mutex_unlock(&disk->lock);
+	}
+
+	for (i = 0; i < nqueued; i++) {
+		if (!queue[i].result && !queue[i].write)
+			queue[i].result = csum_check(queue[i].block,
+						     queue[i].iov.iov_base);
+		if (queue[i].result)
+			ret = -1;
+	}
+	nqueued = 0;
+
+	return ret;
+}
@@ -2,23 +2,150 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
-/** Size of a disk block in bytes */
+/** Default size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Range of block sizes, powers of two in between */
+#define BLOCK_SIZE_MIN 1024
+#define BLOCK_SIZE_MAX 65536
+
+/** Default number of blocks held by the buffer cache */
+#define BLOCK_CACHE_DEFAULT 256
+
+/** Disk backends */
+/* Blocks are read and written with positional file I/O */
+#define BLOCK_BACKEND_FD 0
+/* The whole disk file is mapped in memory */
+#define BLOCK_BACKEND_MMAP 1
+
+/** Ways to create a disk file */
+/* Blocks take space in the file once written */
+#define BLOCK_CREATE_SPARSE 0
+/* The space of all the blocks is reserved when the file is created */
+#define BLOCK_CREATE_PREALLOC 1
+
+/** Asynchronous engines */
+/* No engine: queued requests are performed right away */
+#define BLOCK_ENGINE_SYNC 0
+/* Requests are submitted in batches to an io_uring instance */
+#define BLOCK_ENGINE_IO_URING 1
+/* Requests are spread over a pool of threads doing blocking I/O */
+#define BLOCK_ENGINE_THREADS 2
+/* io_uring if the kernel allows it, the thread pool otherwise */
+#define BLOCK_ENGINE_AUTO 3
+
+/** Buffer cache counters */
+struct block_cache_stats {
+	/* Accesses served from the cache */
+	size_t hits;
+	/* Accesses that had to allocate a cache entry */
+	size_t misses;
+	/* Dirty blocks written back to the disk */
+	size_t writebacks;
+	/* Valid entries recycled to make room for other blocks */
+	size_t evictions;
+	/* Blocks brought in ahead of use by block_prefetch() */
+	size_t readahead;
+	/* Blocks read from the disk that did not match their checksum */
+	size_t corrupt;
+};
+
+/** Virtual disk instance */
+struct disk;
+
+/**
+ * block_disk_new - Create a virtual disk instance
+ *
+ * All the other functions act on the instance selected by the calling thread
+ * with block_disk_select(), or on a default instance if it selected none. Each
+ * instance has its own virtual disk file, buffer cache and engine, so that
+ * several disks can be open at once.
+ *
+ * Return: NULL if out of memory, otherwise a new instance with no virtual disk
+ * file open.
+ */
+struct disk *block_disk_new(void);
+
+/**
+ * block_disk_free - Destroy a virtual disk instance
+ * @d: Instance created by block_disk_new()
+ *
+ * Return: -1 if @d is invalid or still has a virtual disk file open. 0
+ * otherwise.
+ */
+int block_disk_free(struct disk *d);
+
+/**
+ * block_disk_select - Select the virtual disk instance of the calling thread
+ * @d: Instance to act on, NULL for the default instance
+ *
+ * Return: the instance selected before, NULL for the default instance.
+ */
+struct disk *block_disk_select(struct disk *d);
+
+/**
+ * block_disk_create - Create virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @count: Number of blocks of the disk
+ *
+ * Create virtual disk file @diskname, holding @count blocks filled with zeroes,
+ * or empty it if it exists. Blocks are of the size set by block_size_set(), and
+ * only take space in the file once written. The disk is not opened.
+ *
+ * Return: -1 if @diskname is invalid, or if the virtual disk file cannot be
+ * created. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t count);
+
+/**
+ * block_disk_create_mode - Create virtual disk file in a given way
+ * @diskname: Name of the virtual disk file
+ * @count: Number of blocks of the disk
+ * @mode: %BLOCK_CREATE_SPARSE or %BLOCK_CREATE_PREALLOC
+ *
+ * Same as block_disk_create(), but select how the space of the blocks is
+ * obtained. With %BLOCK_CREATE_PREALLOC, it is reserved in the host file system
+ * right away, so that writing the disk later cannot run out of space and finds
+ * the file laid out in as few extents as the host file system can manage.
+ * block_disk_create() uses %BLOCK_CREATE_SPARSE.
+ *
+ * Return: -1 if @diskname or @mode is invalid, or if the virtual disk file
+ * cannot be created or its space reserved. 0 otherwise.
+ */
+int block_disk_create_mode(const char *diskname, size_t count, int mode);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
  *
  * Open virtual disk file @diskname. A virtual disk file must be opened before
  * blocks can be read from it with block_read() or written to it with
- * block_write().
+ * block_write(). Once the disk is open, blocks can be accessed from several
+ * threads at once, until block_disk_close().
  *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_backend - Open virtual disk file with a given backend
+ * @diskname: Name of the virtual disk file
+ * @backend: %BLOCK_BACKEND_FD or %BLOCK_BACKEND_MMAP
+ *
+ * Same as block_disk_open(), but select how blocks are accessed. With
+ * %BLOCK_BACKEND_MMAP, the whole virtual disk file is mapped in memory:
+ * block_read() and block_write() become plain copies from and into the
+ * mapping, the buffer cache is not used, and block_ptr() gives direct access to
+ * the blocks. block_disk_open() uses %BLOCK_BACKEND_FD.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, or is already open. 0 otherwise.
+ */
+int block_disk_open_backend(const char *diskname, int backend);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -39,7 +166,7 @@ int block_disk_count(void);
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
+ * Write the content of buffer @buf (one block) in the virtual disk's
  * block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
@@ -52,7 +179,7 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
+ * Read the content of virtual disk's block @block (one block) into
  * buffer @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
@@ -60,5 +187,274 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_writev - Write a run of consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @iov: Array of @count buffers of one block each
+ *
+ * Write buffer @iov[i] in the virtual disk's block @block + i, for every i
+ * below @count, using a single positional vectored write. Unlike
+ * block_write(), the blocks are written through to the disk file.
+ *
+ * Return: -1 if the run is out of bounds or inaccessible, if a buffer is not
+ * one block long, or if the writing operation fails. 0 otherwise.
+ */
+int block_writev(size_t block, size_t count, const struct iovec *iov);
+
+/**
+ * block_readv - Read a run of consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @iov: Array of @count buffers of one block each
+ *
+ * Read the content of virtual disk's block @block + i into buffer @iov[i], for
+ * every i below @count, using a single positional vectored read.
+ *
+ * Return: -1 if the run is out of bounds or inaccessible, if a buffer is not
+ * one block long, or if the reading operation fails. 0 otherwise.
+ */
+int block_readv(size_t block, size_t count, const struct iovec *iov);
+
+/**
+ * block_prefetch - Read blocks ahead of use
+ * @block: Index of the first block to prefetch
+ * @count: Number of blocks to prefetch
+ *
+ * Bring the blocks @block to @block + @count - 1 into the buffer cache, reading
+ * each run of blocks that are not cached yet with a single vectored read, so
+ * that later accesses to them are served from memory. At most half of the
+ * cache is used, and the run is cut at the end of the disk. Without a buffer
+ * cache, nothing is read.
+ *
+ * Return: -1 if there was no virtual disk file opened, if @block is out of
+ * bounds, or if the reading operation fails. 0 otherwise.
+ */
+int block_prefetch(size_t block, size_t count);
+
+/**
+ * block_ptr - Get direct access to a block
+ * @block: Index of the block
+ *
+ * With the %BLOCK_BACKEND_MMAP backend, return the address where block @block
+ * of the virtual disk is mapped. The block at that address can be
+ * read and modified in place, and consecutive blocks are contiguous in memory.
+ * The address stays valid until the virtual disk file is closed.
+ *
+ * Return: NULL if there was no virtual disk file opened, if it was not opened
+ * with %BLOCK_BACKEND_MMAP, or if @block is out of bounds. The block's address
+ * otherwise.
+ */
+void *block_ptr(size_t block);
+
+/**
+ * block_cache_flush - Write back dirty cached blocks
+ *
+ * Write every modified block held by the buffer cache to the virtual disk
+ * file. Blocks remain cached. The cache is also flushed by block_disk_close().
+ * With the %BLOCK_BACKEND_MMAP backend, synchronize the mapping with the
+ * virtual disk file instead.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if a block cannot be
+ * written back. 0 otherwise.
+ */
+int block_cache_flush(void);
+
+/**
+ * block_sync - Make written blocks durable
+ *
+ * Flush the buffer cache like block_cache_flush(), then wait until every block
+ * written so far has reached stable storage.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if a block cannot be
+ * written back or synchronized. 0 otherwise.
+ */
+int block_sync(void);
+
+/**
+ * block_write_sync - Write a block to disk durably, its checksum first
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Same as block_write() followed by block_sync(), except that on a checksummed
+ * disk the checksum of @buf reaches stable storage before @buf does. A crash in
+ * between leaves @block as it was, with the checksum of what was to be written:
+ * meant for a block that tells how to recover from what it held before, such as
+ * a superblock pointing to a journal.
+ *
+ * Return: -1 if @block is out of bounds or inaccessible, or if a block cannot
+ * be written back or synchronized. 0 otherwise.
+ */
+int block_write_sync(size_t block, const void *buf);
+
+/**
+ * block_cache_set_size - Configure the buffer cache
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Set the capacity of the write-back buffer cache that sits under block_read()
+ * and block_write(). The new capacity applies to the next virtual disk file
+ * opened by the selected instance. A capacity of 0 disables the cache, so that
+ * every access goes straight to the disk file. The default capacity is
+ * %BLOCK_CACHE_DEFAULT blocks.
+ *
+ * Return: -1 if a virtual disk file is currently open. 0 otherwise.
+ */
+int block_cache_set_size(size_t nblocks);
+
+/**
+ * block_cache_stats - Get buffer cache counters
+ * @stats: Structure to be filled with the counters
+ *
+ * Counters are reset every time a virtual disk file is opened.
+ *
+ * Return: -1 if there was no virtual disk file opened or if @stats is NULL. 0
+ * otherwise.
+ */
+int block_cache_stats(struct block_cache_stats *stats);
+
+/**
+ * block_checksum_create - Start checksumming the blocks of a new disk
+ * @start: Index of the first block of the checksum area
+ * @count: Number of blocks of the checksum area
+ *
+ * Same as block_checksum_enable(), on a disk whose blocks below @start all hold
+ * zeroes, as block_disk_create() leaves them: the area is filled in without
+ * reading them, and written by the next block_cache_flush().
+ *
+ * Return: -1 if there was no virtual disk file opened, if it was opened with
+ * %BLOCK_BACKEND_MMAP, if the area is out of bounds or too small, or if out of
+ * memory. 0 otherwise.
+ */
+int block_checksum_create(size_t start, size_t count);
+
+/**
+ * block_checksum_enable - Start checksumming the blocks of the disk
+ * @start: Index of the first block of the checksum area
+ * @count: Number of blocks of the checksum area
+ *
+ * Load the checksum area, blocks @start to @start + @count - 1, which holds
+ * the CRC32C of each block below @start as a 32-bit word. From then on until
+ * the disk is closed, every block read from the virtual disk file is checked
+ * against its checksum, whichever function reads it, and every block written
+ * to it gets its checksum updated. A block that does not match makes the read
+ * fail, and is counted in the corrupt blocks of block_cache_stats(). Blocks
+ * already cached are checked right away, unless modified.
+ *
+ * The area is kept in memory and written back along with the dirty blocks of
+ * the cache by block_cache_flush(): blocks written since the last flush may not
+ * match their checksum after a crash, which block_write_sync() and
+ * block_checksum_lenient() help recover from. Blocks of the area must not be
+ * accessed otherwise. The %BLOCK_BACKEND_MMAP backend gives direct access to
+ * the blocks, which the checksums would not follow, and cannot be used.
+ *
+ * Return: -1 if there was no virtual disk file opened, if it was opened with
+ * %BLOCK_BACKEND_MMAP, if the area is out of bounds or too small, if it cannot
+ * be read, or if a cached block does not match its checksum. 0 otherwise.
+ */
+int block_checksum_enable(size_t start, size_t count);
+
+/**
+ * block_checksum_lenient - Let blocks that fail their checksum be read
+ * @on: 1 to read them as they are, 0 to make their reads fail again
+ *
+ * While on, a block that does not match its checksum is read as it is instead
+ * of making the read fail, and is not counted corrupt. Neither are the cached
+ * blocks checked by block_checksum_enable(). Meant for recovering from a crash,
+ * which may leave blocks written without their checksums: the caller writes
+ * the blocks it read this way again, bringing their checksums up to date. It
+ * is off whenever a disk is opened.
+ *
+ * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ */
+int block_checksum_lenient(int on);
+
+/**
+ * block_size_set - Set the block size
+ * @size: Block size in bytes
+ *
+ * Set the size of the blocks of the next virtual disk file created or opened,
+ * %BLOCK_SIZE by default. The size of the virtual disk file must be a multiple
+ * of it. Buffers given to the other functions hold one block of that size.
+ *
+ * Return: -1 if @size is not a power of two between %BLOCK_SIZE_MIN and
+ * %BLOCK_SIZE_MAX. 0 otherwise.
+ */
+int block_size_set(size_t size);
+
+/**
+ * block_size - Get disk's block size
+ *
+ * Return: -1 if there was no virtual disk file opened, otherwise the size in
+ * bytes of the blocks of the currently open disk.
+ */
+int block_size(void);
+
+/**
+ * block_engine_set - Select the asynchronous engine
+ * @engine: One of the %BLOCK_ENGINE_* values
+ *
+ * Select the engine that performs the requests queued with block_queue_read()
+ * and block_queue_write(). The engine applies to the next virtual disk file
+ * opened by the selected instance; a disk opened with %BLOCK_BACKEND_MMAP
+ * never uses an engine. The default is %BLOCK_ENGINE_SYNC.
+ *
+ * Return: -1 if a virtual disk file is currently open or if @engine is
+ * invalid. 0 otherwise.
+ */
+int block_engine_set(int engine);
+
+/**
+ * block_engine - Get the asynchronous engine in use
+ *
+ * Return: -1 if there was no virtual disk file opened. Otherwise, the
+ * %BLOCK_ENGINE_* value of the engine serving the currently open disk: never
+ * %BLOCK_ENGINE_AUTO, and %BLOCK_ENGINE_SYNC if there is none.
+ */
+int block_engine(void);
+
+/**
+ * block_queue_read - Queue the read of a block
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Queue a request to read virtual disk's block @block (one block) into
+ * buffer @buf. The request is only guaranteed to be complete once
+ * block_submit() returns, and @buf must not be accessed until then. Blocks
+ * held by the buffer cache, and all blocks when there is no asynchronous
+ * engine, are read right away. A batch of requests should not access the same
+ * block more than once.
+ *
+ * Return: -1 if @block is out of bounds or inaccessible, or if the request
+ * cannot be queued. 0 otherwise.
+ */
+int block_queue_read(size_t block, void *buf);
+
+/**
+ * block_queue_write - Queue the write of a block
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Queue a request to write the content of buffer @buf (one block) in
+ * the virtual disk's block @block. As for block_queue_read(), @buf must be left
+ * untouched until block_submit() returns.
+ *
+ * Return: -1 if @block is out of bounds or inaccessible, or if the request
+ * cannot be queued. 0 otherwise.
+ */
+int block_queue_write(size_t block, const void *buf);
+
+/**
+ * block_submit - Perform queued requests
+ *
+ * Hand every queued request to the asynchronous engine in batches that keep
+ * many of them in flight at once, and wait until they have all completed.
+ * Each thread has its own queue, and the engine performs the batches of
+ * different threads one after the other.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if any of the
+ * requests failed. 0 otherwise.
+ */
+int block_submit(void);
+
 #endif /* _DISK_H */
 
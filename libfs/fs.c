@@ -4,11 +4,19 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <math.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include "disk.h"
 #include "fs.h"
-#define BLOCK_SIZE 4096
-#define FAT_EOC 0xFFFF
+#include "lz.h"
+// End of a chain, as returned by fat_get() whatever the format
+#define FAT_EOC (-1)
+// End of a chain in a version 1 FAT
+#define FAT16_EOC 0xFFFF
 // -- Structs -- //
 /* Here are the structures for the blocks to hold metadata */
 struct __attribute__((packed)) superblock {
@@ -18,487 +26,4543 @@ struct __attribute__((packed)) superblock {
 	uint16_t data_block_start_index;
 	uint16_t amount_of_data_blocks;
 	uint8_t num_of_blocks_for_FAT;
-	uint8_t padding[4079];
+	// Metadata journal, in what was padding: JOURNAL_MAGIC if there is one,
+	// FAT index of its first block and its number of blocks, then sequence
+	// number and journal block of the first transaction to replay
+	uint32_t journal_magic;
+	uint16_t journal_start;
+	uint16_t journal_blocks;
+	uint32_t journal_seq;
+	uint16_t journal_tail;
+	uint8_t padding[4065];
 };
+// Superblock of a version 2 file system, told apart by its signature: block
+// numbers are 32-bit, and so are FAT entries
+struct __attribute__((packed)) superblock2 {
+	uint8_t signature[8];
+	uint32_t total_blocks_on_disk;
+	uint32_t root_dir_index;
+	uint32_t data_block_start_index;
+	uint32_t amount_of_data_blocks;
+	uint32_t num_of_blocks_for_FAT;
+	uint32_t journal_magic;
+	uint32_t journal_start;
+	uint32_t journal_blocks;
+	uint32_t journal_seq;
+	uint32_t journal_tail;
+	// Size of the blocks in bytes, BLOCK_SIZE if 0
+	uint32_t block_size;
+	// Optional features, FEATURE_* bits. A file system with a feature this
+	// driver does not know is not mounted
+	uint32_t features;
+	// With FEATURE_CHECKSUM, first block and number of blocks of the
+	// checksum area. Padding follows up to the end of the block
+	uint32_t checksum_start;
+	uint32_t checksum_blocks;
+};
+// Files of up to half a block are packed together in fragment blocks
+#define FEATURE_PACKED 0x1
+// The content of files is compressed, in clusters of CLUSTER_BYTES
+#define FEATURE_COMPRESSED 0x2
+// Each block before the checksum area, at the end of the disk, has its CRC32C
+// there
+#define FEATURE_CHECKSUM 0x4
+#define FEATURES_KNOWN (FEATURE_PACKED | FEATURE_COMPRESSED | FEATURE_CHECKSUM)
+#define CLUSTER_BYTES LZ_MAX_INPUT
+#define FS_SIGNATURE "ECS150FS"
+#define FS_SIGNATURE2 "ECS150F2"
 typedef struct __attribute__((packed)) root_file_entry {
 	uint8_t filename[16];
 	uint32_t filesize;
 	uint16_t first_data_block_index;
 	uint8_t padding[10];
 } file_entry;
+// Root directory entry of a version 2 file system, of the same size
+typedef struct __attribute__((packed)) root_file_entry2 {
+	uint8_t filename[16];
+	uint64_t filesize;
+	uint32_t first_data_block_index;
+	// ENTRY_FILE or ENTRY_DIR
+	uint8_t type;
+	// For a packed file, unit of fragment block @first_data_block_index its
+	// content starts at. 0 otherwise
+	uint8_t frag;
+	uint8_t padding[2];
+} file_entry2;
+#define ENTRY_FILE 0
+#define ENTRY_DIR 1
 struct __attribute__((packed)) root_dir {
 	file_entry dir[128]; //this is the array of 128 entries holding the files
 };
-struct filesystem {
-	struct superblock *fs_superblock; // This is the superblock
-	uint16_t *fs_FAT; // This is the FAT
-	struct root_dir *fs_root_dir;  // This is the root directory
+// In-core map from the logical blocks of a file to their FAT index
+struct block_map {
+	// Set 1 once the map covers the file's whole FAT chain
+	int valid;
+	// FAT index of each logical block
+	int *blocks;
+	// Number of mapped blocks and room in @blocks
+	int nblocks;
+	int cap;
+	// Number of file descriptors open on the file
+	int users;
+	// On a compressed file system, set 1 once the table of clusters of the
+	// file is loaded: where each full cluster starts in its chain, counted
+	// from the end of the table (entry @nclusters being where the last one
+	// ends), and the number of blocks the table takes
+	int cluster_loaded;
+	int *clusters;
+	int nclusters;
+	int cluster_cap;
+	int table_blocks;
+	// Bumped by each write, so that descriptors tell the cluster they
+	// decompressed last is out of date
+	unsigned int cluster_gen;
+};
+// In-core state of the metadata journal
+struct journal {
+	// Set 1 if metadata updates go through the journal
+	int on;
+	// Set 1 if the disk has a journal, FAT index of its first block and
+	// its number of blocks
+	int present;
+	int start;
+	int nblocks;
+	// Journal block where the next transaction starts, and number of blocks
+	// written since the last checkpoint
+	int head;
+	int used;
+	// Sequence number of the next transaction
+	uint32_t seq;
+	// FAT entries and root entries updated since the last commit, a bit is
+	// set if updated
+	uint64_t *fat_pending;
+	int fat_count;
+	uint64_t root_pending[FS_FILE_MAX_COUNT / 64];
+	// Set 1 after a commit failed, the next one is then a checkpoint
+	int failed;
+	// Set 1 while mounting a checksummed disk recovers from a crash, which
+	// may have left metadata in place without its checksums: it is read
+	// whether it matches them or not, and all of it is written again
+	int recover;
 };
 typedef struct filedescriptor {
+	// Held while the descriptor is used
+	pthread_mutex_t lock;
 	// Open flag, set 1 if fd is open 0 if closed
 	uint8_t open;
 	// Current offset
 	size_t file_offset;
-	// Root directory index
+	// Id of the file
 	int root_index;
 	// Name of the file
 	uint8_t filename[16];
+	// Cursor left by the last FAT walk, so the next one can resume from it:
+	// logical block number in the file (-1 if unset) and its FAT index
+	int cursor_block;
+	int cursor_fat;
+	// Readahead state: offset a sequential read would start at, window size
+	// in blocks, and first logical block not prefetched yet
+	size_t ra_next;
+	int ra_window;
+	int ra_block;
+	// Write-behind buffer of @wb_size bytes (NULL if disabled), holding
+	// @wb_len bytes still to be written at file offset @wb_start
+	uint8_t *wb_buf;
+	size_t wb_size;
+	size_t wb_start;
+	size_t wb_len;
+	// Set 1 if pending bytes could not be written out, until reported
+	int wb_error;
+	// Room of @bounce_size bytes for the blocks a transfer bounces
+	uint8_t *bounce;
+	size_t bounce_size;
+	// On a compressed file system, room for the cluster decompressed last
+	// (NULL otherwise), its index (SIZE_MAX if none) and the cluster_gen of
+	// the file it is up to date with
+	uint8_t *cl_buf;
+	size_t cl_index;
+	unsigned int cl_gen;
 } filedes;
+// In-core state of a file of a subdirectory while it is open: the data block
+// and slot its entry is in, and a copy of the entry. Files are told apart by
+// an id, which is their root index for the files of the root directory, and
+// FS_FILE_MAX_COUNT plus the index of their node for the others
+struct node {
+	int block;
+	int slot;
+	file_entry2 entry;
+};
+#define NODE_COUNT (FS_FILE_MAX_COUNT + FS_OPEN_MAX_COUNT)
+// Block map of a directory, by the FAT index of its first block
+struct dir_map {
+	int first;
+	int *blocks;
+	int nblocks;
+};
+// Number of directories whose block map is kept
+#define DIR_MAPS 16
+// With a journal, a directory block updated since the last commit: its FAT
+// index, whether it was started anew or freed since, the slots updated since,
+// a bit set each, and its content. It reaches the disk once the commit makes
+// the updates durable
+struct dir_update {
+	struct dir_update *next;
+	int block;
+	int fresh;
+	int freed;
+	uint64_t *pending;
+	uint8_t *data;
+};
+// Buckets of the directory blocks updated, by FAT index
+#define DIR_UPDATE_BUCKETS 256
+// Fragment block, and the units of it in use once its header has been read
+struct frag_block {
+	int block;
+	int loaded;
+	uint64_t used;
+};
+// Buckets of the file name index, a power of two
+#define NAME_INDEX_SIZE (2 * FS_FILE_MAX_COUNT)
+struct filesystem {
+	struct superblock *fs_superblock; // This is the superblock
+	uint8_t *fs_FAT; // This is the FAT, in its on-disk layout
+	struct root_dir *fs_root_dir;  // This is the root directory
+	// Format version (1 or 2), its optional features, and layout of the disk
+	int version;
+	int features;
+	int block_size;
+	int fat_blocks;
+	int fat_per_block;
+	int root_block;
+	int root_blocks;
+	int data_blocks;
+	// Set 1 if the metadata above points straight into the mapped disk
+	int mapped;
+	// Free-space bitmap over the data blocks, a bit is set if in use
+	uint8_t *used_map;
+	// Number of free data blocks
+	int free_count;
+	// Next-fit rotor: where the next search for free blocks starts
+	int rotor;
+	// Block maps shared by all descriptors of a file, by file id
+	struct block_map maps[NODE_COUNT];
+	// Files of subdirectories that are open, a node is in use while its
+	// block map has users
+	struct node nodes[FS_OPEN_MAX_COUNT];
+	// Block maps of the directories used last, the next one to evict, and
+	// a block of room to look at directories
+	struct dir_map dir_maps[DIR_MAPS];
+	int dir_map_next;
+	uint8_t *dir_buf;
+	// A block of room to update directory entries, used with alloc_lock
+	// held
+	uint8_t *entry_buf;
+	// Directory blocks updated and not written in place yet, and their
+	// number
+	struct dir_update *dir_updates[DIR_UPDATE_BUCKETS];
+	int ndir_updates;
+	// Fragment blocks in the order of their chain, room for them, and where
+	// the next search for free units starts
+	struct frag_block *frags;
+	int nfrags;
+	int frag_cap;
+	int frag_rotor;
+	// A block of room to update fragment blocks, and another to put together
+	// the content of a packed file, used with frag_lock held for writing
+	uint8_t *frag_buf;
+	uint8_t *pack_buf;
+	// Memory used by the block maps, in bytes
+	size_t map_bytes;
+	// Open-addressing hash index from file names to root indexes, -1 marks
+	// an empty bucket
+	int16_t name_index[NAME_INDEX_SIZE];
+	// Free root directory entries, a bit is set if the entry is free
+	uint64_t free_slots[FS_FILE_MAX_COUNT / 64];
+	// FAT blocks and root directory modified since they were last written,
+	// a FAT block is dirty if its byte is set
+	uint8_t *fat_dirty;
+	int root_dirty;
+	struct journal journal;
+	// Held for reading while packed files are read, and for writing while
+	// they are written or fragment blocks updated
+	pthread_rwlock_t frag_lock;
+	// Held while allocating blocks or updating the FAT and root directory
+	pthread_mutex_t alloc_lock;
+	// Held while using the directory blocks updated, which are only updated
+	// with alloc_lock held too
+	pthread_mutex_t dir_lock;
+	// Held for reading while a file is read or its size looked at, and for
+	// writing while it is written, by file id
+	pthread_rwlock_t file_locks[NODE_COUNT];
+	// Serializes fs_sync() calls
+	pthread_mutex_t sync_lock;
+	// Background flusher: set 1 while its thread runs, and 1 to stop it
+	pthread_t flusher;
+	int flusher_on;
+	int flusher_quit;
+	unsigned int flusher_ms;
+	pthread_mutex_t flusher_lock;
+	pthread_cond_t flusher_cond;
+	// Disk instance the file system is on
+	struct disk *disk;
+	// Held while using the descriptor table, the name index, the free root
+	// entries, the nodes, the directories or the memory budget of the block
+	// maps
+	pthread_mutex_t table_lock;
+	filedes filedes_table[FS_OPEN_MAX_COUNT];
+};
+// A file system, mounted or not. Locks are taken in this order: the lock of
+// the handle, of a descriptor, of its file, table_lock, frag_lock, alloc_lock,
+// then dir_lock.
+struct fs_handle {
+	// Held shared by the entry points, and exclusively while the file system
+	// comes and goes
+	pthread_rwlock_t lock;
+	struct filesystem *fs;
+	// Disk instance it is mounted from, NULL for the default one
+	struct disk *disk;
+};
 // -- Static Vars -- //
-static struct filesystem *fs;
-static filedes filedes_table[FS_OPEN_MAX_COUNT];
+// File system the calling thread works on, set by the entry points
+static __thread struct filesystem *fs;
+// File system used by the functions that take no handle
+static struct fs_handle default_handle = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+};
 
-int fs_mount(const char *diskname)
-{
-	// Is the disk already mounted/open?
-	if(block_disk_open(diskname) == -1) return -1;
-	// Allocate new superblock struct to hold metainformation
-	struct superblock *new_superblock = malloc(sizeof(struct superblock));
-	// Grab the superblock at index 0 of disk
-	block_read(0, new_superblock);
-	// Check the signature of the disk
-	char correct_fs_sig[9] = "ECS150FS";
-	char disk_sig[9];
-	for(int i = 0; i < 8; i++) disk_sig[i] = new_superblock->signature[i];
-	if(strcmp(disk_sig, correct_fs_sig)) return -1; // Invalid disk signature
-	// Allocate enough space for the FAT array
-	int fat_size = (new_superblock->num_of_blocks_for_FAT * BLOCK_SIZE);
-	uint16_t *new_fat = malloc(fat_size);
-	// Read the FAT data in
-	for (int i = 1; i <= new_superblock->num_of_blocks_for_FAT; i++){
-		// We have 4096/2 fs_fat entries per block
-		// Make a 4096 byte buffer and fill it with read data
-		uint16_t buf[BLOCK_SIZE/2];
-		block_read(i, &buf);
-		int offset = (i-1)*(BLOCK_SIZE/2);
-		for (int j = 0; j < BLOCK_SIZE/2; j++) {
-			new_fat[j+offset] = buf[j];
-		}
-
-	}
-	// Allocate a new root directory
-	struct root_dir *new_root_dir = malloc(sizeof(struct root_dir));
-	// Get root directory index
-	int root_start = new_superblock->root_dir_index;
-	// Read in the root directory
-	block_read(root_start, new_root_dir);
-	// Allocate file system structure to preserve changes:
-	fs = malloc(sizeof(struct filesystem));
-	fs->fs_superblock = new_superblock;
-	fs->fs_FAT = new_fat;
-	fs->fs_root_dir = new_root_dir;
+static int wb_flush(int fd);
+static size_t file_size(int rootindex);
+static int fat_get(int index);
+static int root_first(int rootindex);
+static int root_frag(int rootindex);
+static int dir_read(int block, uint8_t *buf);
+static int dir_write(int block, const uint8_t *buf, int fresh);
+static void dir_settle(int block, const uint8_t *data);
+static int cluster_load(int rootindex);
+static void cluster_drop(int rootindex);
+
+// Memory the block maps of all files may use, in bytes
+#define BLOCK_MAP_BUDGET (1 << 20)
+
+// Release the block map of the file at @rootindex. Called with table_lock
+// held, or while unmounting
+static void map_drop(int rootindex) {
+	struct block_map *map = &fs->maps[rootindex];
+	fs->map_bytes -= map->cap * sizeof(int);
+	free(map->blocks);
+	map->blocks = NULL;
+	map->nblocks = map->cap = 0;
+	map->valid = 0;
+}
+
+// Make room for @bytes more bytes of block maps, evicting the maps of files
+// that are not open if needed. Returns -1 if they do not fit the budget.
+// Called with table_lock held
+static int map_reserve(size_t bytes) {
+	for (int i = 0; i < NODE_COUNT &&
+		fs->map_bytes + bytes > BLOCK_MAP_BUDGET; i++) {
+		if (fs->maps[i].valid && fs->maps[i].users == 0) map_drop(i);
+	}
+	if (fs->map_bytes + bytes > BLOCK_MAP_BUDGET) return -1;
+	fs->map_bytes += bytes;
 	return 0;
 }
 
-int fs_umount(void)
-{
-	if (fs == NULL) return -1;
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (filedes_table[i].open == 1) return -1;
-	}
-	// Write the FAT and root_dir back to the disk
-	// Write back fat
-	for (int i = 1; i <= fs->fs_superblock->num_of_blocks_for_FAT; i++){
-		// We have 4096/2 fs_fat entries per block
-		// Make a 4096 byte buffer and fill it with fs_fat data
-		uint16_t buf[BLOCK_SIZE/2];
-		int offset = (i-1)*BLOCK_SIZE/2;
-		for (int j = 0; j < BLOCK_SIZE/2; j++) {
-			buf[j] = fs->fs_FAT[j+offset];
-		}
-		block_write(i, &buf);
-	}
-	// Write root dir
-	block_write(fs->fs_superblock->root_dir_index, fs->fs_root_dir);
-	// Free allocated structure memory:
-	free(fs->fs_superblock);
-	free(fs->fs_FAT);
-	free(fs->fs_root_dir);
-	free(fs);
-	// Set the global vars back to NULL
-	fs = NULL;
-	// Close the file
-	if(block_disk_close() == -1) return -1;
+// Make room for @cap blocks in the block map of the file at @rootindex.
+// The map is dropped if it cannot grow.
+static int map_grow(int rootindex, int cap) {
+	struct block_map *map = &fs->maps[rootindex];
+	if (cap <= map->cap) return 0;
+	// The budget is shared with the maps of the other files
+	pthread_mutex_lock(&fs->table_lock);
+	int ret = -1;
+	if (!map_reserve((cap - map->cap) * sizeof(int))) {
+		int *blocks = realloc(map->blocks, cap * sizeof(int));
+		if (blocks == NULL) {
+			fs->map_bytes -= (cap - map->cap) * sizeof(int);
+		} else {
+			map->blocks = blocks;
+			map->cap = cap;
+			ret = 0;
+		}
+	}
+	if (ret) map_drop(rootindex);
+	pthread_mutex_unlock(&fs->table_lock);
+	return ret;
+}
+
+// Build the block map of the file at @rootindex by walking its chain once.
+// Files too large for the budget are left without a map, and so are packed
+// files, which have no chain.
+static void map_build(int rootindex) {
+	struct block_map *map = &fs->maps[rootindex];
+	if (root_frag(rootindex)) return;
+	int first = root_first(rootindex);
+	int len = 0;
+	for (int cur = first; cur != FAT_EOC; cur = fat_get(cur)) len++;
+	if (map_grow(rootindex, len)) return;
+	for (int cur = first; cur != FAT_EOC; cur = fat_get(cur))
+		map->blocks[map->nblocks++] = cur;
+	map->valid = 1;
+}
+
+// Record that FAT index @fat was appended to the file at @rootindex
+static void map_push(int rootindex, int fat) {
+	struct block_map *map = &fs->maps[rootindex];
+	if (!map->valid) return;
+	if (map->nblocks == map->cap &&
+		map_grow(rootindex, map->cap ? 2 * map->cap : 16)) return;
+	map->blocks[map->nblocks++] = fat;
+}
+
+// The allocator, the FAT and the root directory below are used with
+// alloc_lock held, except while mounting
+
+// Whether data block @fat is in use according to the free-space bitmap
+static int block_used(int fat) {
+	return fs->used_map[fat / 8] & (1 << (fat % 8));
+}
+
+static void mark_used(int fat) {
+	fs->used_map[fat / 8] |= 1 << (fat % 8);
+	fs->free_count--;
+}
+
+static void mark_free(int fat) {
+	fs->used_map[fat / 8] &= ~(1 << (fat % 8));
+	fs->free_count++;
+}
+
+// Build the free-space bitmap from the FAT
+static int alloc_init(void) {
+	int total = fs->data_blocks;
+	fs->used_map = calloc((total + 7) / 8 + 1, 1);
+	if (fs->used_map == NULL) return -1;
+	fs->free_count = total;
+	// FAT entry 0 is reserved and never handed out
+	mark_used(0);
+	for (int i = 1; i < total; i++)
+		if (fat_get(i) != 0) mark_used(i);
+	fs->rotor = 1;
 	return 0;
 }
 
-int fs_info(void)
-{
-	if (!fs) return -1; // No disk has been opened
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", fs->fs_superblock->amount_of_data_blocks +
-		fs->fs_superblock->num_of_blocks_for_FAT + 2);
-	printf("fat_blk_count=%d\n", fs->fs_superblock->num_of_blocks_for_FAT);
-	printf("rdir_blk=%d\n",fs->fs_superblock->root_dir_index);
-	printf("data_blk=%d\n",fs->fs_superblock->root_dir_index+1);
-	printf("data_blk_count=%d\n",fs->fs_superblock->amount_of_data_blocks);
-	int num_free_blocks = 0;
-	for (int i = 0; i < fs->fs_superblock->amount_of_data_blocks; i++)
-		if (fs->fs_FAT[i] == 0) num_free_blocks++;
-	printf("fat_free_ratio=%d/%d\n", num_free_blocks,
-		fs->fs_superblock->amount_of_data_blocks);
-	int num_free_root_entries = 0;
-	for (int j = 0; j < FS_FILE_MAX_COUNT; j++){
-		if (fs->fs_root_dir->dir[j].filename[0] == 0) num_free_root_entries++;
+// Look for @count free blocks in a row starting in [@from, @to), and keep
+// track of the longest run seen in @best_start/@best_len. Returns 1 once a
+// run of @count blocks is found.
+static int find_run(int from, int to, int count, int *best_start,
+	int *best_len) {
+	int pos = from;
+	while (pos < to) {
+		if (block_used(pos)) {
+			// Whole bytes of blocks in use are skipped at once
+			if (pos % 8 == 0 && fs->used_map[pos / 8] == 0xFF) pos += 8;
+			else pos++;
+			continue;
+		}
+		int len = 0;
+		while (pos + len < to && len < count && !block_used(pos + len)) len++;
+		if (len > *best_len) {
+			*best_len = len;
+			*best_start = pos;
+		}
+		if (len == count) return 1;
+		pos += len;
 	}
-	printf("rdir_free_ratio=%d/%d\n",num_free_root_entries,
-		FS_FILE_MAX_COUNT);
 	return 0;
 }
 
-static int root_strcmp(int file_index, const char* filename) {
-	return strcmp((char*)fs->fs_root_dir->dir[file_index].filename, filename);
+// Allocate up to @count contiguous data blocks, next-fit from the rotor.
+// Returns how many were allocated (0 if the disk is full) and sets @start
+// to the first of them. Their FAT entries are left to the caller.
+static int alloc_run(int count, int *start) {
+	int total = fs->data_blocks;
+	if (count <= 0 || fs->free_count == 0) return 0;
+	int best_start = 0, best_len = 0;
+	// Search from the rotor to the end of the disk, then wrap around
+	if (!find_run(fs->rotor, total, count, &best_start, &best_len))
+		find_run(1, total, count, &best_start, &best_len);
+	for (int i = 0; i < best_len; i++) mark_used(best_start + i);
+	fs->rotor = best_start + best_len;
+	if (fs->rotor >= total) fs->rotor = 1;
+	*start = best_start;
+	return best_len;
 }
 
-int fs_create(const char *filename)
-{
-	if (!filename) return -1;
-	if(strlen(filename) > FS_FILENAME_LEN) return -1;
-	// Check if any slots have the same file name
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
-		if(!root_strcmp(i,filename)) return -1;
-	// Search root directory for empty spot
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(fs->fs_root_dir->dir[i].filename[0] == 0){
-			// Create the new file
-			strcpy((char*)fs->fs_root_dir->dir[i].filename, filename);
-			fs->fs_root_dir->dir[i].filesize = 0;
-			fs->fs_root_dir->dir[i].first_data_block_index = FAT_EOC;
-			return 0;
-		}
-	}
-	// No empty slots in FATfs->
+// Name of the file at @rootindex
+static const char *root_name(int rootindex) {
+	return (const char *)fs->fs_root_dir->dir[rootindex].filename;
+}
+
+// Hash of @name (FNV-1a)
+static uint32_t name_hash32(const char *name) {
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < FS_FILENAME_LEN && name[i]; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// Bucket where the search for @name starts
+static int name_hash(const char *name) {
+	return name_hash32(name) & (NAME_INDEX_SIZE - 1);
+}
+
+// Root index of the file named @name, or -1 if there is none
+static int name_lookup(const char *name) {
+	for (int h = name_hash(name); fs->name_index[h] != -1;
+		h = (h + 1) & (NAME_INDEX_SIZE - 1)) {
+		if (!strncmp(root_name(fs->name_index[h]), name, FS_FILENAME_LEN))
+			return fs->name_index[h];
+	}
 	return -1;
 }
 
-int fs_delete(const char *filename)
-{
-	if (!fs) return -1;
-	if (!filename) return -1;
-	if(strlen(filename) > FS_FILENAME_LEN) return -1;
-	// Check if the file is currently open
-	for (int j = 0; j < FS_OPEN_MAX_COUNT; j++) {
-		// strcmp with @filename
-		// if open return -1;
-		if(!strcmp((char*)filedes_table[j].filename, filename)){
-			if(filedes_table[j].open) return -1;
-		}
-	}
-	// Find the files
-	int i;
-	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(!root_strcmp(i, filename))
-			break;
+// Add the file at @rootindex to the name index
+static void name_insert(int rootindex) {
+	int h = name_hash(root_name(rootindex));
+	while (fs->name_index[h] != -1) h = (h + 1) & (NAME_INDEX_SIZE - 1);
+	fs->name_index[h] = rootindex;
+}
+
+// Remove the file at @rootindex from the name index, while it still has
+// its name
+static void name_remove(int rootindex) {
+	int h = name_hash(root_name(rootindex));
+	while (fs->name_index[h] != rootindex) h = (h + 1) & (NAME_INDEX_SIZE - 1);
+	fs->name_index[h] = -1;
+	// Move back the entries that can no longer be reached past the hole
+	for (int j = (h + 1) & (NAME_INDEX_SIZE - 1); fs->name_index[j] != -1;
+		j = (j + 1) & (NAME_INDEX_SIZE - 1)) {
+		int home = name_hash(root_name(fs->name_index[j]));
+		// Distances from the home bucket, to the entry and to the hole
+		int to_entry = (j - home) & (NAME_INDEX_SIZE - 1);
+		int to_hole = (h - home) & (NAME_INDEX_SIZE - 1);
+		if (to_hole < to_entry) {
+			fs->name_index[h] = fs->name_index[j];
+			fs->name_index[j] = -1;
+			h = j;
+		}
 	}
-	// If the file was not found; Return failure
-	// Safe to change filename to zero after this conditional
-	if (i == FS_FILE_MAX_COUNT) return -1;
-	// We have found the file to delete
-	// Set the first char of its filename to a zero i.e. "\0"
-	fs->fs_root_dir->dir[i].filename[0] = 0;
-	// Trace the FAT and set all values to zero
-	int cur_block = fs->fs_root_dir->dir[i].first_data_block_index;
-	while (cur_block != FAT_EOC) {
-		int nextvalue = fs->fs_FAT[cur_block];
-		fs->fs_FAT[cur_block] = 0;
-		cur_block = nextvalue;
+}
+
+// Take the first free root directory entry, -1 if there is none
+static int slot_take(void) {
+	for (int w = 0; w < FS_FILE_MAX_COUNT / 64; w++) {
+		if (!fs->free_slots[w]) continue;
+		int b = __builtin_ctzll(fs->free_slots[w]);
+		fs->free_slots[w] &= ~(1ULL << b);
+		return w * 64 + b;
 	}
-	// return success
-	return 0;
+	return -1;
 }
 
-int fs_ls(void)
-{
-	if (!fs) return -1;
-	printf("FS Ls:\n");
+static void slot_put(int rootindex) {
+	fs->free_slots[rootindex / 64] |= 1ULL << (rootindex % 64);
+}
+
+// Index the names of the files in the root directory, and its free entries
+static void dir_index_init(void) {
+	memset(fs->name_index, 0xff, sizeof(fs->name_index));
+	memset(fs->free_slots, 0, sizeof(fs->free_slots));
 	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (fs->fs_root_dir->dir[i].filename[0] != 0) {
-			// Extract file name
-			char fname[FS_FILENAME_LEN];
-			for (int f = 0; f < FS_FILENAME_LEN; f++)
-				fname[f] = fs->fs_root_dir->dir[i].filename[f];
-			// We have found a file
-			printf("file: %s, size: %d, data_blk: %d\n",
-				fname, fs->fs_root_dir->dir[i].filesize,
-				fs->fs_root_dir->dir[i].first_data_block_index);
-		}
+		if (fs->fs_root_dir->dir[i].filename[0] == 0) slot_put(i);
+		else name_insert(i);
+	}
+}
+
+static int FAT_to_abs(int fat_index) {
+	return fat_index + 1 + fs->fat_blocks + fs->root_blocks;
+}
+
+// Entry @index of the FAT
+static int fat_get(int index) {
+	if (fs->version == 1) {
+		uint16_t value = ((uint16_t *)fs->fs_FAT)[index];
+		return value == FAT16_EOC ? FAT_EOC : value;
+	}
+	return (int)((uint32_t *)fs->fs_FAT)[index];
+}
+
+// Set FAT entry @index to @value
+static void fat_set(int index, int value) {
+	if (fs->version == 1) ((uint16_t *)fs->fs_FAT)[index] = value;
+	else ((uint32_t *)fs->fs_FAT)[index] = value;
+	fs->fat_dirty[index / fs->fat_per_block] = 1;
+	if (fs->journal.on) {
+		uint64_t *word = &fs->journal.fat_pending[index / 64];
+		if (!(*word & (1ULL << (index % 64)))) fs->journal.fat_count++;
+		*word |= 1ULL << (index % 64);
+	}
+}
+
+// Entry of the file with id @rootindex on a version 2 file system: in the
+// root directory, or the copy kept by its node
+static file_entry2 *entry2(int rootindex) {
+	if (rootindex >= FS_FILE_MAX_COUNT)
+		return &fs->nodes[rootindex - FS_FILE_MAX_COUNT].entry;
+	return &((file_entry2 *)fs->fs_root_dir->dir)[rootindex];
+}
+
+// Size and first data block of the file with id @rootindex
+static size_t root_size(int rootindex) {
+	if (fs->version == 1) return fs->fs_root_dir->dir[rootindex].filesize;
+	return entry2(rootindex)->filesize;
+}
+
+static int root_first(int rootindex) {
+	if (fs->version == 1) {
+		uint16_t first = fs->fs_root_dir->dir[rootindex].first_data_block_index;
+		return first == FAT16_EOC ? FAT_EOC : first;
+	}
+	return (int)entry2(rootindex)->first_data_block_index;
+}
+
+static void root_set_size(int rootindex, size_t size) {
+	if (fs->version == 1) fs->fs_root_dir->dir[rootindex].filesize = size;
+	else entry2(rootindex)->filesize = size;
+}
+
+static void root_set_first(int rootindex, int fat) {
+	if (fs->version == 1)
+		fs->fs_root_dir->dir[rootindex].first_data_block_index = fat;
+	else
+		entry2(rootindex)->first_data_block_index = fat;
+}
+
+// Unit of its fragment block the file with id @rootindex starts at, 0 if it
+// is not packed
+static int root_frag(int rootindex) {
+	return fs->version == 1 ? 0 : entry2(rootindex)->frag;
+}
+
+static void root_set_frag(int rootindex, int unit) {
+	entry2(rootindex)->frag = unit;
+}
+
+// Entry @rootindex of the root directory, in the layout of version 2
+static void root_entry(int rootindex, file_entry2 *e) {
+	if (fs->version == 2) {
+		*e = *entry2(rootindex);
+		return;
+	}
+	memset(e, 0, sizeof(*e));
+	memcpy(e->filename, root_name(rootindex), FS_FILENAME_LEN);
+	e->filesize = root_size(rootindex);
+	e->first_data_block_index = root_first(rootindex);
+}
+
+// Write entry @e in slot @slot of directory block @block. The other entries
+// of the block may be updated meanwhile from elsewhere, which alloc_lock held
+// by the caller prevents
+static int entry_store(int block, int slot, const file_entry2 *e) {
+	uint8_t *buf = fs->entry_buf;
+	if (dir_read(block, buf)) return -1;
+	memcpy(&((file_entry2 *)buf)[slot], e, sizeof(*e));
+	return dir_write(block, buf, 0);
+}
+
+// Largest file the format can describe
+static size_t max_file_size(void) {
+	return fs->version == 1 ? UINT32_MAX : SSIZE_MAX;
+}
+
+// Note that the entry of the file with id @rootindex was modified. The entry of
+// a node goes straight to its directory block (see dir_write())
+static void mark_root(int rootindex) {
+	if (rootindex >= FS_FILE_MAX_COUNT) {
+		struct node *n = &fs->nodes[rootindex - FS_FILE_MAX_COUNT];
+		entry_store(n->block, n->slot, &n->entry);
+		return;
+	}
+	fs->root_dirty = 1;
+	if (fs->journal.on)
+		fs->journal.root_pending[rootindex / 64] |= 1ULL << (rootindex % 64);
+}
+
+// Metadata blocks on their way to the disk: their numbers, and a copy of
+// their content. @dirs is set if they are directory blocks (see
+// dir_snapshot())
+struct meta_copy {
+	int n;
+	int dirs;
+	int *where;
+	uint8_t *data;
+};
+
+// Copy the FAT blocks and the root directory modified since they were last
+// written, and mark them clean
+static int meta_snapshot(struct meta_copy *copy) {
+	int nfat = fs->fat_blocks;
+	copy->n = 0;
+	copy->dirs = 0;
+	copy->where = NULL;
+	copy->data = NULL;
+	// Mapped metadata is modified in place
+	if (fs->mapped) return 0;
+	int count = fs->root_dirty ? fs->root_blocks : 0;
+	for (int i = 0; i < nfat; i++) count += fs->fat_dirty[i] != 0;
+	if (count == 0) return 0;
+	copy->data = malloc((size_t)count * fs->block_size);
+	copy->where = malloc(count * sizeof(int));
+	if (!copy->data || !copy->where) {
+		free(copy->data);
+		free(copy->where);
+		copy->data = NULL;
+		copy->where = NULL;
+		return -1;
 	}
+	for (int i = 0; i < nfat; i++) {
+		if (!fs->fat_dirty[i]) continue;
+		// The FAT is kept in memory in its on-disk layout
+		memcpy(&copy->data[copy->n * fs->block_size],
+			&fs->fs_FAT[(size_t)i * fs->block_size], fs->block_size);
+		copy->where[copy->n++] = i + 1;
+		fs->fat_dirty[i] = 0;
+	}
+	// With small blocks, the root directory spans several of them
+	for (int i = 0; fs->root_dirty && i < fs->root_blocks; i++) {
+		memcpy(&copy->data[copy->n * fs->block_size],
+			(uint8_t *)fs->fs_root_dir + (size_t)i * fs->block_size,
+			fs->block_size);
+		copy->where[copy->n++] = fs->root_block + i;
+	}
+	fs->root_dirty = 0;
 	return 0;
 }
 
-int fs_open(const char *filename)
-{
-	if (!fs) return -1;
-	if (!filename) return -1;
-	// Make sure we don't have the max number of open files
-	int count = 0;
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (filedes_table[i].open == 1) count++;
-	}
-	if (count >= FS_OPEN_MAX_COUNT) return -1;
-	// Check that the filename is not too long
-	if(strlen(filename) > FS_FILENAME_LEN) return -1;
-	// Now look for the file
-	int i;
-	for(i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(root_strcmp(i, filename)) continue;
-		// We have found the file
-		filedes newfiledes;
-		newfiledes.file_offset = 0;
-		// This was we can tell if the fd is open or not
-		newfiledes.open = 1;
-		newfiledes.root_index = i;
-		strcpy((char*)newfiledes.filename,
-			(char*)fs->fs_root_dir->dir[i].filename);
-		// find the next open slot in the filedes_table
-		for (int j = 0; j < FS_FILE_MAX_COUNT; j++) {
-			// If open == 0 then the file is closed and we can proceed
-			if (filedes_table[j].open == 0){
-				// Found open slot
-				memcpy(&filedes_table[j], &newfiledes, sizeof(filedes));
-				return j;
-			}
+// Release the blocks copied by meta_snapshot() or dir_snapshot()
+static void meta_free(struct meta_copy *copy) {
+	free(copy->data);
+	free(copy->where);
+	copy->data = NULL;
+	copy->where = NULL;
+	copy->n = 0;
+}
+
+// Write the blocks copied by meta_snapshot() or dir_snapshot(). Return -1 if
+// one of them could not be written, in which case it is marked dirty again,
+// or for a directory block left to a later write
+static int meta_write(struct meta_copy *copy) {
+	int ret = 0;
+	for (int k = 0; k < copy->n; k++) {
+		uint8_t *data = &copy->data[k * fs->block_size];
+		if (block_write(copy->where[k], data) == 0) {
+			if (copy->dirs) dir_settle(copy->where[k] - FAT_to_abs(0), data);
+			continue;
 		}
+		ret = -1;
+		if (copy->dirs) continue;
+		pthread_mutex_lock(&fs->alloc_lock);
+		if (copy->where[k] >= fs->root_block)
+			fs->root_dirty = 1;
+		else
+			fs->fat_dirty[copy->where[k] - 1] = 1;
+		pthread_mutex_unlock(&fs->alloc_lock);
 	}
-	// No file name found to open
+	meta_free(copy);
+	return ret;
+}
+
+// Write the FAT blocks and the root directory modified since they were last
+// written back to the disk. Return -1 if one of them could not be written
+static int meta_writeback(void) {
+	struct meta_copy copy;
+	pthread_mutex_lock(&fs->alloc_lock);
+	int ret = meta_snapshot(&copy);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (meta_write(&copy)) ret = -1;
+	return ret;
+}
+
+// -- Fragment blocks -- //
+// On a file system with FEATURE_PACKED, files of up to half a block are packed
+// together in fragment blocks instead of taking a block each. A fragment block
+// is split into FRAG_UNITS units: the first one holds a header telling which
+// units are in use, and a packed file takes a run of the others. The fragment
+// blocks are chained in the FAT from data block FRAG_FIRST, which the format
+// reserves, so that mounting finds them as it would the blocks of a file. They
+// are used with frag_lock held for writing.
+
+#define FRAG_UNITS 64
+#define FRAG_MAGIC 0x47415246
+#define FRAG_FIRST 1
+
+// Header of a fragment block, in its first unit
+struct __attribute__((packed)) frag_header {
+	uint32_t magic;
+	uint32_t padding;
+	// A bit is set if the unit is in use, which the first one always is
+	uint64_t used;
+};
+
+// Size of a unit, and number of units that @size bytes take
+static size_t frag_unit(void) {
+	return fs->block_size / FRAG_UNITS;
+}
+
+static int frag_units(size_t size) {
+	return (size + frag_unit() - 1) / frag_unit();
+}
+
+// Largest packed file
+static size_t pack_max(void) {
+	return fs->block_size / 2;
+}
+
+// Bits of @n units starting at unit @at, @n being less than FRAG_UNITS
+static uint64_t frag_mask(int at, int n) {
+	return ((1ULL << n) - 1) << at;
+}
+
+// First unit of a run of @n free units, in a fragment block whose units in
+// use are @used. -1 if there is none
+static int frag_free_run(uint64_t used, int n) {
+	for (int at = 1; at + n <= FRAG_UNITS; at++)
+		if (!(used & frag_mask(at, n))) return at;
 	return -1;
 }
 
-int fs_close(int fd)
-{
-	// Bounds checking
-	if (fd < 0 || fd > 31) return -1;
-	// Check if there is an open file in filedes_table[fd]
-	if (filedes_table[fd].open == 0) return -1;
-	// Otherwise, we have a valid file descriptor
-	else {
-		// Set all values inside the file descriptor to zero (close the fd)
-		filedes_table[fd].open = 0;
-		filedes_table[fd].file_offset = 0;
-		filedes_table[fd].root_index = 0;
-		// Set the first character of filename to null character
-		filedes_table[fd].filename[0] = 0;
+// Make room for one more fragment block in the list
+static int frag_room(void) {
+	if (fs->nfrags < fs->frag_cap) return 0;
+	int cap = fs->frag_cap ? 2 * fs->frag_cap : 16;
+	struct frag_block *frags = realloc(fs->frags, cap * sizeof(*frags));
+	if (!frags) return -1;
+	fs->frags = frags;
+	fs->frag_cap = cap;
+	return 0;
+}
+
+// List the fragment blocks by walking their chain. Their headers are only read
+// once needed
+static int frag_init(void) {
+	if (!(fs->features & FEATURE_PACKED)) return 0;
+	fs->frag_buf = malloc(fs->block_size);
+	fs->pack_buf = malloc(fs->block_size);
+	if (!fs->frag_buf || !fs->pack_buf) return -1;
+	for (int cur = FRAG_FIRST; cur != FAT_EOC; cur = fat_get(cur)) {
+		// A chain that leaves the data blocks or loops is corrupted
+		if (cur <= 0 || cur >= fs->data_blocks ||
+			fs->nfrags >= fs->data_blocks || frag_room())
+			return -1;
+		struct frag_block f = { cur, 0, 0 };
+		fs->frags[fs->nfrags++] = f;
 	}
 	return 0;
 }
 
-int fs_stat(int fd)
-{
-	// Bounds checking
-	if (fd < 0 || fd > 31) return -1;
-	// Checking if file is not currently open:
-	if (filedes_table[fd].open == 0) return -1;
-	int rootindex = filedes_table[fd].root_index;
-	int filesize = fs->fs_root_dir->dir[rootindex].filesize;
-	return filesize;
+// Fragment block at FAT index @block, NULL if there is none
+static struct frag_block *frag_get(int block) {
+	for (int k = 0; k < fs->nfrags; k++)
+		if (fs->frags[k].block == block) return &fs->frags[k];
+	return NULL;
 }
 
-int fs_lseek(int fd, size_t offset)
-{
-	// Bounds checking
-	if (fd < 0 || fd > 31) return -1;
-	// Checking if file is not currently open:
-	if (filedes_table[fd].open == 0) return -1;
-	// Check if offset is larger than filesize:
-	int rootindex = filedes_table[fd].root_index;
-	uint32_t filesize = fs->fs_root_dir->dir[rootindex].filesize;
-	if (offset > filesize) return -1;
-	// Set the offset for the fd to the offset given
-	filedes_table[fd].file_offset = offset;
+// Read fragment block @f into frag_buf, and its header the first time
+static int frag_read(struct frag_block *f) {
+	if (block_read(FAT_to_abs(f->block), fs->frag_buf)) return -1;
+	if (!f->loaded) {
+		struct frag_header hdr;
+		memcpy(&hdr, fs->frag_buf, sizeof(hdr));
+		// A block without a valid header is never handed out
+		f->used = hdr.magic == FRAG_MAGIC ? hdr.used | 1 : ~0ULL;
+		f->loaded = 1;
+	}
 	return 0;
 }
 
-// This is a helper function to find the index of the data block corresponding
-// to the file's offset
-static int offset_to_block(int fd, size_t offset) {
-	// For an open file with file descriptor fd, find the block
-	// coordinating to the current offset in the file
-	// Returns the ABSOLUTE index of the data block, i.e. what
-	// block_read or block_write will actually use
-	// Make sure the file at @fd is actually open
-	if (filedes_table[fd].open == 0) return -1;
-	// Find how many blocks from the start we need to traverse
-	int num_blocks_to_traverse = offset / BLOCK_SIZE;
-	// First find the file's FIRST data block
-	uint16_t file_first_data_block = fs->fs_root_dir->
-		dir[(filedes_table[fd].root_index)].first_data_block_index;
-	// Trace the FAT until we get the desired block OR
-	// reach the end of the file.
-	int cur_block = file_first_data_block;
-	while (num_blocks_to_traverse > 0) {
-		// Check if we have reached the end of the file
-		if (fs->fs_FAT[cur_block] == FAT_EOC) {
-			break;
-		}
-		cur_block = fs->fs_FAT[cur_block];
-		num_blocks_to_traverse--;
+// Write frag_buf to fragment block @f, with its header up to date
+static int frag_write(struct frag_block *f) {
+	struct frag_header hdr = { FRAG_MAGIC, 0, f->used };
+	memcpy(fs->frag_buf, &hdr, sizeof(hdr));
+	return block_write(FAT_to_abs(f->block), fs->frag_buf);
+}
+
+// Find @n free units in a row and read the fragment block they are in into
+// frag_buf, chaining a new fragment block if none has room. Return the block
+// and set @at to the first of the units, or return NULL if the disk is full.
+// The units are left to the caller to mark in use
+static struct frag_block *frag_alloc(int n, int *at) {
+	for (int k = 0; k < fs->nfrags; k++) {
+		int i = (fs->frag_rotor + k) % fs->nfrags;
+		struct frag_block *f = &fs->frags[i];
+		// Blocks known to be too full are not read
+		if (f->loaded && frag_free_run(f->used, n) < 0) continue;
+		if (frag_read(f) || (*at = frag_free_run(f->used, n)) < 0) continue;
+		fs->frag_rotor = i;
+		return f;
+	}
+	int block;
+	if (frag_room()) return NULL;
+	pthread_mutex_lock(&fs->alloc_lock);
+	int got = alloc_run(1, &block);
+	if (got) {
+		fat_set(fs->frags[fs->nfrags - 1].block, block);
+		fat_set(block, FAT_EOC);
 	}
-	int absolute_first_data_block_index = 2 +
-		fs->fs_superblock->num_of_blocks_for_FAT;
-	return absolute_first_data_block_index + cur_block;
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (!got) return NULL;
+	struct frag_block *f = &fs->frags[fs->nfrags];
+	f->block = block;
+	f->loaded = 1;
+	f->used = 1;
+	fs->frag_rotor = fs->nfrags++;
+	memset(fs->frag_buf, 0, fs->block_size);
+	*at = 1;
+	return f;
 }
 
-static int find_first_open_FAT(){
-	// Find the first open FAT
-	int index = 0;
-	for (int i = 1; i < fs->fs_superblock->num_of_blocks_for_FAT
-		* BLOCK_SIZE; i++){
-			if(fs->fs_FAT[i] == 0) {
-				index = i;
-				break;
-			}
+// Give back the @n units starting at unit @at of fragment block @block. A
+// fragment block left empty is unchained and freed, but for the first one
+static int frag_release(int block, int at, int n) {
+	struct frag_block *f = frag_get(block);
+	if (!f || frag_read(f)) return -1;
+	f->used &= ~frag_mask(at, n);
+	int k = f - fs->frags;
+	if (f->used != 1 || k == 0) return frag_write(f);
+	pthread_mutex_lock(&fs->alloc_lock);
+	fat_set(fs->frags[k - 1].block, fat_get(block));
+	fat_set(block, 0);
+	mark_free(block);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	memmove(f, f + 1, (fs->nfrags - k - 1) * sizeof(*f));
+	fs->nfrags--;
+	if (fs->frag_rotor >= fs->nfrags) fs->frag_rotor = 0;
+	return 0;
+}
+
+// -- Directories -- //
+// Version 2 file systems have subdirectories. A directory is a chain of data
+// blocks of entries laid out as in the root directory, each block being a
+// bucket of a hash table: an entry goes to the bucket given by the low bits of
+// the hash of its name. Once an entry does not fit its bucket, the number of
+// buckets doubles and the entries of each bucket are spread over it and a new
+// one, so that a lookup reads a single block however large the directory
+// grows. A directory is told by the FAT index of its first block, 0 standing
+// for the root directory. They are used with table_lock held.
+
+// Where an entry is: entry @root_index of the root directory, or if it is -1,
+// slot @slot of data block @block
+struct entry_loc {
+	int root_index;
+	int block;
+	int slot;
+};
+
+// Number of entries of a directory block
+static int dir_slots(void) {
+	return fs->block_size / sizeof(file_entry2);
+}
+
+// With a journal, the directory blocks updated are kept in memory until a
+// commit logs their entries, and only then are written in place: a block
+// reaching the disk earlier could point to blocks that replaying the journal
+// leaves free. Whether the updates are kept so, which they also are while
+// mounting replays the journal
+static int dir_logged(void) {
+	return fs->journal.present && !fs->mapped;
+}
+
+// Number of words of the slot bits of a directory block
+static int dir_words(void) {
+	return (dir_slots() + 63) / 64;
+}
+
+// The update of directory block @block, NULL if there is none. Called with
+// dir_lock held
+static struct dir_update *dir_update_find(int block) {
+	struct dir_update *u = fs->dir_updates[block % DIR_UPDATE_BUCKETS];
+	while (u && u->block != block) u = u->next;
+	return u;
+}
+
+// The update of directory block @block, made from what the block holds if
+// there is none yet, or from zeroes if @blank is set. NULL if it cannot be
+// made. Called with dir_lock held
+static struct dir_update *dir_update_get(int block, int blank) {
+	struct dir_update *u = dir_update_find(block);
+	if (u) return u;
+	size_t words = dir_words();
+	u = malloc(sizeof(*u) + words * sizeof(uint64_t) + fs->block_size);
+	if (!u) return NULL;
+	u->block = block;
+	u->fresh = 0;
+	u->freed = 0;
+	u->pending = (uint64_t *)(u + 1);
+	u->data = (uint8_t *)(u->pending + words);
+	memset(u->pending, 0, words * sizeof(uint64_t));
+	if (blank) {
+		memset(u->data, 0, fs->block_size);
+	} else if (block_read(FAT_to_abs(block), u->data)) {
+		free(u);
+		return NULL;
 	}
-	// if zero, the FAT is full
-	if (index == 0) return -1;
-	// If we are out of data blocks, return -1
-	if (index > fs->fs_superblock->amount_of_data_blocks - 1) return -1;
-	return index;
+	u->next = fs->dir_updates[block % DIR_UPDATE_BUCKETS];
+	fs->dir_updates[block % DIR_UPDATE_BUCKETS] = u;
+	fs->ndir_updates++;
+	return u;
 }
 
-static int FAT_to_abs(int fat_index) {
-	return fat_index + 2 + fs->fs_superblock->num_of_blocks_for_FAT;
+// Forget update @u. Called with dir_lock held
+static void dir_update_drop(struct dir_update *u) {
+	struct dir_update **p = &fs->dir_updates[u->block % DIR_UPDATE_BUCKETS];
+	while (*p != u) p = &(*p)->next;
+	*p = u->next;
+	fs->ndir_updates--;
+	free(u);
 }
 
-int fs_write(int fd, void *buf, size_t count)
-{
-	// Bounds checking
-	if (fd < 0 || fd > 31) return -1;
-	if (buf == NULL) return -1;
-	// Check if there is an open file in filedes_table[fd]
-	if (filedes_table[fd].open == 0) return -1;
-	if (count == 0) return 0;
-	// offset for the input buffer
-	size_t input_offset = 0;
-	// Return value
-	int num_bytes_written = 0;
-	// End condition
-	size_t num_bytes_to_write = count;
-	// Get a pointer to the current offset
-	size_t* curr_offset = &filedes_table[fd].file_offset;
-	// Quick reference to root index
-	int rootindex = filedes_table[fd].root_index;
-	// This should be the new offset once we are finished writing
-	size_t final_offset = count + *curr_offset;
-	// Check how far we are overwriting
-	size_t og_filesize = fs->fs_root_dir->dir[rootindex].filesize;
-	// Initialize our block buffer
-	uint8_t bounce_buffer[4096];
-	int curr_block;
-	int last_block = 0;
-	uint16_t *prev_block;
-	if (fs->fs_root_dir->dir[rootindex].first_data_block_index == FAT_EOC){
-		curr_block = FAT_EOC;
-		// If curr_block IS FAT_EOC we need to modify the root reference
-		prev_block = &(fs->fs_root_dir->dir[rootindex].first_data_block_index);
-	} else if ((*curr_offset % BLOCK_SIZE) == 0){
-		// When the OFFSET is just one past the block size
-		// Set curr_block to fat EOC to immediately allocate a block
-		curr_block = FAT_EOC;
-		int lblock = offset_to_block(fd, filedes_table[fd].file_offset);
-		prev_block = &fs->fs_FAT[lblock];
+// Read directory block @block into @buf
+static int dir_read(int block, uint8_t *buf) {
+	if (dir_logged()) {
+		pthread_mutex_lock(&fs->dir_lock);
+		struct dir_update *u = dir_update_find(block);
+		int hit = u && !u->freed;
+		if (hit) memcpy(buf, u->data, fs->block_size);
+		pthread_mutex_unlock(&fs->dir_lock);
+		if (hit) return 0;
+	}
+	return block_read(FAT_to_abs(block), buf);
+}
+
+// Write @buf to directory block @block, which starts anew if @fresh is set.
+// With a journal, the entries that changed are noted for the next commit.
+// Called with alloc_lock held
+static int dir_write(int block, const uint8_t *buf, int fresh) {
+	if (!dir_logged()) return block_write(FAT_to_abs(block), buf);
+	pthread_mutex_lock(&fs->dir_lock);
+	struct dir_update *u = dir_update_get(block, fresh);
+	if (!u) {
+		pthread_mutex_unlock(&fs->dir_lock);
+		return -1;
+	}
+	// Entries logged for a block before it was freed are not replayed
+	if (fresh || u->freed) {
+		memset(u->data, 0, fs->block_size);
+		memset(u->pending, 0, dir_words() * sizeof(uint64_t));
+		u->fresh = 1;
+		u->freed = 0;
+	}
+	const file_entry2 *from = (const file_entry2 *)buf;
+	file_entry2 *to = (file_entry2 *)u->data;
+	for (int s = 0; s < dir_slots(); s++) {
+		if (!memcmp(&to[s], &from[s], sizeof(*to))) continue;
+		to[s] = from[s];
+		u->pending[s / 64] |= 1ULL << (s % 64);
+	}
+	pthread_mutex_unlock(&fs->dir_lock);
+	return 0;
+}
+
+// Note that directory block @block is freed, so that the entries logged for
+// it are not replayed over what it holds next. Called with alloc_lock held
+static void dir_revoke(int block) {
+	if (!dir_logged()) return;
+	pthread_mutex_lock(&fs->dir_lock);
+	struct dir_update *u = dir_update_get(block, 1);
+	if (u) {
+		memset(u->pending, 0, dir_words() * sizeof(uint64_t));
+		u->fresh = 0;
+		u->freed = 1;
 	} else {
-		curr_block = offset_to_block(fd, filedes_table[fd].file_offset);
-		// Get the FAT index for the fd:
-		curr_block -= (2 + fs->fs_superblock->num_of_blocks_for_FAT);
-		prev_block = &fs->fs_FAT[curr_block];
-	}
-	do {
-		// Check if we need more space:
-		if(curr_block == FAT_EOC){
-			curr_block = find_first_open_FAT();
-			// If we have no space left, just return what we have written so far
-			if (curr_block == -1) break;
-			*prev_block = curr_block;
-			fs->fs_FAT[curr_block] = FAT_EOC;
-		}
-		// Need absolute index for reading
-		int abs_curr = FAT_to_abs(curr_block);
-		// Read the current block into our bounce buffer
-		block_read(abs_curr, &bounce_buffer);
-		// Our buffer now holds the data from the current block
-		// Num of bytes we need to write to this block is
-		// 4096 - (offset) if offset->end
-		// it is offset->end if we need to write more than we have left in this
-		// block
-		int num_bytes_to_copy;
-		if (BLOCK_SIZE - (*curr_offset % BLOCK_SIZE) < num_bytes_to_write)
-			num_bytes_to_copy = BLOCK_SIZE - (*curr_offset % BLOCK_SIZE);
-		// (final_offset - cur_offset) if offset->final_offset
-		else
-			num_bytes_to_copy = final_offset - *curr_offset;
-		// Copy relevant data
-		memcpy(&bounce_buffer[*curr_offset % BLOCK_SIZE], buf + input_offset,
-			num_bytes_to_copy);
-		// Now write back to the disk
-		block_write(abs_curr, bounce_buffer);
-		// Adjust indicators
-		input_offset += num_bytes_to_copy;
-		num_bytes_to_write -= num_bytes_to_copy;
-		*curr_offset += num_bytes_to_copy;
-		num_bytes_written += num_bytes_to_copy;
-		if (num_bytes_to_write > 0)
-			prev_block = &fs->fs_FAT[curr_block];
-		last_block = curr_block;
-		curr_block = fs->fs_FAT[curr_block];
-	} while (num_bytes_to_write > 0);
-	// Rewrite new FAT_EOC
-	if (*curr_offset > og_filesize) {
-		fs->fs_root_dir->dir[rootindex].filesize = (uint32_t) *curr_offset;
-		fs->fs_FAT[last_block] = FAT_EOC;
+		// The next commit writes everything in place instead
+		fs->journal.failed = 1;
 	}
-	return num_bytes_written;
+	pthread_mutex_unlock(&fs->dir_lock);
 }
 
-int fs_read(int fd, void *buf, size_t count)
-{
-	// Bounds checking
-	if (fd < 0 || fd > 31) return -1;
-	// Check if there is an open file in filedes_table[fd]
-	if (filedes_table[fd].open == 0) return -1;
-	if (buf == NULL) return -1;
-	size_t num_bytes_to_read = count;
-	// How we index the ouput buf*
-	size_t output_offset = 0;
-	// Return value
-	int num_bytes_copied = 0;
-	// Get a pointer to the current offset
-	size_t* offset = &filedes_table[fd].file_offset;
-	// Quick reference to root index
-	int rootindex = filedes_table[fd].root_index;
-	// Quick reference to filesize
-	uint filesize = fs->fs_root_dir->dir[rootindex].filesize;
-	// Current block index
-	int db_index;
-	// This should be the new offset once we are finished reading
-	size_t final_offset = count + *offset;
-	// Block index of where we stop reading
-	int final_db_index = offset_to_block(fd,final_offset);
-	// Initialize our block buffer
-	uint8_t bounce_buffer[4096];
-	while (*offset < filesize && num_bytes_to_read > 0
-		&& *offset < final_offset) {
-		db_index = offset_to_block(fd,filedes_table[fd].file_offset);
-		// Fill the buffer
-		block_read(db_index, &bounce_buffer);
-		// Num of bytes we need to read in this block is
-		// 4096 - (offset) if offset->end
-		// it is offset->end if db_index is NOT final_db_index
-		int num_bytes_to_copy;
-		if (db_index != final_db_index)
-			num_bytes_to_copy = BLOCK_SIZE - (*offset % BLOCK_SIZE);
-		// (final_offset - cur_offset) if offset->final_offset
-		// it is offset->final_offset
-		if (db_index == final_db_index)
-			num_bytes_to_copy = final_offset - *offset;
-		// Copy relevant data
-		memcpy(buf + output_offset,
-			&bounce_buffer[*offset % BLOCK_SIZE],
-			num_bytes_to_copy);
-		// Adjust indicators
-		output_offset += num_bytes_to_copy;
-		num_bytes_to_read -= num_bytes_to_copy;
-		*offset += num_bytes_to_copy;
-		num_bytes_copied += num_bytes_to_copy;
+// Note that the blocks of the directory starting at FAT index @first are
+// freed. Called with alloc_lock held, before freeing them
+static void dir_revoke_chain(int first) {
+	if (!dir_logged()) return;
+	for (int cur = first, len = 0; cur > 0 && cur < fs->data_blocks &&
+		len < fs->data_blocks; cur = fat_get(cur), len++)
+		dir_revoke(cur);
+}
+
+// Copy the directory blocks updated, to be written in place once the updates
+// are durable. Called with alloc_lock held
+static int dir_snapshot(struct meta_copy *copy) {
+	copy->n = 0;
+	copy->dirs = 1;
+	copy->where = NULL;
+	copy->data = NULL;
+	pthread_mutex_lock(&fs->dir_lock);
+	int count = 0;
+	for (int b = 0; b < DIR_UPDATE_BUCKETS; b++)
+		for (struct dir_update *u = fs->dir_updates[b]; u; u = u->next)
+			count += !u->freed;
+	if (count) {
+		copy->data = malloc((size_t)count * fs->block_size);
+		copy->where = malloc(count * sizeof(int));
 	}
-	return num_bytes_copied;
+	if (count && (!copy->data || !copy->where)) {
+		pthread_mutex_unlock(&fs->dir_lock);
+		meta_free(copy);
+		return -1;
+	}
+	for (int b = 0; b < DIR_UPDATE_BUCKETS; b++) {
+		for (struct dir_update *u = fs->dir_updates[b]; u; u = u->next) {
+			if (u->freed) continue;
+			memcpy(&copy->data[copy->n * fs->block_size], u->data,
+				fs->block_size);
+			copy->where[copy->n++] = FAT_to_abs(u->block);
+		}
+	}
+	pthread_mutex_unlock(&fs->dir_lock);
+	return 0;
+}
+
+// Forget the update of directory block @block once @data, which it held, is
+// written in place, unless it was updated since
+static void dir_settle(int block, const uint8_t *data) {
+	pthread_mutex_lock(&fs->dir_lock);
+	struct dir_update *u = dir_update_find(block);
+	int busy = !u || u->freed || u->fresh;
+	for (int w = 0; !busy && w < dir_words(); w++) busy = u->pending[w] != 0;
+	if (!busy && !memcmp(u->data, data, fs->block_size)) dir_update_drop(u);
+	pthread_mutex_unlock(&fs->dir_lock);
+}
+
+// Free the chain of data blocks starting at FAT index @first. Called with
+// alloc_lock held
+static void chain_free(int first) {
+	int cur_block = first;
+	while (cur_block != FAT_EOC) {
+		int nextvalue = fat_get(cur_block);
+		fat_set(cur_block, 0);
+		mark_free(cur_block);
+		cur_block = nextvalue;
+	}
+}
+
+// Block map of directory @dir, built by walking its chain once. NULL if it
+// cannot be built
+static struct dir_map *dir_map_get(int dir) {
+	for (int k = 0; k < DIR_MAPS; k++)
+		if (fs->dir_maps[k].first == dir) return &fs->dir_maps[k];
+	// The maps are evicted in turn
+	struct dir_map *map = &fs->dir_maps[fs->dir_map_next];
+	fs->dir_map_next = (fs->dir_map_next + 1) % DIR_MAPS;
+	free(map->blocks);
+	map->blocks = NULL;
+	map->first = 0;
+	pthread_mutex_lock(&fs->alloc_lock);
+	int len = 0;
+	for (int cur = dir; cur > 0 && cur < fs->data_blocks &&
+		len < fs->data_blocks; cur = fat_get(cur))
+		len++;
+	int *blocks = malloc(len * sizeof(int));
+	for (int cur = dir, k = 0; blocks && k < len; cur = fat_get(cur))
+		blocks[k++] = cur;
+	pthread_mutex_unlock(&fs->alloc_lock);
+	// A directory has a power of two buckets
+	if (!blocks || len == 0 || (len & (len - 1))) {
+		free(blocks);
+		return NULL;
+	}
+	map->first = dir;
+	map->blocks = blocks;
+	map->nblocks = len;
+	return map;
+}
+
+// Forget the block map of directory @dir, once it is removed
+static void dir_map_drop(int dir) {
+	for (int k = 0; k < DIR_MAPS; k++) {
+		if (fs->dir_maps[k].first != dir) continue;
+		free(fs->dir_maps[k].blocks);
+		fs->dir_maps[k].blocks = NULL;
+		fs->dir_maps[k].first = 0;
+	}
+}
+
+// Look for @name in directory @dir. Return 0 if found, and set @loc and @e to
+// where its entry is and what it holds
+static int dir_find(int dir, const char *name, struct entry_loc *loc,
+	file_entry2 *e) {
+	if (dir == 0) {
+		int i = name_lookup(name);
+		if (i == -1) return -1;
+		loc->root_index = i;
+		root_entry(i, e);
+		return 0;
+	}
+	struct dir_map *map = dir_map_get(dir);
+	if (!map) return -1;
+	int block = map->blocks[name_hash32(name) & (map->nblocks - 1)];
+	if (dir_read(block, fs->dir_buf)) return -1;
+	file_entry2 *slots = (file_entry2 *)fs->dir_buf;
+	for (int s = 0; s < dir_slots(); s++) {
+		if (strncmp((const char *)slots[s].filename, name, FS_FILENAME_LEN))
+			continue;
+		loc->root_index = -1;
+		loc->block = block;
+		loc->slot = s;
+		*e = slots[s];
+		return 0;
+	}
+	return -1;
+}
+
+// Resolve @path down to the directory holding its last component: set @dir
+// to it, @dloc to where its own entry is, and @name to the last component.
+// Return -1 if the path is invalid, or goes through something that is not a
+// directory
+static int path_walk(const char *path, int *dir, struct entry_loc *dloc,
+	char *name) {
+	if (!path) return -1;
+	*dir = 0;
+	// Version 1 has no directories, and its file names are taken as they are
+	if (fs->version == 1) {
+		size_t len = strlen(path);
+		if (len == 0 || len >= FS_FILENAME_LEN) return -1;
+		memcpy(name, path, len + 1);
+		return 0;
+	}
+	for (;;) {
+		while (*path == '/') path++;
+		size_t len = strcspn(path, "/");
+		if (len == 0 || len >= FS_FILENAME_LEN) return -1;
+		memcpy(name, path, len);
+		name[len] = 0;
+		path += len;
+		while (*path == '/') path++;
+		if (*path == 0) return 0;
+		file_entry2 e;
+		if (dir_find(*dir, name, dloc, &e) || e.type != ENTRY_DIR) return -1;
+		*dir = e.first_data_block_index;
+	}
+}
+
+// Id of the open file whose entry is at @loc, -1 if it is not open
+static int node_lookup(const struct entry_loc *loc) {
+	for (int k = 0; k < FS_OPEN_MAX_COUNT; k++) {
+		struct node *n = &fs->nodes[k];
+		if (fs->maps[FS_FILE_MAX_COUNT + k].users && n->block == loc->block &&
+			n->slot == loc->slot)
+			return FS_FILE_MAX_COUNT + k;
+	}
+	return -1;
+}
+
+// Id of the file whose entry @e is at @loc, taking a node for it if it is not
+// open yet. There are as many nodes as file descriptors
+static int node_get(const struct entry_loc *loc, const file_entry2 *e) {
+	int id = node_lookup(loc);
+	for (int k = 0; id == -1 && k < FS_OPEN_MAX_COUNT; k++) {
+		if (fs->maps[FS_FILE_MAX_COUNT + k].users) continue;
+		fs->nodes[k].block = loc->block;
+		fs->nodes[k].slot = loc->slot;
+		fs->nodes[k].entry = *e;
+		id = FS_FILE_MAX_COUNT + k;
+	}
+	return id;
+}
+
+// Set the size in the entry at @loc of a directory. Called with alloc_lock
+// held
+static int dir_set_size(const struct entry_loc *loc, size_t size) {
+	if (loc->root_index >= 0) {
+		root_set_size(loc->root_index, size);
+		mark_root(loc->root_index);
+		return 0;
+	}
+	uint8_t *buf = fs->entry_buf;
+	if (dir_read(loc->block, buf)) return -1;
+	((file_entry2 *)buf)[loc->slot].filesize = size;
+	return dir_write(loc->block, buf, 0);
+}
+
+// Double the number of buckets of directory @dir, whose entry is at @dloc
+static int dir_grow(int dir, const struct entry_loc *dloc) {
+	struct dir_map *map = dir_map_get(dir);
+	if (!map) return -1;
+	int n = map->nblocks;
+	if (n > fs->data_blocks / 2) return -1;
+	int *blocks = realloc(map->blocks, 2 * n * sizeof(int));
+	if (!blocks) return -1;
+	map->blocks = blocks;
+	size_t bs = fs->block_size;
+	uint8_t *old = malloc((size_t)n * bs);
+	uint8_t *hi = malloc(bs);
+	if (!old || !hi) {
+		free(old);
+		free(hi);
+		return -1;
+	}
+	pthread_mutex_lock(&fs->alloc_lock);
+	// Every bucket is read before anything changes: one that cannot be,
+	// corrupted for instance, leaves the directory as it is
+	for (int i = 0; i < n; i++) {
+		if (dir_read(blocks[i], &old[(size_t)i * bs])) {
+			pthread_mutex_unlock(&fs->alloc_lock);
+			free(old);
+			free(hi);
+			return -1;
+		}
+	}
+	// The new buckets are chained after the others
+	int got = 0;
+	while (got < n) {
+		int start;
+		int k = alloc_run(n - got, &start);
+		if (k == 0) break;
+		for (int b = 0; b < k; b++) blocks[n + got + b] = start + b;
+		got += k;
+	}
+	if (got < n) {
+		for (int b = 0; b < got; b++) mark_free(blocks[n + b]);
+		pthread_mutex_unlock(&fs->alloc_lock);
+		free(old);
+		free(hi);
+		return -1;
+	}
+	for (int b = n - 1; b < 2 * n - 1; b++) fat_set(blocks[b], blocks[b + 1]);
+	fat_set(blocks[2 * n - 1], FAT_EOC);
+	map->nblocks = 2 * n;
+	// The entries of bucket @i whose hash has bit @n set move to bucket
+	// @i + @n, in the same slot
+	int ret = 0;
+	for (int i = 0; i < n; i++) {
+		uint8_t *lo = &old[(size_t)i * bs];
+		memset(hi, 0, bs);
+		file_entry2 *from = (file_entry2 *)lo, *to = (file_entry2 *)hi;
+		for (int s = 0; s < dir_slots(); s++) {
+			if (from[s].filename[0] == 0 ||
+				!(name_hash32((const char *)from[s].filename) & n))
+				continue;
+			to[s] = from[s];
+			memset(&from[s], 0, sizeof(file_entry2));
+			// Open files follow their entry
+			struct entry_loc old = { -1, blocks[i], s };
+			int id = node_lookup(&old);
+			if (id != -1) fs->nodes[id - FS_FILE_MAX_COUNT].block =
+				blocks[n + i];
+		}
+		if (dir_write(blocks[i], lo, 0) || dir_write(blocks[n + i], hi, 1))
+			ret = -1;
+	}
+	if (dir_set_size(dloc, (size_t)2 * n * bs)) ret = -1;
+	pthread_mutex_unlock(&fs->alloc_lock);
+	free(old);
+	free(hi);
+	return ret;
+}
+
+// Add entry @e to directory @dir, whose own entry is at @dloc. Return -1 if
+// its name is taken or the directory cannot grow
+static int dir_insert(int dir, const struct entry_loc *dloc,
+	const file_entry2 *e) {
+	const char *name = (const char *)e->filename;
+	uint32_t h = name_hash32(name);
+	for (;;) {
+		struct dir_map *map = dir_map_get(dir);
+		if (!map) return -1;
+		int block = map->blocks[h & (map->nblocks - 1)];
+		if (dir_read(block, fs->dir_buf)) return -1;
+		file_entry2 *slots = (file_entry2 *)fs->dir_buf;
+		int slot = -1;
+		for (int s = 0; s < dir_slots(); s++) {
+			if (slots[s].filename[0] == 0) {
+				if (slot == -1) slot = s;
+			} else if (!strncmp((const char *)slots[s].filename, name,
+				FS_FILENAME_LEN)) {
+				return -1;
+			}
+		}
+		if (slot != -1) {
+			pthread_mutex_lock(&fs->alloc_lock);
+			int ret = entry_store(block, slot, e);
+			pthread_mutex_unlock(&fs->alloc_lock);
+			return ret;
+		}
+		if (dir_grow(dir, dloc)) return -1;
+	}
+}
+
+// Whether directory @dir holds no entry
+static int dir_empty(int dir) {
+	struct dir_map *map = dir_map_get(dir);
+	if (!map) return 0;
+	for (int b = 0; b < map->nblocks; b++) {
+		if (dir_read(map->blocks[b], fs->dir_buf)) return 0;
+		file_entry2 *slots = (file_entry2 *)fs->dir_buf;
+		for (int s = 0; s < dir_slots(); s++)
+			if (slots[s].filename[0] != 0) return 0;
+	}
+	return 1;
+}
+
+// Add entry @e to the root directory. Return -1 if it is full
+static int root_insert(const file_entry2 *e) {
+	int i = slot_take();
+	if (i == -1) return -1;
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (fs->version == 2) {
+		*entry2(i) = *e;
+	} else {
+		strcpy((char*)fs->fs_root_dir->dir[i].filename,
+			(const char *)e->filename);
+		root_set_size(i, e->filesize);
+		root_set_first(i, (int)e->first_data_block_index);
+	}
+	mark_root(i);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	name_insert(i);
+	return 0;
+}
+
+// Remove entry @e, which is at @loc, and free the blocks of what it held
+static void entry_remove(const struct entry_loc *loc, const file_entry2 *e) {
+	// A packed file has no chain of its own
+	int first = e->frag ? FAT_EOC : (int)e->first_data_block_index;
+	if (loc->root_index >= 0) {
+		int i = loc->root_index;
+		name_remove(i);
+		slot_put(i);
+		map_drop(i);
+		cluster_drop(i);
+		pthread_mutex_lock(&fs->alloc_lock);
+		// Set the first char of its filename to a zero i.e. "\0"
+		fs->fs_root_dir->dir[i].filename[0] = 0;
+		mark_root(i);
+		if (e->type == ENTRY_DIR) dir_revoke_chain(first);
+		chain_free(first);
+		pthread_mutex_unlock(&fs->alloc_lock);
+	} else {
+		file_entry2 none;
+		memset(&none, 0, sizeof(none));
+		pthread_mutex_lock(&fs->alloc_lock);
+		if (e->type == ENTRY_DIR) dir_revoke_chain(first);
+		chain_free(first);
+		entry_store(loc->block, loc->slot, &none);
+		pthread_mutex_unlock(&fs->alloc_lock);
+	}
+	// Its units are given back once nothing points to them
+	if (e->frag) {
+		pthread_rwlock_wrlock(&fs->frag_lock);
+		frag_release((int)e->first_data_block_index, e->frag,
+			frag_units(e->filesize));
+		pthread_rwlock_unlock(&fs->frag_lock);
+	}
+}
+
+// -- Metadata journal -- //
+// Metadata updates are grouped in transactions, which fs_sync() appends to a
+// circular region of data blocks with a single write. The FAT and root
+// directory blocks themselves are only written at a checkpoint, once the
+// journal fills up or on fs_umount(), after which the journal is empty again.
+// Mounting replays the transactions written since the last checkpoint. On a
+// checksummed disk, it then writes all of the metadata again, as a crash may
+// have left some of it on the disk without its checksums.
+
+#define JOURNAL_MAGIC 0x4c4e524a
+// Size of a new journal, in blocks
+#define JOURNAL_BLOCKS 64
+#define JOURNAL_MIN_BLOCKS 4
+
+// Header of a transaction, at the start of its first block, followed by
+// @nbytes bytes of records
+struct __attribute__((packed)) journal_header {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t nblocks;
+	uint32_t nbytes;
+	uint32_t checksum;
+};
+
+// FAT entries @index to @index + @count - 1 each point to the next one, and
+// the last one holds @value
+#define JR_FAT_CHAIN 1
+// FAT entries @index to @index + @count - 1 all hold @value
+#define JR_FAT_FILL 2
+// Root entry @index is the file_entry that follows the record
+#define JR_DIR 3
+// Slot @value of directory block @index is the file_entry2 that follows the
+// record
+#define JR_DIRENT 4
+// Directory block @index starts anew, empty
+#define JR_DIRZERO 5
+// Directory block @index is freed: the records before this one for it are
+// not to be applied
+#define JR_DIRREVOKE 6
+
+struct __attribute__((packed)) journal_record {
+	uint8_t type;
+	uint8_t pad;
+	uint16_t index;
+	uint16_t count;
+	uint16_t value;
+};
+
+// Record of a version 2 file system. Records are handled in this form, and
+// stored as a journal_record on a version 1 file system
+struct __attribute__((packed)) journal_record2 {
+	uint8_t type;
+	uint8_t pad[3];
+	uint32_t index;
+	uint32_t count;
+	uint32_t value;
+};
+
+// Size of a record on the disk
+static size_t record_size(void) {
+	return fs->version == 1 ? sizeof(struct journal_record) :
+		sizeof(struct journal_record2);
+}
+
+// Store record @rec at @buf in the format of the disk
+static void record_put(uint8_t *buf, const struct journal_record2 *rec) {
+	if (fs->version == 1) {
+		struct journal_record r = { rec->type, 0, rec->index, rec->count,
+			rec->value };
+		memcpy(buf, &r, sizeof(r));
+	} else {
+		memcpy(buf, rec, sizeof(*rec));
+	}
+}
+
+static void record_get(const uint8_t *buf, struct journal_record2 *rec) {
+	if (fs->version == 1) {
+		struct journal_record r;
+		memcpy(&r, buf, sizeof(r));
+		rec->type = r.type;
+		rec->index = r.index;
+		rec->count = r.count;
+		rec->value = r.value;
+	} else {
+		memcpy(rec, buf, sizeof(*rec));
+	}
+}
+
+// Checksum of the records of a transaction (FNV-1a)
+static uint32_t journal_checksum(const uint8_t *buf, size_t len) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h ^= buf[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// Disk block of journal block @k
+static int journal_block(int k) {
+	return FAT_to_abs(fs->journal.start + k);
+}
+
+// Check the @len bytes of records in @buf, and apply them if @apply is set.
+// Return -1 if a record is invalid
+static int journal_apply(const uint8_t *buf, size_t len, int apply) {
+	uint32_t total = fs->data_blocks;
+	size_t pos = 0;
+	while (pos < len) {
+		struct journal_record2 rec;
+		if (len - pos < record_size()) return -1;
+		record_get(&buf[pos], &rec);
+		pos += record_size();
+		if (rec.type == JR_DIR) {
+			if (rec.index >= FS_FILE_MAX_COUNT) return -1;
+			if (len - pos < sizeof(file_entry)) return -1;
+			if (apply) {
+				memcpy(&fs->fs_root_dir->dir[rec.index], &buf[pos],
+					sizeof(file_entry));
+				mark_root(rec.index);
+			}
+			pos += sizeof(file_entry);
+			continue;
+		}
+		if (rec.type == JR_DIRENT || rec.type == JR_DIRZERO ||
+			rec.type == JR_DIRREVOKE) {
+			// Version 1 has no directories
+			if (fs->version == 1 || rec.index == 0 || rec.index >= total)
+				return -1;
+			if (rec.type != JR_DIRENT) {
+				if (!apply) continue;
+				if (rec.type == JR_DIRREVOKE) {
+					dir_revoke(rec.index);
+					continue;
+				}
+				memset(fs->entry_buf, 0, fs->block_size);
+				if (dir_write(rec.index, fs->entry_buf, 1)) return -1;
+				continue;
+			}
+			if (rec.value >= (uint32_t)dir_slots()) return -1;
+			if (len - pos < sizeof(file_entry2)) return -1;
+			if (apply && entry_store(rec.index, rec.value,
+				(const file_entry2 *)&buf[pos]))
+				return -1;
+			pos += sizeof(file_entry2);
+			continue;
+		}
+		if (rec.type != JR_FAT_CHAIN && rec.type != JR_FAT_FILL) return -1;
+		if (rec.count == 0 || rec.index >= total ||
+			rec.count > total - rec.index)
+			return -1;
+		for (uint32_t k = 0; apply && k < rec.count; k++) {
+			int last = (k == rec.count - 1);
+			fat_set(rec.index + k, (rec.type == JR_FAT_FILL || last) ?
+				rec.value : rec.index + k + 1);
+		}
+	}
+	return 0;
+}
+
+// Forget the metadata updated since the last commit
+static void journal_clear(void) {
+	struct journal *j = &fs->journal;
+	if (j->fat_pending) {
+		int total = fs->data_blocks;
+		memset(j->fat_pending, 0, (total + 63) / 64 * sizeof(uint64_t));
+	}
+	j->fat_count = 0;
+	memset(j->root_pending, 0, sizeof(j->root_pending));
+	// The directory blocks stay until they are written in place
+	pthread_mutex_lock(&fs->dir_lock);
+	for (int b = 0; b < DIR_UPDATE_BUCKETS; b++) {
+		struct dir_update *u = fs->dir_updates[b];
+		while (u) {
+			struct dir_update *next = u->next;
+			if (u->freed) {
+				dir_update_drop(u);
+			} else {
+				u->fresh = 0;
+				memset(u->pending, 0, dir_words() * sizeof(uint64_t));
+			}
+			u = next;
+		}
+	}
+	pthread_mutex_unlock(&fs->dir_lock);
+}
+
+// Record the journal in the superblock, and the transaction that replaying
+// it starts at
+static void sb_store(void) {
+	struct journal *j = &fs->journal;
+	if (fs->version == 1) {
+		struct superblock *sb = fs->fs_superblock;
+		sb->journal_magic = JOURNAL_MAGIC;
+		sb->journal_start = j->start;
+		sb->journal_blocks = j->nblocks;
+		sb->journal_seq = j->seq;
+		sb->journal_tail = j->head;
+	} else {
+		struct superblock2 *sb = (struct superblock2 *)fs->fs_superblock;
+		sb->journal_magic = JOURNAL_MAGIC;
+		sb->journal_start = j->start;
+		sb->journal_blocks = j->nblocks;
+		sb->journal_seq = j->seq;
+		sb->journal_tail = j->head;
+	}
+}
+
+static int journal_write(int at, uint8_t *buf, int nblocks);
+
+// Write the metadata in place and empty the journal
+static int journal_checkpoint(void) {
+	struct superblock *sb = fs->fs_superblock;
+	struct journal *j = &fs->journal;
+	struct meta_copy copy, dirs;
+	int ret = 0;
+	// Everything updated so far is written in place, and needs no commit
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (dir_snapshot(&dirs)) {
+		ret = -1;
+	} else if (meta_snapshot(&copy)) {
+		meta_free(&dirs);
+		ret = -1;
+	} else {
+		journal_clear();
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (ret) return -1;
+	// On a checksummed disk, a crash while the metadata goes in place must
+	// leave a transaction to replay, telling mounting to recover (see
+	// journal_pending()): an empty one if there is none
+	if ((fs->features & FEATURE_CHECKSUM) && !fs->mapped && j->used == 0 &&
+		(copy.n || dirs.n)) {
+		uint8_t *mark = calloc(1, fs->block_size);
+		struct journal_header hdr = { JOURNAL_MAGIC, j->seq, 1, 0,
+			journal_checksum(NULL, 0) };
+		if (mark) memcpy(mark, &hdr, sizeof(hdr));
+		if (!mark || journal_write(j->head, mark, 1)) {
+			ret = -1;
+		} else {
+			j->head = (j->head + 1) % j->nblocks;
+			j->seq++;
+		}
+		free(mark);
+	}
+	// The data, then the metadata that points to it
+	if (block_sync()) ret = -1;
+	if (meta_write(&copy)) ret = -1;
+	if (meta_write(&dirs)) ret = -1;
+	if (block_sync()) ret = -1;
+	// On failure the journal still holds what was committed, and the next
+	// commit tries again
+	if (ret) {
+		j->failed = 1;
+		return -1;
+	}
+	// Until the superblock is in place, the journal it points to is still
+	// replayed: its checksum goes ahead of it
+	sb_store();
+	if (fs->mapped ? block_sync() : block_write_sync(0, sb)) {
+		j->failed = 1;
+		return -1;
+	}
+	j->used = 0;
+	j->failed = 0;
+	return 0;
+}
+
+// Write @nblocks blocks from @buf at journal block @at, wrapping around the
+// end of the journal
+static int journal_write(int at, uint8_t *buf, int nblocks) {
+	struct iovec iov[16];
+	while (nblocks > 0) {
+		int n = fs->journal.nblocks - at;
+		if (n > nblocks) n = nblocks;
+		if (n > 16) n = 16;
+		for (int k = 0; k < n; k++) {
+			iov[k].iov_base = buf + k * fs->block_size;
+			iov[k].iov_len = fs->block_size;
+		}
+		if (block_writev(journal_block(at), n, iov)) return -1;
+		buf += n * fs->block_size;
+		nblocks -= n;
+		at = (at + n) % fs->journal.nblocks;
+	}
+	return 0;
+}
+
+// Append the metadata updated since the last commit to the journal as a
+// single transaction, and make it durable
+static int journal_commit(void) {
+	struct journal *j = &fs->journal;
+	int total = fs->data_blocks;
+	// Updates keep going while the transaction is written: it is built from
+	// the metadata as it is now
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (j->failed) {
+		pthread_mutex_unlock(&fs->alloc_lock);
+		return journal_checkpoint();
+	}
+	int nroot = 0, nblock = 0, nslot = 0;
+	for (int w = 0; w < FS_FILE_MAX_COUNT / 64; w++)
+		nroot += __builtin_popcountll(j->root_pending[w]);
+	// Directory blocks are only updated with alloc_lock held
+	pthread_mutex_lock(&fs->dir_lock);
+	for (int b = 0; b < DIR_UPDATE_BUCKETS; b++) {
+		for (struct dir_update *u = fs->dir_updates[b]; u; u = u->next) {
+			nblock += u->freed || u->fresh;
+			for (int w = 0; w < dir_words(); w++)
+				nslot += __builtin_popcountll(u->pending[w]);
+		}
+	}
+	pthread_mutex_unlock(&fs->dir_lock);
+	if (j->fat_count == 0 && nroot == 0 && nblock == 0 && nslot == 0) {
+		pthread_mutex_unlock(&fs->alloc_lock);
+		return 0;
+	}
+	// Records take at most one per FAT entry and directory block, and two
+	// per root or directory entry
+	size_t cap = sizeof(struct journal_header) + (j->fat_count + nblock) *
+		record_size() + nroot * (record_size() + sizeof(file_entry)) +
+		nslot * (record_size() + sizeof(file_entry2));
+	cap = (cap + fs->block_size - 1) / fs->block_size * fs->block_size;
+	uint8_t *buf = calloc(1, cap);
+	if (!buf) {
+		pthread_mutex_unlock(&fs->alloc_lock);
+		return -1;
+	}
+	size_t len = sizeof(struct journal_header);
+	struct journal_record2 rec = { 0 };
+	// Runs of updated FAT entries are logged as chains or fills
+	for (int i = 0; i < total; ) {
+		if (!j->fat_pending[i / 64]) {
+			i = (i / 64 + 1) * 64;
+			continue;
+		}
+		if (!(j->fat_pending[i / 64] & (1ULL << (i % 64)))) {
+			i++;
+			continue;
+		}
+		int end = i + 1;
+#define PENDING(k) (j->fat_pending[(k) / 64] & (1ULL << ((k) % 64)))
+		if (fat_get(i) == i + 1) {
+			rec.type = JR_FAT_CHAIN;
+			while (end < total && PENDING(end) && fat_get(end - 1) == end)
+				end++;
+		} else {
+			rec.type = JR_FAT_FILL;
+			while (end < total && PENDING(end) && fat_get(end) == fat_get(i))
+				end++;
+		}
+#undef PENDING
+		rec.index = i;
+		rec.count = end - i;
+		rec.value = fat_get(end - 1);
+		record_put(&buf[len], &rec);
+		len += record_size();
+		i = end;
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (!(j->root_pending[i / 64] & (1ULL << (i % 64)))) continue;
+		rec.type = JR_DIR;
+		rec.index = i;
+		rec.count = 1;
+		rec.value = 0;
+		record_put(&buf[len], &rec);
+		len += record_size();
+		memcpy(&buf[len], &fs->fs_root_dir->dir[i], sizeof(file_entry));
+		len += sizeof(file_entry);
+	}
+	pthread_mutex_lock(&fs->dir_lock);
+	for (int b = 0; b < DIR_UPDATE_BUCKETS; b++) {
+		for (struct dir_update *u = fs->dir_updates[b]; u; u = u->next) {
+			rec.index = u->block;
+			rec.count = 1;
+			rec.value = 0;
+			if (u->freed || u->fresh) {
+				rec.type = u->freed ? JR_DIRREVOKE : JR_DIRZERO;
+				record_put(&buf[len], &rec);
+				len += record_size();
+			}
+			for (int s = 0; s < dir_slots(); s++) {
+				if (!(u->pending[s / 64] & (1ULL << (s % 64)))) continue;
+				rec.type = JR_DIRENT;
+				rec.value = s;
+				record_put(&buf[len], &rec);
+				len += record_size();
+				memcpy(&buf[len], &u->data[s * sizeof(file_entry2)],
+					sizeof(file_entry2));
+				len += sizeof(file_entry2);
+			}
+		}
+	}
+	pthread_mutex_unlock(&fs->dir_lock);
+	struct journal_header hdr;
+	hdr.magic = JOURNAL_MAGIC;
+	hdr.seq = j->seq;
+	hdr.nblocks = (len + fs->block_size - 1) / fs->block_size;
+	hdr.nbytes = len - sizeof(hdr);
+	hdr.checksum = journal_checksum(&buf[sizeof(hdr)], hdr.nbytes);
+	memcpy(buf, &hdr, sizeof(hdr));
+	if (j->used + (int)hdr.nblocks > j->nblocks) {
+		// No room left: write the metadata in place instead
+		pthread_mutex_unlock(&fs->alloc_lock);
+		free(buf);
+		return journal_checkpoint();
+	}
+	// The directory blocks as the transaction leaves them. Those left
+	// unwritten by memory running out go with a later commit
+	struct meta_copy dirs;
+	dir_snapshot(&dirs);
+	journal_clear();
+	pthread_mutex_unlock(&fs->alloc_lock);
+	// The data reaches the disk before the transaction that points to it
+	int ret = block_sync();
+	if (!ret) ret = journal_write(j->head, buf, hdr.nblocks);
+	if (!ret) ret = block_sync();
+	if (!ret) {
+		j->head = (j->head + hdr.nblocks) % j->nblocks;
+		j->used += hdr.nblocks;
+		// Replaying now rebuilds what the directory blocks hold, and they
+		// may go in place. A block that fails to stays in memory
+		meta_write(&dirs);
+	} else {
+		meta_free(&dirs);
+		// Whatever reached the journal is never replayed, and the updates it
+		// held are written by a checkpoint instead
+		j->failed = 1;
+	}
+	j->seq++;
+	free(buf);
+	return ret;
+}
+
+// Whether the journal starts with a transaction to replay, from the header of
+// its first block alone. It is read before checksums are enabled, around the
+// cache so that replaying reads it again, checked
+static int journal_pending(void) {
+	struct journal *j = &fs->journal;
+	if (!j->present || j->nblocks <= 0 || j->head < 0 ||
+		j->head >= j->nblocks || j->start <= 0 ||
+		j->start > fs->data_blocks - j->nblocks)
+		return 0;
+	uint8_t *buf = malloc(fs->block_size);
+	struct iovec iov = { buf, fs->block_size };
+	struct journal_header hdr;
+	int pending = buf && !block_readv(journal_block(j->head), 1, &iov);
+	if (pending) {
+		memcpy(&hdr, buf, sizeof(hdr));
+		pending = hdr.magic == JOURNAL_MAGIC && hdr.seq == j->seq;
+	}
+	free(buf);
+	return pending;
+}
+
+// Mark the whole FAT and root directory dirty, and write again the blocks of
+// every directory that replaying left alone, so that the checkpoint that
+// follows brings all of their checksums up to date
+static int journal_rewrite(void) {
+	memset(fs->fat_dirty, 1, fs->fat_blocks);
+	fs->root_dirty = 1;
+	if (fs->version == 1) return 0;
+	// The first blocks of the directories left to walk
+	int n = 0, cap = FS_FILE_MAX_COUNT, visited = 0, ret = 0;
+	int *todo = malloc(cap * sizeof(int));
+	if (!todo) return -1;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		file_entry2 e;
+		root_entry(i, &e);
+		if (e.filename[0] && e.type == ENTRY_DIR)
+			todo[n++] = e.first_data_block_index;
+	}
+	while (n > 0 && !ret) {
+		// A chain that loops or leaves the data blocks is corrupted
+		for (int cur = todo[--n]; !ret && cur != FAT_EOC; cur = fat_get(cur)) {
+			if (cur <= 0 || cur >= fs->data_blocks ||
+				++visited > fs->data_blocks || dir_read(cur, fs->dir_buf)) {
+				ret = -1;
+				break;
+			}
+			pthread_mutex_lock(&fs->dir_lock);
+			int updated = dir_update_find(cur) != NULL;
+			pthread_mutex_unlock(&fs->dir_lock);
+			if (!updated && block_write(FAT_to_abs(cur), fs->dir_buf))
+				ret = -1;
+			file_entry2 *slots = (file_entry2 *)fs->dir_buf;
+			for (int s = 0; !ret && s < dir_slots(); s++) {
+				if (!slots[s].filename[0] || slots[s].type != ENTRY_DIR)
+					continue;
+				if (n == cap) {
+					int *more = realloc(todo, 2 * cap * sizeof(int));
+					if (!more) {
+						ret = -1;
+						break;
+					}
+					todo = more;
+					cap *= 2;
+				}
+				todo[n++] = slots[s].first_data_block_index;
+			}
+		}
+	}
+	free(todo);
+	return ret;
+}
+
+// Apply the transactions written since the last checkpoint, then checkpoint
+static int journal_replay(void) {
+	struct journal *j = &fs->journal;
+	// Replay starts where the superblock says
+	int nblocks = j->nblocks;
+	if (nblocks <= 0 || j->head < 0 || j->head >= nblocks || j->start <= 0 ||
+		j->start > fs->data_blocks - nblocks)
+		return -1;
+	// On a checksummed disk, mounting already found out whether there is
+	// anything to replay, and leaves the blocks past the last transaction
+	// unread: a crash may have left them failing their checksums
+	if ((fs->features & FEATURE_CHECKSUM) && !j->recover) return 0;
+	uint8_t *buf = malloc((size_t)nblocks * fs->block_size);
+	if (!buf) return -1;
+	int done = 0, replayed = 0;
+	struct journal_header hdr;
+	// Transactions that fail their checksums were torn by a crash
+	block_checksum_lenient(0);
+	while (done < nblocks) {
+		if (block_read(journal_block(j->head), buf)) break;
+		memcpy(&hdr, buf, sizeof(hdr));
+		// Stop at the first block that does not start the next transaction
+		if (hdr.magic != JOURNAL_MAGIC || hdr.seq != j->seq) break;
+		if (hdr.nblocks == 0 || hdr.nblocks > (uint32_t)(nblocks - done))
+			break;
+		if (hdr.nbytes > hdr.nblocks * fs->block_size - sizeof(hdr)) break;
+		int k;
+		for (k = 1; k < (int)hdr.nblocks; k++) {
+			if (block_read(journal_block((j->head + k) % nblocks),
+				&buf[k * fs->block_size]))
+				break;
+		}
+		if (k < (int)hdr.nblocks) break;
+		// A transaction torn by a crash is ignored, like the ones after it
+		uint8_t *records = &buf[sizeof(hdr)];
+		if (journal_checksum(records, hdr.nbytes) != hdr.checksum) break;
+		if (journal_apply(records, hdr.nbytes, 0)) break;
+		// Directory entries can fail to apply, for lack of memory. The
+		// blocks they go to are read as they are while recovering
+		block_checksum_lenient(j->recover);
+		int err = journal_apply(records, hdr.nbytes, 1);
+		block_checksum_lenient(0);
+		if (err) {
+			free(buf);
+			return -1;
+		}
+		j->head = (j->head + hdr.nblocks) % nblocks;
+		j->seq++;
+		done += hdr.nblocks;
+		replayed++;
+	}
+	free(buf);
+	if (j->recover) {
+		block_checksum_lenient(1);
+		int err = journal_rewrite();
+		block_checksum_lenient(0);
+		j->recover = 0;
+		if (err) return -1;
+		return journal_checkpoint();
+	}
+	if (replayed) return journal_checkpoint();
+	return 0;
+}
+
+// Reserve a run of data blocks for a new journal
+static int journal_create(void) {
+	int want = fs->data_blocks / 16;
+	if (want > JOURNAL_BLOCKS) want = JOURNAL_BLOCKS;
+	if (want < JOURNAL_MIN_BLOCKS) want = JOURNAL_MIN_BLOCKS;
+	int start;
+	int got = alloc_run(want, &start);
+	if (got < JOURNAL_MIN_BLOCKS) {
+		for (int b = 0; b < got; b++) mark_free(start + b);
+		return -1;
+	}
+	// The journal looks like an allocated chain to tools that ignore it
+	for (int b = 0; b < got; b++)
+		fat_set(start + b, (b == got - 1) ? FAT_EOC : start + b + 1);
+	fs->journal.present = 1;
+	fs->journal.start = start;
+	fs->journal.nblocks = got;
+	fs->journal.head = 0;
+	fs->journal.seq = 1;
+	return journal_checkpoint();
+}
+
+// Create the journal if asked to on mount, and start journaling
+static int journal_init(int flags) {
+	if (!fs->journal.present) {
+		if (!(flags & FS_MOUNT_JOURNAL)) return 0;
+		if (journal_create()) return -1;
+	}
+	// Mapped metadata reaches the disk whenever the kernel writes it, so
+	// it cannot be journaled
+	if (fs->mapped) return 0;
+	int total = fs->data_blocks;
+	fs->journal.fat_pending = calloc((total + 63) / 64, sizeof(uint64_t));
+	if (!fs->journal.fat_pending) return -1;
+	fs->journal.on = 1;
+	return 0;
+}
+
+// Read the layout of the disk and the state of its journal from the
+// superblock. Return -1 if it does not describe a file system that fits
+// the disk
+static int sb_load(void) {
+	struct superblock *sb = fs->fs_superblock;
+	struct superblock2 *sb2 = (struct superblock2 *)fs->fs_superblock;
+	struct journal *j = &fs->journal;
+	if (!memcmp(sb->signature, FS_SIGNATURE, 8)) {
+		if (fs->block_size != BLOCK_SIZE) return -1;
+		fs->version = 1;
+		fs->fat_blocks = sb->num_of_blocks_for_FAT;
+		fs->root_block = sb->root_dir_index;
+		fs->data_blocks = sb->amount_of_data_blocks;
+		fs->fat_per_block = fs->block_size / sizeof(uint16_t);
+		j->present = sb->journal_magic == JOURNAL_MAGIC;
+		j->start = sb->journal_start;
+		j->nblocks = sb->journal_blocks;
+		j->seq = sb->journal_seq;
+		j->head = sb->journal_tail;
+	} else {
+		// Block numbers are handled as int, FAT_EOC apart
+		if (sb2->num_of_blocks_for_FAT >= INT_MAX ||
+			sb2->root_dir_index >= INT_MAX ||
+			sb2->amount_of_data_blocks >= INT_MAX ||
+			sb2->journal_start >= INT_MAX || sb2->journal_blocks >= INT_MAX ||
+			sb2->journal_tail >= INT_MAX)
+			return -1;
+		// The disk was opened with the block size of the superblock
+		if ((sb2->block_size ? (int)sb2->block_size : BLOCK_SIZE) !=
+			fs->block_size)
+			return -1;
+		if (sb2->features & ~FEATURES_KNOWN) return -1;
+		// A cluster spans two blocks at least
+		if ((sb2->features & FEATURE_COMPRESSED) &&
+			fs->block_size > CLUSTER_BYTES / 2)
+			return -1;
+		fs->version = 2;
+		fs->features = sb2->features;
+		fs->fat_blocks = sb2->num_of_blocks_for_FAT;
+		fs->root_block = sb2->root_dir_index;
+		fs->data_blocks = sb2->amount_of_data_blocks;
+		fs->fat_per_block = fs->block_size / sizeof(uint32_t);
+		j->present = sb2->journal_magic == JOURNAL_MAGIC;
+		j->start = sb2->journal_start;
+		j->nblocks = sb2->journal_blocks;
+		j->seq = sb2->journal_seq;
+		j->head = sb2->journal_tail;
+	}
+	fs->root_blocks = (sizeof(struct root_dir) + fs->block_size - 1) /
+		fs->block_size;
+	// The FAT covers the data blocks, and everything fits on the disk
+	long long end = (long long)fs->data_blocks + fs->fat_blocks + 1 +
+		fs->root_blocks;
+	if (fs->data_blocks < 1 || fs->root_block != fs->fat_blocks + 1 ||
+		(long long)fs->fat_blocks * fs->fat_per_block < fs->data_blocks ||
+		end > block_disk_count())
+		return -1;
+	// The checksum area follows the data blocks, up to the end of the disk,
+	// and has room for all of them
+	if ((fs->features & FEATURE_CHECKSUM) &&
+		(sb2->checksum_start != end || (long long)sb2->checksum_start +
+		sb2->checksum_blocks != block_disk_count() ||
+		(long long)sb2->checksum_blocks * (fs->block_size / 4) < end))
+		return -1;
+	return 0;
+}
+
+// Release the in-core state of the file system
+static void fs_free(void) {
+	if (!fs->mapped) {
+		// Free allocated structure memory:
+		free(fs->fs_superblock);
+		free(fs->fs_FAT);
+		free(fs->fs_root_dir);
+	}
+	for (int i = 0; i < NODE_COUNT; i++) {
+		map_drop(i);
+		cluster_drop(i);
+	}
+	for (int k = 0; k < DIR_MAPS; k++) free(fs->dir_maps[k].blocks);
+	for (int b = 0; b < DIR_UPDATE_BUCKETS; b++)
+		while (fs->dir_updates[b]) dir_update_drop(fs->dir_updates[b]);
+	free(fs->dir_buf);
+	free(fs->entry_buf);
+	free(fs->frags);
+	free(fs->frag_buf);
+	free(fs->pack_buf);
+	free(fs->used_map);
+	free(fs->fat_dirty);
+	free(fs->journal.fat_pending);
+	pthread_rwlock_destroy(&fs->frag_lock);
+	pthread_mutex_destroy(&fs->alloc_lock);
+	pthread_mutex_destroy(&fs->dir_lock);
+	for (int i = 0; i < NODE_COUNT; i++)
+		pthread_rwlock_destroy(&fs->file_locks[i]);
+	pthread_mutex_destroy(&fs->sync_lock);
+	pthread_mutex_destroy(&fs->flusher_lock);
+	pthread_cond_destroy(&fs->flusher_cond);
+	pthread_mutex_destroy(&fs->table_lock);
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		pthread_mutex_destroy(&fs->filedes_table[i].lock);
+	free(fs);
+	// Set the global vars back to NULL
+	fs = NULL;
+}
+
+// Block size of the file system on @diskname, from its superblock, and its
+// features in *@features. The superblock is read in blocks of the smallest
+// size, as the actual size is not known yet
+static int probe_block_size(const char *diskname, int *features) {
+	uint8_t buf[BLOCK_SIZE_MIN];
+	struct superblock2 *sb2 = (struct superblock2 *)buf;
+	if (block_size_set(BLOCK_SIZE_MIN)) return -1;
+	block_engine_set(BLOCK_ENGINE_SYNC);
+	if (block_disk_open(diskname)) return -1;
+	int err = block_read(0, buf);
+	block_disk_close();
+	if (err) return -1;
+	*features = 0;
+	if (memcmp(sb2->signature, FS_SIGNATURE2, 8)) return BLOCK_SIZE;
+	*features = sb2->features;
+	return sb2->block_size ? (int)sb2->block_size : BLOCK_SIZE;
+}
+
+static int do_mount(const char *diskname, int flags, struct disk *disk)
+{
+	// Is a file system already mounted?
+	if (fs) return -1;
+	int features;
+	int bsize = probe_block_size(diskname, &features);
+	if (bsize < 0 || block_size_set(bsize)) return -1;
+	// Checksums follow the blocks written through the block layer, which a
+	// mapping bypasses
+	int backend = (flags & FS_MOUNT_MMAP) && !(features & FEATURE_CHECKSUM) ?
+		BLOCK_BACKEND_MMAP : BLOCK_BACKEND_FD;
+	// Keep many blocks in flight with the best engine available
+	block_engine_set((flags & FS_MOUNT_ASYNC) ? BLOCK_ENGINE_AUTO :
+		BLOCK_ENGINE_SYNC);
+	// Is the disk already mounted/open?
+	if(block_disk_open_backend(diskname, backend) == -1) return -1;
+	// With a mapped disk, the metadata is used in place
+	int mapped = block_ptr(0) != NULL;
+	// Allocate new superblock struct to hold metainformation
+	struct superblock *new_superblock = block_ptr(0);
+	if (!mapped) {
+		// A version 1 superblock fills a whole block of the default size
+		new_superblock = malloc(bsize > (int)sizeof(struct superblock) ?
+			(size_t)bsize : sizeof(struct superblock));
+		// Grab the superblock at index 0 of disk
+		if (new_superblock && block_read(0, new_superblock)) {
+			free(new_superblock);
+			new_superblock = NULL;
+		}
+	}
+	// Check the signature of the disk, of either version
+	if (!new_superblock ||
+		(memcmp(new_superblock->signature, FS_SIGNATURE, 8) &&
+		memcmp(new_superblock->signature, FS_SIGNATURE2, 8))) {
+		// Invalid disk signature
+		if (!mapped) free(new_superblock);
+		block_disk_close();
+		return -1;
+	}
+	// Allocate file system structure to preserve changes:
+	fs = calloc(1, sizeof(struct filesystem));
+	if (!fs) {
+		if (!mapped) free(new_superblock);
+		block_disk_close();
+		return -1;
+	}
+	pthread_rwlock_init(&fs->frag_lock, NULL);
+	pthread_mutex_init(&fs->alloc_lock, NULL);
+	pthread_mutex_init(&fs->dir_lock, NULL);
+	for (int i = 0; i < NODE_COUNT; i++)
+		pthread_rwlock_init(&fs->file_locks[i], NULL);
+	pthread_mutex_init(&fs->sync_lock, NULL);
+	pthread_mutex_init(&fs->flusher_lock, NULL);
+	pthread_cond_init(&fs->flusher_cond, NULL);
+	pthread_mutex_init(&fs->table_lock, NULL);
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		pthread_mutex_init(&fs->filedes_table[i].lock, NULL);
+	fs->disk = disk;
+	fs->fs_superblock = new_superblock;
+	fs->mapped = mapped;
+	fs->block_size = bsize;
+	// From now on, the blocks read are checked unless the journal tells
+	// there was a crash to recover from. The superblock, read before, is
+	// read again to be checked too
+	struct superblock2 *sb2 = (struct superblock2 *)new_superblock;
+	int err = sb_load();
+	if (!err && (fs->features & FEATURE_CHECKSUM)) {
+		fs->journal.recover = !mapped && journal_pending();
+		err = block_checksum_lenient(fs->journal.recover) ||
+			block_checksum_enable(sb2->checksum_start, sb2->checksum_blocks) ||
+			block_read(0, new_superblock);
+	}
+	if (err) {
+		fs_free();
+		block_disk_close();
+		return -1;
+	}
+	fs->fat_dirty = calloc(fs->fat_blocks, 1);
+	fs->dir_buf = malloc(fs->block_size);
+	fs->entry_buf = malloc(fs->block_size);
+	if (mapped) {
+		// The FAT blocks directly follow the superblock
+		fs->fs_FAT = block_ptr(1);
+		fs->fs_root_dir = block_ptr(fs->root_block);
+	} else {
+		// Allocate enough space for the FAT array
+		uint8_t *new_fat = malloc((size_t)fs->fat_blocks * fs->block_size);
+		// Allocate a new root directory
+		struct root_dir *new_root_dir = malloc((size_t)fs->root_blocks *
+			fs->block_size);
+		fs->fs_FAT = new_fat;
+		fs->fs_root_dir = new_root_dir;
+		// Read the FAT data in, it is kept in its on-disk layout
+		err = !new_fat || !new_root_dir;
+		for (int i = 1; !err && i <= fs->fat_blocks; i++)
+			err = block_read(i, &new_fat[(size_t)(i - 1) * fs->block_size]);
+		// Read in the root directory
+		for (int i = 0; !err && i < fs->root_blocks; i++)
+			err = block_read(fs->root_block + i, (uint8_t *)new_root_dir +
+				(size_t)i * fs->block_size);
+		if (err) {
+			fs_free();
+			block_disk_close();
+			return -1;
+		}
+	}
+	// Find out which data blocks are free and which hold packed files, and
+	// bring the metadata up to date with the journal
+	if (!fs->fat_dirty || !fs->dir_buf || !fs->entry_buf ||
+		(fs->journal.present && journal_replay()) ||
+		alloc_init() || frag_init() || journal_init(flags)) {
+		fs_free();
+		block_disk_close();
+		return -1;
+	}
+	dir_index_init();
+	return 0;
+}
+
+static int do_sync(void)
+{
+	if (!fs) return -1;
+	int ret = 0;
+	pthread_mutex_lock(&fs->sync_lock);
+	// Buffered bytes first, so that the metadata below accounts for them
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		filedes *fdes = &fs->filedes_table[i];
+		pthread_mutex_lock(&fdes->lock);
+		if (fdes->open && fdes->wb_size) {
+			pthread_rwlock_wrlock(&fs->file_locks[fdes->root_index]);
+			if (wb_flush(i)) ret = -1;
+			pthread_rwlock_unlock(&fs->file_locks[fdes->root_index]);
+		}
+		pthread_mutex_unlock(&fdes->lock);
+	}
+	if (fs->journal.on) {
+		// A single transaction makes the metadata durable
+		if (journal_commit()) ret = -1;
+	} else {
+		struct meta_copy copy;
+		pthread_mutex_lock(&fs->alloc_lock);
+		if (meta_snapshot(&copy)) ret = -1;
+		pthread_mutex_unlock(&fs->alloc_lock);
+		// Data reaches the disk before the metadata that points to it
+		if (block_cache_flush()) ret = -1;
+		if (meta_write(&copy)) ret = -1;
+		if (block_cache_flush()) ret = -1;
+	}
+	pthread_mutex_unlock(&fs->sync_lock);
+	return ret;
+}
+
+// Body of the background flusher thread, which syncs the file system every
+// flusher_ms milliseconds until it is told to stop
+static void *flusher_main(void *arg) {
+	fs = arg;
+	block_disk_select(fs->disk);
+	pthread_mutex_lock(&fs->flusher_lock);
+	while (!fs->flusher_quit) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += fs->flusher_ms / 1000;
+		deadline.tv_nsec += (long)(fs->flusher_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		int err = 0;
+		while (!fs->flusher_quit && err != ETIMEDOUT)
+			err = pthread_cond_timedwait(&fs->flusher_cond,
+				&fs->flusher_lock, &deadline);
+		if (fs->flusher_quit) break;
+		// The entry points keep running while it syncs
+		pthread_mutex_unlock(&fs->flusher_lock);
+		do_sync();
+		pthread_mutex_lock(&fs->flusher_lock);
+	}
+	pthread_mutex_unlock(&fs->flusher_lock);
+	return NULL;
+}
+
+// Stop the background flusher if it runs, and wait for it to exit
+static void flusher_stop(void) {
+	if (!fs->flusher_on) return;
+	pthread_mutex_lock(&fs->flusher_lock);
+	fs->flusher_quit = 1;
+	pthread_cond_signal(&fs->flusher_cond);
+	pthread_mutex_unlock(&fs->flusher_lock);
+	pthread_join(fs->flusher, NULL);
+	fs->flusher_on = 0;
+}
+
+static int do_sync_interval(unsigned int ms)
+{
+	if (!fs) return -1;
+	flusher_stop();
+	if (ms == 0) return 0;
+	fs->flusher_ms = ms;
+	fs->flusher_quit = 0;
+	if (pthread_create(&fs->flusher, NULL, flusher_main, fs)) return -1;
+	fs->flusher_on = 1;
+	return 0;
+}
+
+static int do_umount(void)
+{
+	if (fs == NULL) return -1;
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (fs->filedes_table[i].open == 1) return -1;
+	}
+	flusher_stop();
+	int ret = 0;
+	// Write the modified FAT blocks and root_dir back to the disk. The file
+	// system goes away even if that fails, but the caller hears about it
+	if (fs->journal.on) {
+		if (journal_checkpoint()) ret = -1;
+	} else {
+		if (meta_writeback()) ret = -1;
+	}
+	// A mapped FAT and root_dir were modified in place, and get synced
+	// when the disk is closed
+	fs_free();
+	// Close the file
+	if(block_disk_close() == -1) ret = -1;
+	return ret;
+}
+
+static int do_info(void)
+{
+	if (!fs) return -1; // No disk has been opened
+	pthread_mutex_lock(&fs->table_lock);
+	pthread_mutex_lock(&fs->alloc_lock);
+	printf("FS Info:\n");
+	printf("total_blk_count=%d\n", fs->data_blocks + fs->fat_blocks + 1 +
+		fs->root_blocks);
+	printf("fat_blk_count=%d\n", fs->fat_blocks);
+	printf("rdir_blk=%d\n", fs->root_block);
+	printf("data_blk=%d\n", fs->root_block + fs->root_blocks);
+	printf("data_blk_count=%d\n", fs->data_blocks);
+	printf("fat_free_ratio=%d/%d\n", fs->free_count, fs->data_blocks);
+	int num_free_root_entries = 0;
+	for (int w = 0; w < FS_FILE_MAX_COUNT / 64; w++)
+		num_free_root_entries += __builtin_popcountll(fs->free_slots[w]);
+	printf("rdir_free_ratio=%d/%d\n",num_free_root_entries,
+		FS_FILE_MAX_COUNT);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pthread_mutex_unlock(&fs->table_lock);
+	return 0;
+}
+
+static int do_create(const char *filename)
+{
+	if (!fs) return -1;
+	char name[FS_FILENAME_LEN];
+	int dir;
+	struct entry_loc dloc, loc;
+	file_entry2 e;
+	pthread_mutex_lock(&fs->table_lock);
+	// Check that the directory exists, and has no file of the same name
+	if (path_walk(filename, &dir, &dloc, name) ||
+		!dir_find(dir, name, &loc, &e)) {
+		pthread_mutex_unlock(&fs->table_lock);
+		return -1;
+	}
+	// Create the new file, in the first empty spot of the root directory
+	memset(&e, 0, sizeof(e));
+	strcpy((char*)e.filename, name);
+	e.first_data_block_index = FAT_EOC;
+	int ret = dir == 0 ? root_insert(&e) : dir_insert(dir, &dloc, &e);
+	pthread_mutex_unlock(&fs->table_lock);
+	return ret;
+}
+
+static int do_delete(const char *filename)
+{
+	if (!fs) return -1;
+	char name[FS_FILENAME_LEN];
+	int dir;
+	struct entry_loc dloc, loc;
+	file_entry2 e;
+	pthread_mutex_lock(&fs->table_lock);
+	// Find the file
+	int found = !path_walk(filename, &dir, &dloc, name) &&
+		!dir_find(dir, name, &loc, &e) && e.type != ENTRY_DIR;
+	// If the file was not found, or is currently open; Return failure
+	if (!found || (loc.root_index >= 0 ? fs->maps[loc.root_index].users :
+		node_lookup(&loc) != -1)) {
+		pthread_mutex_unlock(&fs->table_lock);
+		return -1;
+	}
+	// We have found the file to delete, its blocks are freed
+	entry_remove(&loc, &e);
+	pthread_mutex_unlock(&fs->table_lock);
+	// return success
+	return 0;
+}
+
+static int do_mkdir(const char *path)
+{
+	if (!fs || fs->version == 1) return -1;
+	char name[FS_FILENAME_LEN];
+	int dir;
+	struct entry_loc dloc, loc;
+	file_entry2 e;
+	pthread_mutex_lock(&fs->table_lock);
+	if (path_walk(path, &dir, &dloc, name) || !dir_find(dir, name, &loc, &e)) {
+		pthread_mutex_unlock(&fs->table_lock);
+		return -1;
+	}
+	// A new directory has a single bucket, empty
+	int first = 0, ret = -1;
+	memset(fs->dir_buf, 0, fs->block_size);
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (alloc_run(1, &first)) {
+		fat_set(first, FAT_EOC);
+		ret = dir_write(first, fs->dir_buf, 1);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (first && !ret) {
+		memset(&e, 0, sizeof(e));
+		strcpy((char*)e.filename, name);
+		e.filesize = fs->block_size;
+		e.first_data_block_index = first;
+		e.type = ENTRY_DIR;
+		ret = dir == 0 ? root_insert(&e) : dir_insert(dir, &dloc, &e);
+	}
+	if (ret && first) {
+		pthread_mutex_lock(&fs->alloc_lock);
+		dir_revoke_chain(first);
+		chain_free(first);
+		pthread_mutex_unlock(&fs->alloc_lock);
+	}
+	pthread_mutex_unlock(&fs->table_lock);
+	return ret;
+}
+
+static int do_rmdir(const char *path)
+{
+	if (!fs) return -1;
+	char name[FS_FILENAME_LEN];
+	int dir;
+	struct entry_loc dloc, loc;
+	file_entry2 e;
+	pthread_mutex_lock(&fs->table_lock);
+	// Only empty directories are removed
+	int found = !path_walk(path, &dir, &dloc, name) &&
+		!dir_find(dir, name, &loc, &e) && e.type == ENTRY_DIR;
+	if (!found || !dir_empty(e.first_data_block_index)) {
+		pthread_mutex_unlock(&fs->table_lock);
+		return -1;
+	}
+	dir_map_drop(e.first_data_block_index);
+	entry_remove(&loc, &e);
+	pthread_mutex_unlock(&fs->table_lock);
+	return 0;
+}
+
+// Print entry @e of a directory
+static void ls_entry(const file_entry2 *e) {
+	// Extract file name
+	char fname[FS_FILENAME_LEN];
+	memcpy(fname, e->filename, FS_FILENAME_LEN);
+	fname[FS_FILENAME_LEN - 1] = 0;
+	printf("%s: %s, size: %zu, data_blk: %u\n",
+		e->type == ENTRY_DIR ? "dir" : "file", fname, (size_t)e->filesize,
+		(unsigned)e->first_data_block_index);
+}
+
+static int do_ls(const char *path)
+{
+	if (!fs) return -1;
+	pthread_mutex_lock(&fs->table_lock);
+	// Directories other than the root directory are listed bucket by bucket
+	if (path && path[strspn(path, "/")] != 0) {
+		char name[FS_FILENAME_LEN];
+		int dir;
+		struct entry_loc dloc, loc;
+		file_entry2 e;
+		struct dir_map *map = NULL;
+		if (!path_walk(path, &dir, &dloc, name) &&
+			!dir_find(dir, name, &loc, &e) && e.type == ENTRY_DIR)
+			map = dir_map_get(e.first_data_block_index);
+		if (!map) {
+			pthread_mutex_unlock(&fs->table_lock);
+			return -1;
+		}
+		printf("FS Ls:\n");
+		for (int b = 0; b < map->nblocks; b++) {
+			if (dir_read(map->blocks[b], fs->dir_buf)) break;
+			file_entry2 *slots = (file_entry2 *)fs->dir_buf;
+			for (int s = 0; s < dir_slots(); s++)
+				if (slots[s].filename[0] != 0) ls_entry(&slots[s]);
+		}
+		pthread_mutex_unlock(&fs->table_lock);
+		return 0;
+	}
+	pthread_mutex_lock(&fs->alloc_lock);
+	printf("FS Ls:\n");
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (fs->fs_root_dir->dir[i].filename[0] != 0) {
+			// We have found a file, its first block is shown as on the
+			// disk
+			file_entry2 e;
+			root_entry(i, &e);
+			if (fs->version == 1 && root_first(i) == FAT_EOC)
+				e.first_data_block_index = FAT16_EOC;
+			ls_entry(&e);
+		}
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pthread_mutex_unlock(&fs->table_lock);
+	return 0;
+}
+
+// Room for the blocks of a batch that are bounced: those partially covered
+// by the transfer, or spread over several buffers. It holds BOUNCE_BLOCKS
+// blocks, up to BOUNCE_BYTES, which is at least one block of the largest size
+#define BOUNCE_BLOCKS 16
+#define BOUNCE_BYTES BLOCK_SIZE_MAX
+
+// Allocate the buffers the transfers of @fdes go through, sized for the block
+// size of the volume. The bounce buffer of a compressed file system takes the
+// blocks of a whole cluster. Return -1 if out of memory
+static int fd_buffers(filedes *fdes) {
+	size_t size = BOUNCE_BLOCKS * fs->block_size;
+	if (size > BOUNCE_BYTES) size = BOUNCE_BYTES;
+	if (fs->features & FEATURE_COMPRESSED) size = CLUSTER_BYTES;
+	fdes->bounce = malloc(size);
+	fdes->bounce_size = size;
+	fdes->cl_buf = (fs->features & FEATURE_COMPRESSED) ?
+		malloc(CLUSTER_BYTES) : NULL;
+	fdes->cl_index = SIZE_MAX;
+	if (fdes->bounce &&
+		(fdes->cl_buf || !(fs->features & FEATURE_COMPRESSED)))
+		return 0;
+	free(fdes->bounce);
+	free(fdes->cl_buf);
+	fdes->bounce = fdes->cl_buf = NULL;
+	return -1;
+}
+
+static void fd_buffers_free(filedes *fdes) {
+	free(fdes->bounce);
+	free(fdes->cl_buf);
+	fdes->bounce = fdes->cl_buf = NULL;
+	fdes->bounce_size = 0;
+}
+
+static int do_open(const char *filename)
+{
+	if (!fs) return -1;
+	// Find the next open slot in the filedes_table, making sure we don't
+	// have the max number of open files
+	filedes *fdes;
+	for (;;) {
+		int j = 0;
+		pthread_mutex_lock(&fs->table_lock);
+		while (j < FS_OPEN_MAX_COUNT && fs->filedes_table[j].open) j++;
+		pthread_mutex_unlock(&fs->table_lock);
+		if (j == FS_OPEN_MAX_COUNT) return -1;
+		// Its lock comes first, then check that nobody took it meanwhile
+		fdes = &fs->filedes_table[j];
+		pthread_mutex_lock(&fdes->lock);
+		pthread_mutex_lock(&fs->table_lock);
+		if (!fdes->open) break;
+		pthread_mutex_unlock(&fs->table_lock);
+		pthread_mutex_unlock(&fdes->lock);
+	}
+	if (fd_buffers(fdes)) {
+		pthread_mutex_unlock(&fs->table_lock);
+		pthread_mutex_unlock(&fdes->lock);
+		return -1;
+	}
+	// Now look for the file, a file of a subdirectory gets a node
+	char name[FS_FILENAME_LEN];
+	int dir;
+	struct entry_loc dloc, loc;
+	file_entry2 e;
+	int i = -1;
+	if (!path_walk(filename, &dir, &dloc, name) &&
+		!dir_find(dir, name, &loc, &e) && e.type != ENTRY_DIR)
+		i = loc.root_index >= 0 ? loc.root_index : node_get(&loc, &e);
+	if (i == -1) {
+		fd_buffers_free(fdes);
+		pthread_mutex_unlock(&fs->table_lock);
+		pthread_mutex_unlock(&fdes->lock);
+		return -1;
+	}
+	fdes->file_offset = 0;
+	// This was we can tell if the fd is open or not
+	fdes->open = 1;
+	fdes->root_index = i;
+	fdes->cursor_block = -1;
+	fdes->ra_next = 0;
+	fdes->ra_window = 0;
+	fdes->ra_block = 0;
+	fdes->wb_buf = NULL;
+	fdes->wb_size = 0;
+	fdes->wb_len = 0;
+	fdes->wb_error = 0;
+	memcpy(fdes->filename, name, FS_FILENAME_LEN);
+	// The block map is shared by all descriptors of the file
+	int first = (fs->maps[i].users++ == 0);
+	pthread_mutex_unlock(&fs->table_lock);
+	if (first) {
+		pthread_rwlock_wrlock(&fs->file_locks[i]);
+		if (!fs->maps[i].valid) map_build(i);
+		if (!fs->maps[i].cluster_loaded) cluster_load(i);
+		pthread_rwlock_unlock(&fs->file_locks[i]);
+	}
+	pthread_mutex_unlock(&fdes->lock);
+	return fdes - fs->filedes_table;
+}
+
+// Lock the descriptor @fd and return it, or NULL if it is not open
+static filedes *fd_get(int fd) {
+	// Bounds checking
+	if (!fs || fd < 0 || fd > 31) return NULL;
+	filedes *fdes = &fs->filedes_table[fd];
+	pthread_mutex_lock(&fdes->lock);
+	// Check if there is an open file in filedes_table[fd]
+	if (fdes->open) return fdes;
+	pthread_mutex_unlock(&fdes->lock);
+	return NULL;
+}
+
+static void fd_put(filedes *fdes) {
+	pthread_mutex_unlock(&fdes->lock);
+}
+
+static int do_close(int fd)
+{
+	filedes *fdes = fd_get(fd);
+	if (!fdes) return -1;
+	// Otherwise, we have a valid file descriptor
+	pthread_rwlock_t *lock = &fs->file_locks[fdes->root_index];
+	pthread_rwlock_wrlock(lock);
+	// Write out what is still buffered, the descriptor is closed even if
+	// that fails
+	int ret = wb_flush(fd);
+	if (fdes->wb_error) ret = -1;
+	free(fdes->wb_buf);
+	fdes->wb_buf = NULL;
+	fdes->wb_size = 0;
+	fd_buffers_free(fdes);
+	pthread_mutex_lock(&fs->table_lock);
+	// The node of a file of a subdirectory goes with its last descriptor
+	if (--fs->maps[fdes->root_index].users == 0 &&
+		fdes->root_index >= FS_FILE_MAX_COUNT) {
+		map_drop(fdes->root_index);
+		cluster_drop(fdes->root_index);
+	}
+	// Set all values inside the file descriptor to zero (close the fd)
+	fdes->open = 0;
+	fdes->file_offset = 0;
+	fdes->root_index = 0;
+	// Set the first character of filename to null character
+	fdes->filename[0] = 0;
+	pthread_mutex_unlock(&fs->table_lock);
+	pthread_rwlock_unlock(lock);
+	fd_put(fdes);
+	return ret;
+}
+
+static off_t do_stat(int fd)
+{
+	filedes *fdes = fd_get(fd);
+	if (!fdes) return -1;
+	int rootindex = fdes->root_index;
+	pthread_rwlock_rdlock(&fs->file_locks[rootindex]);
+	off_t filesize = file_size(rootindex);
+	pthread_rwlock_unlock(&fs->file_locks[rootindex]);
+	fd_put(fdes);
+	return filesize;
+}
+
+static int do_lseek(int fd, off_t offset)
+{
+	if (offset < 0) return -1;
+	filedes *fdes = fd_get(fd);
+	if (!fdes) return -1;
+	// Check if offset is larger than filesize:
+	int rootindex = fdes->root_index;
+	pthread_rwlock_rdlock(&fs->file_locks[rootindex]);
+	size_t filesize = file_size(rootindex);
+	// Set the offset for the fd to the offset given
+	if ((size_t)offset <= filesize) fdes->file_offset = offset;
+	pthread_rwlock_unlock(&fs->file_locks[rootindex]);
+	fd_put(fdes);
+	return (size_t)offset <= filesize ? 0 : -1;
+}
+
+// Remember that logical block @lblock of the file open at @fdes is at FAT
+// index @fat
+static void set_cursor(filedes *fdes, int lblock, int fat) {
+	fdes->cursor_block = lblock;
+	fdes->cursor_fat = fat;
+}
+
+// This is a helper function to find the index of the data block corresponding
+// to the file's offset
+static int offset_to_block(filedes *fdes, size_t offset) {
+	// For an open file with file descriptor fdes, find the block
+	// coordinating to the current offset in the file
+	// Returns the FAT index of the data block, or FAT_EOC if the
+	// offset is past the file's last block
+	// Make sure the file at @fdes is actually open
+	if (fdes->open == 0) return -1;
+	int target = offset / fs->block_size;
+	// Find how many blocks from the start we need to traverse
+	int num_blocks_to_traverse = target;
+	// First find the file's FIRST data block
+	int cur_block = root_first(fdes->root_index);
+	// The block map answers in constant time
+	struct block_map *map = &fs->maps[fdes->root_index];
+	if (map->valid)
+		return target < map->nblocks ? map->blocks[target] : FAT_EOC;
+	// Sequential accesses and forward seeks resume from the cursor
+	if (fdes->cursor_block >= 0 && fdes->cursor_block <= target) {
+		num_blocks_to_traverse = target - fdes->cursor_block;
+		cur_block = fdes->cursor_fat;
+	}
+	// Trace the FAT until we get the desired block OR
+	// reach the end of the file.
+	while (num_blocks_to_traverse > 0 && cur_block != FAT_EOC) {
+		cur_block = fat_get(cur_block);
+		num_blocks_to_traverse--;
+	}
+	if (cur_block != FAT_EOC) set_cursor(fdes, target, cur_block);
+	return cur_block;
+}
+
+// Number of blocks that can be staged for a single batch of I/O
+#define MAX_BATCH_BLOCKS 256
+
+// Chain up to @count new blocks after FAT index @last of the file at
+// @rootindex (FAT_EOC if it has no block yet), as a single contiguous run if
+// possible. Returns the number of blocks added, 0 if the disk is full.
+static int extend_file(int rootindex, int last, int count) {
+	int start;
+	pthread_mutex_lock(&fs->alloc_lock);
+	int got = alloc_run(count, &start);
+	for (int b = 0; b < got; b++)
+		fat_set(start + b, (b == got - 1) ? FAT_EOC : start + b + 1);
+	if (got && last == FAT_EOC) {
+		root_set_first(rootindex, start);
+		mark_root(rootindex);
+	} else if (got)
+		fat_set(last, start);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	for (int b = 0; b < got; b++) map_push(rootindex, start + b);
+	return got;
+}
+
+// Read or write the @n blocks listed in @blocks (FAT indices) from or into
+// the matching buffers of @bufs
+static int batch_io(const int *blocks, int n, uint8_t *const *bufs,
+	int write) {
+	struct iovec iov[MAX_BATCH_BLOCKS];
+	int ret = 0;
+	// With an asynchronous engine, the whole batch is in flight at once
+	if (block_engine() != BLOCK_ENGINE_SYNC) {
+		for (int b = 0; b < n; b++) {
+			int abs_block = FAT_to_abs(blocks[b]);
+			if (write)
+				ret |= block_queue_write(abs_block, bufs[b]);
+			else
+				ret |= block_queue_read(abs_block, bufs[b]);
+		}
+		return block_submit() | ret;
+	}
+	// Otherwise each run of contiguous blocks takes a single vectored call
+	int run;
+	for (int b = 0; b < n; b += run) {
+		for (run = 1; b + run < n && blocks[b + run] == blocks[b] + run; run++)
+			;
+		int abs_block = FAT_to_abs(blocks[b]);
+		if (run == 1) {
+			if (write)
+				ret |= block_write(abs_block, bufs[b]);
+			else
+				ret |= block_read(abs_block, bufs[b]);
+			continue;
+		}
+		for (int k = 0; k < run; k++) {
+			iov[k].iov_base = bufs[b + k];
+			iov[k].iov_len = fs->block_size;
+		}
+		if (write)
+			ret |= block_writev(abs_block, run, iov);
+		else
+			ret |= block_readv(abs_block, run, iov);
+	}
+	return ret;
+}
+
+// Position in an array of buffers
+struct iov_iter {
+	const struct iovec *iov;
+	int cnt;
+	// Bytes of iov[0] already used
+	size_t skip;
+};
+
+// Move past the buffers that are used up
+static void iter_settle(struct iov_iter *it) {
+	while (it->cnt && it->skip == it->iov->iov_len) {
+		it->iov++;
+		it->cnt--;
+		it->skip = 0;
+	}
+}
+
+// Pointer to the next @len bytes if they lie in a single buffer, NULL
+// otherwise
+static uint8_t *iter_span(struct iov_iter *it, size_t len) {
+	iter_settle(it);
+	if (!it->cnt || it->iov->iov_len - it->skip < len) return NULL;
+	return (uint8_t *)it->iov->iov_base + it->skip;
+}
+
+// Copy the next @len bytes of the buffers into @buf, or the other way around
+// if @to_iov is set, and move past them. A NULL @buf just moves past them.
+static void iter_copy(struct iov_iter *it, uint8_t *buf, size_t len,
+	int to_iov) {
+	while (len > 0) {
+		iter_settle(it);
+		uint8_t *base = (uint8_t *)it->iov->iov_base + it->skip;
+		size_t n = it->iov->iov_len - it->skip;
+		if (n > len) n = len;
+		if (buf && to_iov) memcpy(base, buf, n);
+		else if (buf) memcpy(buf, base, n);
+		if (buf) buf += n;
+		it->skip += n;
+		len -= n;
+	}
+}
+
+// Total size of @iovcnt buffers, or -1 if it does not fit a return value
+static ssize_t iov_total(const struct iovec *iov, int iovcnt) {
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len && !iov[i].iov_base) return -1;
+		if (iov[i].iov_len > SSIZE_MAX - total) return -1;
+		total += iov[i].iov_len;
+	}
+	return total;
+}
+
+// Copy @len bytes between the buffers of @it and the mapped blocks listed in
+// @blocks, starting @in_block bytes into the first one
+static void mapped_copy(const int *blocks, size_t in_block,
+	struct iov_iter *it, size_t len, int write) {
+	for (int b = 0; len > 0; b++) {
+		uint8_t *mapped = block_ptr(FAT_to_abs(blocks[b]));
+		size_t n = fs->block_size - in_block;
+		if (n > len) n = len;
+		iter_copy(it, &mapped[in_block], n, !write);
+		len -= n;
+		in_block = 0;
+	}
+}
+
+// Whether writing @count bytes at @offset in the file with id @rootindex
+// leaves it packed: it is packed or empty, and stays within half a block
+static int pack_fits(int rootindex, size_t offset, size_t count) {
+	if (!(fs->features & FEATURE_PACKED)) return 0;
+	if (!root_frag(rootindex) && root_first(rootindex) != FAT_EOC) return 0;
+	return count <= pack_max() && offset <= pack_max() - count;
+}
+
+// Copy the @count bytes at @offset in the packed file with id @rootindex into
+// the buffers of @it, reading its fragment block into @buf
+static int pack_read(int rootindex, size_t offset, struct iov_iter *it,
+	size_t count, uint8_t *buf) {
+	// Other files of the block may be written meanwhile
+	pthread_rwlock_rdlock(&fs->frag_lock);
+	int ret = block_read(FAT_to_abs(root_first(rootindex)), buf);
+	pthread_rwlock_unlock(&fs->frag_lock);
+	if (ret) return -1;
+	iter_copy(it, &buf[root_frag(rootindex) * frag_unit() + offset], count, 1);
+	return 0;
+}
+
+// Write the @count bytes of the buffers of @it at @offset in the file with id
+// @rootindex, which stays packed. Return -1 if there is no room left for it
+static int pack_write(int rootindex, size_t offset, struct iov_iter *it,
+	size_t count) {
+	size_t size = root_size(rootindex);
+	size_t end = offset + count > size ? offset + count : size;
+	size_t unit = frag_unit();
+	int block = root_first(rootindex), at = root_frag(rootindex);
+	int have = at ? frag_units(size) : 0, need = frag_units(end);
+	int to = at, ret = 0;
+	pthread_rwlock_wrlock(&fs->frag_lock);
+	struct frag_block *f = at ? frag_get(block) : NULL;
+	if (at && (!f || frag_read(f))) {
+		pthread_rwlock_unlock(&fs->frag_lock);
+		return -1;
+	}
+	if (at && (need == have || (at + need <= FRAG_UNITS &&
+		!(f->used & frag_mask(at + have, need - have))))) {
+		// The file stays in place, growing into the units that follow it
+		f->used |= frag_mask(at, need);
+		iter_copy(it, &fs->frag_buf[at * unit + offset], count, 0);
+		ret = frag_write(f);
+	} else {
+		// Otherwise its content is put together and moves to free units
+		if (at) memcpy(fs->pack_buf, &fs->frag_buf[at * unit], size);
+		iter_copy(it, &fs->pack_buf[offset], count, 0);
+		f = frag_alloc(need, &to);
+		if (f) {
+			f->used |= frag_mask(to, need);
+			memcpy(&fs->frag_buf[to * unit], fs->pack_buf, end);
+			ret = frag_write(f);
+		} else {
+			ret = -1;
+		}
+	}
+	if (!ret && (to != at || f->block != block || end > size)) {
+		pthread_mutex_lock(&fs->alloc_lock);
+		root_set_first(rootindex, f->block);
+		root_set_frag(rootindex, to);
+		root_set_size(rootindex, end);
+		mark_root(rootindex);
+		pthread_mutex_unlock(&fs->alloc_lock);
+		// The units it left are given back once nothing points to them
+		if (at && (to != at || f->block != block))
+			frag_release(block, at, have);
+	}
+	pthread_rwlock_unlock(&fs->frag_lock);
+	return ret;
+}
+
+// Move the packed file with id @rootindex to a block of its own, before it
+// grows past half a block. Return -1 if there is no room left for it
+static int pack_promote(int rootindex) {
+	size_t size = root_size(rootindex);
+	int block = root_first(rootindex), at = root_frag(rootindex);
+	int first, ret = -1;
+	pthread_rwlock_wrlock(&fs->frag_lock);
+	pthread_mutex_lock(&fs->alloc_lock);
+	int got = alloc_run(1, &first);
+	if (got) fat_set(first, FAT_EOC);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	struct frag_block *f = frag_get(block);
+	if (got && f && !frag_read(f)) {
+		// Its content goes to the start of the block, the rest is zeroed
+		uint8_t *buf = fs->frag_buf;
+		memmove(buf, &buf[at * frag_unit()], size);
+		memset(&buf[size], 0, fs->block_size - size);
+		ret = block_write(FAT_to_abs(first), buf);
+	}
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (!ret) {
+		root_set_first(rootindex, first);
+		root_set_frag(rootindex, 0);
+		mark_root(rootindex);
+	} else if (got) {
+		fat_set(first, 0);
+		mark_free(first);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (!ret) frag_release(block, at, frag_units(size));
+	pthread_rwlock_unlock(&fs->frag_lock);
+	if (ret) return -1;
+	// The file may have been empty when opened, with a block map of no block
+	if (fs->maps[rootindex].valid) map_push(rootindex, first);
+	else map_build(rootindex);
+	return 0;
+}
+
+// -- Compressed files -- //
+// On a file system with FEATURE_COMPRESSED, the content of a file is cut in
+// clusters of CLUSTER_BYTES. A full cluster is compressed on its own and takes
+// the blocks the result needs, or is stored as is if that saves no block. The
+// last cluster of a file is stored as is until it fills up, so that appending
+// does not compress the same bytes over and over. The chain of a file starts
+// with a table giving the number of blocks of each full cluster, a byte each,
+// which tells where any cluster is in the chain: a read only decompresses the
+// clusters it touches. Clusters changing size are spliced in and out of the
+// chain, which makes positions in the chain, rather than offsets, what the
+// block map and the cursors of the file count in.
+
+// Header of a compressed cluster, followed by its compressed content
+struct __attribute__((packed)) cluster_header {
+	uint32_t length;
+};
+
+// Number of blocks of a cluster stored as is
+static int cluster_blocks(void) {
+	return CLUSTER_BYTES / fs->block_size;
+}
+
+// Forget the table of clusters of the file with id @rootindex
+static void cluster_drop(int rootindex) {
+	struct block_map *map = &fs->maps[rootindex];
+	free(map->clusters);
+	map->clusters = NULL;
+	map->nclusters = map->cluster_cap = map->table_blocks = 0;
+	map->cluster_loaded = 0;
+}
+
+// Make room for @n entries in the table of clusters of @map
+static int cluster_room(struct block_map *map, int n) {
+	if (n <= map->cluster_cap) return 0;
+	int cap = map->cluster_cap ? 2 * map->cluster_cap : 16;
+	while (cap < n) cap *= 2;
+	int *clusters = realloc(map->clusters, cap * sizeof(int));
+	if (!clusters) return -1;
+	map->clusters = clusters;
+	map->cluster_cap = cap;
+	return 0;
+}
+
+// Read the table of clusters of the file with id @rootindex, once it is opened.
+// Called with the file locked for writing
+static int cluster_load(int rootindex) {
+	struct block_map *map = &fs->maps[rootindex];
+	if (!(fs->features & FEATURE_COMPRESSED)) return 0;
+	// A packed file is smaller than a cluster
+	size_t size = root_frag(rootindex) ? 0 : root_size(rootindex);
+	int bs = fs->block_size;
+	if (size / CLUSTER_BYTES > (size_t)fs->data_blocks) return -1;
+	int n = size / CLUSTER_BYTES;
+	uint8_t *buf = malloc(bs);
+	if (!buf || cluster_room(map, n + 1)) {
+		free(buf);
+		return -1;
+	}
+	map->clusters[0] = 0;
+	int cur = root_first(rootindex);
+	for (int t = 0; t * bs < n; t++, cur = fat_get(cur)) {
+		if (cur == FAT_EOC || block_read(FAT_to_abs(cur), buf)) break;
+		for (int k = t * bs; k < n && k < (t + 1) * bs; k++) {
+			// A cluster takes a block at least, and no more than as is
+			int count = buf[k - t * bs];
+			if (count < 1 || count > cluster_blocks()) {
+				free(buf);
+				return -1;
+			}
+			map->clusters[k + 1] = map->clusters[k] + count;
+		}
+		if ((t + 1) * bs >= n) map->cluster_loaded = 1;
+	}
+	free(buf);
+	if (n == 0) map->cluster_loaded = 1;
+	if (!map->cluster_loaded) return -1;
+	map->nclusters = n;
+	map->table_blocks = (n + bs - 1) / bs;
+	return 0;
+}
+
+// FAT index of the block at position @pos in the chain of the file open at
+// @fdes, FAT_EOC if the chain is shorter
+static int chain_at(filedes *fdes, int pos) {
+	return offset_to_block(fdes, (size_t)pos * fs->block_size);
+}
+
+// Forget the cursors of the descriptors open on the file of @fdes, and its
+// own, once blocks were added to the chain of the file or removed from it
+// before them
+static void cursors_reset(filedes *fdes) {
+	pthread_mutex_lock(&fs->table_lock);
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		filedes *other = &fs->filedes_table[i];
+		if (other->open && other->root_index == fdes->root_index)
+			other->cursor_block = -1;
+	}
+	pthread_mutex_unlock(&fs->table_lock);
+	fdes->cursor_block = -1;
+}
+
+// Chain @count new blocks, at most a cluster of them, at position @pos in the
+// chain of the file open at @fdes, which is at most its length. Return -1,
+// the chain being left as it was, if the disk is full
+static int chain_insert(filedes *fdes, int pos, int count) {
+	int rootindex = fdes->root_index;
+	int added[CLUSTER_BYTES / BLOCK_SIZE_MIN];
+	int prev = pos ? chain_at(fdes, pos - 1) : FAT_EOC;
+	if (pos && prev == FAT_EOC) return -1;
+	pthread_mutex_lock(&fs->alloc_lock);
+	int got = 0;
+	while (got < count) {
+		int start;
+		int k = alloc_run(count - got, &start);
+		if (k == 0) break;
+		for (int b = 0; b < k; b++) added[got++] = start + b;
+	}
+	if (got < count) {
+		for (int b = 0; b < got; b++) mark_free(added[b]);
+		pthread_mutex_unlock(&fs->alloc_lock);
+		return -1;
+	}
+	int next = (prev == FAT_EOC) ? root_first(rootindex) : fat_get(prev);
+	for (int b = 0; b < count; b++)
+		fat_set(added[b], (b == count - 1) ? next : added[b + 1]);
+	if (prev == FAT_EOC) {
+		root_set_first(rootindex, added[0]);
+		mark_root(rootindex);
+	} else {
+		fat_set(prev, added[0]);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	// The block map follows, or is dropped if it cannot grow
+	struct block_map *map = &fs->maps[rootindex];
+	if (map->valid && (map->nblocks + count <= map->cap ||
+		!map_grow(rootindex, 2 * (map->nblocks + count)))) {
+		memmove(&map->blocks[pos + count], &map->blocks[pos],
+			(map->nblocks - pos) * sizeof(int));
+		memcpy(&map->blocks[pos], added, count * sizeof(int));
+		map->nblocks += count;
+	}
+	cursors_reset(fdes);
+	return 0;
+}
+
+// Unchain the @count blocks at position @pos in the chain of the file open at
+// @fdes, and free them
+static void chain_remove(filedes *fdes, int pos, int count) {
+	int rootindex = fdes->root_index;
+	int prev = pos ? chain_at(fdes, pos - 1) : FAT_EOC;
+	if (pos && prev == FAT_EOC) return;
+	pthread_mutex_lock(&fs->alloc_lock);
+	int cur = (prev == FAT_EOC) ? root_first(rootindex) : fat_get(prev);
+	for (int b = 0; b < count && cur != FAT_EOC; b++) {
+		int next = fat_get(cur);
+		fat_set(cur, 0);
+		mark_free(cur);
+		cur = next;
+	}
+	if (prev == FAT_EOC) {
+		root_set_first(rootindex, cur);
+		mark_root(rootindex);
+	} else {
+		fat_set(prev, cur);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	struct block_map *map = &fs->maps[rootindex];
+	if (map->valid && pos + count <= map->nblocks) {
+		memmove(&map->blocks[pos], &map->blocks[pos + count],
+			(map->nblocks - pos - count) * sizeof(int));
+		map->nblocks -= count;
+	}
+	cursors_reset(fdes);
+}
+
+// Read or write the @n blocks, at most a cluster of them, from position @pos
+// in the chain of the file open at @fdes from or into @buf
+static int cluster_io(filedes *fdes, int pos, int n, uint8_t *buf,
+	int write) {
+	int blocks[CLUSTER_BYTES / BLOCK_SIZE_MIN];
+	uint8_t *bufs[CLUSTER_BYTES / BLOCK_SIZE_MIN];
+	for (int b = 0; b < n; b++) {
+		blocks[b] = b ? fat_get(blocks[b - 1]) : chain_at(fdes, pos);
+		if (blocks[b] == FAT_EOC) return -1;
+		bufs[b] = &buf[(size_t)b * fs->block_size];
+	}
+	// The next access starts where this one stopped
+	set_cursor(fdes, pos + n - 1, blocks[n - 1]);
+	return batch_io(blocks, n, bufs, write);
+}
+
+// Write block @t of the table of clusters of the file open at @fdes, put
+// together in @buf
+static int cluster_table_write(filedes *fdes, int t, uint8_t *buf) {
+	struct block_map *map = &fs->maps[fdes->root_index];
+	int bs = fs->block_size;
+	memset(buf, 0, bs);
+	for (int k = t * bs; k < map->nclusters && k < (t + 1) * bs; k++)
+		buf[k - t * bs] = map->clusters[k + 1] - map->clusters[k];
+	return cluster_io(fdes, t, 1, buf, 1);
+}
+
+// Decompress cluster @cl of the file open at @fdes, a compressed one, into
+// the cluster room of the descriptor, reading it into @buf. The descriptor
+// keeps the cluster it decompressed last, which is used instead while up to
+// date. Return where the cluster was decompressed, NULL if it cannot be read
+static uint8_t *cluster_fetch(filedes *fdes, size_t cl, uint8_t *buf) {
+	struct block_map *map = &fs->maps[fdes->root_index];
+	if (fdes->cl_index == cl && fdes->cl_gen == map->cluster_gen)
+		return fdes->cl_buf;
+	fdes->cl_index = SIZE_MAX;
+	int n = map->clusters[cl + 1] - map->clusters[cl];
+	size_t room = (size_t)n * fs->block_size - sizeof(struct cluster_header);
+	struct cluster_header hdr;
+	if (cluster_io(fdes, map->table_blocks + map->clusters[cl], n, buf, 0))
+		return NULL;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.length > room || lz_decompress(&buf[sizeof(hdr)], hdr.length,
+		fdes->cl_buf, CLUSTER_BYTES))
+		return NULL;
+	fdes->cl_index = cl;
+	fdes->cl_gen = map->cluster_gen;
+	return fdes->cl_buf;
+}
+
+// Store @raw as cluster @cl of the file open at @fdes, in place of the @old
+// blocks it takes, compressed into @buf if that saves a block. The cluster is
+// a full one, or the one after them which then becomes full. Return -1 if the
+// disk is full, the chain being left as it was
+static int cluster_store(filedes *fdes, size_t cl, uint8_t *raw, int old,
+	uint8_t *buf) {
+	struct block_map *map = &fs->maps[fdes->root_index];
+	size_t bs = fs->block_size;
+	int whole = cluster_blocks();
+	struct cluster_header hdr;
+	hdr.length = lz_compress(raw, CLUSTER_BYTES, &buf[sizeof(hdr)],
+		(whole - 1) * bs - sizeof(hdr));
+	int n = whole;
+	uint8_t *data = raw;
+	if (hdr.length) {
+		n = (sizeof(hdr) + hdr.length + bs - 1) / bs;
+		memcpy(buf, &hdr, sizeof(hdr));
+		memset(&buf[sizeof(hdr) + hdr.length], 0,
+			n * bs - sizeof(hdr) - hdr.length);
+		data = buf;
+	}
+	// A new full cluster may need a new block of table, after the others
+	int fresh = (cl == (size_t)map->nclusters);
+	if (fresh && cluster_room(map, map->nclusters + 2)) return -1;
+	int grow = fresh && (size_t)map->nclusters == map->table_blocks * bs;
+	if (grow) {
+		if (chain_insert(fdes, map->table_blocks, 1)) return -1;
+		map->table_blocks++;
+	}
+	int pos = map->table_blocks + map->clusters[cl];
+	if (n > old && chain_insert(fdes, pos + old, n - old)) {
+		if (grow) chain_remove(fdes, --map->table_blocks, 1);
+		return -1;
+	}
+	if (n < old) chain_remove(fdes, pos + n, old - n);
+	int ret = cluster_io(fdes, pos, n, data, 1);
+	if (fresh) {
+		map->clusters[cl + 1] = map->clusters[cl] + n;
+		map->nclusters++;
+	} else {
+		for (int k = cl + 1; k <= map->nclusters; k++)
+			map->clusters[k] += n - old;
+	}
+	if (cluster_table_write(fdes, cl / bs, buf)) ret = -1;
+	return ret;
+}
+
+// Write the @len bytes of the buffers of @it @in bytes into the cluster at
+// position @pos in the chain of the file open at @fdes, which is stored as is
+// and holds @have bytes, putting the blocks together in @buf. Blocks are added
+// past the ones it has, it is then the last of the file
+static int cluster_write_raw(filedes *fdes, int pos, size_t have, size_t in,
+	struct iov_iter *it, size_t len, uint8_t *buf) {
+	size_t bs = fs->block_size;
+	int first = in / bs, last = (in + len - 1) / bs;
+	int nblocks = (have + bs - 1) / bs;
+	if (last >= nblocks && chain_insert(fdes, pos + nblocks, last + 1 - nblocks))
+		return -1;
+	// Partially written blocks keep the rest of their content, the first
+	// and the last one being looked at
+	for (int b = first; b <= last; b += (last > first) ? last - first : 1) {
+		size_t start = (size_t)b * bs;
+		uint8_t *block = &buf[(b - first) * bs];
+		if (in <= start && in + len >= start + bs) continue;
+		if (start >= have) memset(block, 0, bs);
+		else if (cluster_io(fdes, pos + b, 1, block, 0)) return -1;
+	}
+	iter_copy(it, &buf[in % bs], len, 0);
+	return cluster_io(fdes, pos + first, last - first + 1, buf, 1);
+}
+
+// Read up to @count bytes at *@offset in the file open at @fdes, on a
+// compressed file system, into the buffers of @it, and advance *@offset past
+// them, using @buf. @count is within the file. Return the number of bytes
+// read, or -1 if none could be. Called with the file locked for reading
+static ssize_t cluster_readv(filedes *fdes, size_t *offset,
+	struct iov_iter *it, size_t count, uint8_t *buf) {
+	struct block_map *map = &fs->maps[fdes->root_index];
+	size_t bs = fs->block_size;
+	size_t done = 0;
+	if (!map->cluster_loaded) return -1;
+	while (done < count) {
+		size_t cl = *offset / CLUSTER_BYTES, in = *offset % CLUSTER_BYTES;
+		size_t len = CLUSTER_BYTES - in;
+		if (len > count - done) len = count - done;
+		int full = cl < (size_t)map->nclusters;
+		int pos = map->table_blocks + map->clusters[full ? cl :
+			(size_t)map->nclusters];
+		if (full &&
+			map->clusters[cl + 1] - map->clusters[cl] < cluster_blocks()) {
+			uint8_t *data = cluster_fetch(fdes, cl, buf);
+			if (!data) break;
+			iter_copy(it, &data[in], len, 1);
+		} else {
+			// A cluster stored as is, only the blocks read from are read
+			int first = in / bs, last = (in + len - 1) / bs;
+			if (cluster_io(fdes, pos + first, last - first + 1, buf, 0)) break;
+			iter_copy(it, &buf[in % bs], len, 1);
+		}
+		done += len;
+		*offset += len;
+	}
+	fdes->ra_next = *offset;
+	// The bytes before a block that cannot be read are returned, if any
+	if (done == 0 && count > 0) return -1;
+	return done;
+}
+
+// Write the @count bytes of the buffers of @it at *@offset in the file open
+// at @fdes, on a compressed file system, and advance *@offset past them, using
+// @buf. Return the number of bytes written. Called with the file locked for
+// writing
+static ssize_t cluster_writev(filedes *fdes, size_t *offset,
+	struct iov_iter *it, size_t count, uint8_t *buf) {
+	int rootindex = fdes->root_index;
+	struct block_map *map = &fs->maps[rootindex];
+	size_t size = root_size(rootindex);
+	unsigned int gen = map->cluster_gen;
+	size_t done = 0;
+	if (!map->cluster_loaded) return 0;
+	while (done < count) {
+		size_t cl = *offset / CLUSTER_BYTES, in = *offset % CLUSTER_BYTES;
+		size_t len = CLUSTER_BYTES - in;
+		if (len > count - done) len = count - done;
+		size_t n = map->nclusters;
+		// Bytes of the last cluster, past the full ones
+		size_t have = size - n * CLUSTER_BYTES;
+		int ret;
+		if (cl < n && map->clusters[cl + 1] - map->clusters[cl] ==
+			cluster_blocks()) {
+			// A cluster stored as is is updated in place
+			ret = cluster_write_raw(fdes, map->table_blocks +
+				map->clusters[cl], CLUSTER_BYTES, in, it, len, buf);
+			if (fdes->cl_index == cl) fdes->cl_index = SIZE_MAX;
+		} else if (cl == n && in + len < CLUSTER_BYTES) {
+			// And so is the last one until it fills up
+			ret = cluster_write_raw(fdes, map->table_blocks +
+				map->clusters[n], have, in, it, len, buf);
+		} else {
+			// Otherwise the cluster is put together and compressed again,
+			// in the room of the descriptor which then holds it
+			uint8_t *raw = fdes->cl_buf;
+			size_t bs = fs->block_size;
+			int old = (have + bs - 1) / bs;
+			if (cl < n) {
+				old = map->clusters[cl + 1] - map->clusters[cl];
+				if (!cluster_fetch(fdes, cl, buf)) break;
+			} else {
+				fdes->cl_index = SIZE_MAX;
+				if (in && cluster_io(fdes, map->table_blocks +
+					map->clusters[n], (in + bs - 1) / bs, raw, 0))
+					break;
+			}
+			iter_copy(it, &raw[in], len, 0);
+			ret = cluster_store(fdes, cl, raw, old, buf);
+			fdes->cl_index = ret ? SIZE_MAX : cl;
+			fdes->cl_gen = gen;
+		}
+		if (ret) break;
+		done += len;
+		*offset += len;
+		if (*offset > size) size = *offset;
+	}
+	// Clusters decompressed by the other descriptors are out of date
+	map->cluster_gen = gen + 1;
+	if (fdes->cl_gen == gen) fdes->cl_gen = gen + 1;
+	if (size > root_size(rootindex)) {
+		pthread_mutex_lock(&fs->alloc_lock);
+		root_set_size(rootindex, size);
+		mark_root(rootindex);
+		pthread_mutex_unlock(&fs->alloc_lock);
+	}
+	return done;
+}
+
+// Write the @count bytes of the buffers of @it at *@offset in the file open
+// at @fdes, and advance *@offset past them. Return the number of bytes
+// written, -1 if a block could not be written before any was. Called with
+// the file locked for writing
+static ssize_t writev_at(filedes *fdes, size_t *offset, struct iov_iter *it,
+	size_t count)
+{
+	// Quick reference to root index
+	int rootindex = fdes->root_index;
+	// Blocks starting past the original end of file hold no data yet
+	size_t og_filesize = root_size(rootindex);
+	// Files stop at the largest size the format can describe
+	if (*offset >= max_file_size()) return 0;
+	if (count > max_file_size() - *offset) count = max_file_size() - *offset;
+	// Small files are packed in fragment blocks, as long as they stay small
+	if (pack_fits(rootindex, *offset, count)) {
+		if (pack_write(rootindex, *offset, it, count)) return 0;
+		*offset += count;
+		return count;
+	}
+	if (root_frag(rootindex) && pack_promote(rootindex)) return 0;
+	// Size of the blocks of the volume
+	size_t bs = fs->block_size;
+	// Bounce buffers for the blocks of a batch that are partially written,
+	// or that come from several buffers. Other blocks are written straight
+	// from the buffers
+	uint8_t *bounce_buffer = fdes->bounce;
+	int max_bounce = fdes->bounce_size / bs;
+	int blocks[MAX_BATCH_BLOCKS];
+	uint8_t *bufs[MAX_BATCH_BLOCKS];
+	// Files of a compressed file system are written a cluster at a time,
+	// which fits the bounce buffers
+	if (fs->features & FEATURE_COMPRESSED)
+		return cluster_writev(fdes, offset, it, count, bounce_buffer);
+	// Return value
+	size_t num_bytes_written = 0;
+	int failed = 0;
+	// Block that held the last byte written, to chain new blocks after it
+	int last = FAT_EOC;
+	if (*offset > 0)
+		last = offset_to_block(fdes, *offset - 1);
+	while (num_bytes_written < count) {
+		size_t in_block = *offset % bs;
+		size_t left = count - num_bytes_written;
+		size_t span = (in_block + left + bs - 1) / bs;
+		int need = span > INT_MAX ? INT_MAX : span;
+		int want = need > MAX_BATCH_BLOCKS ? MAX_BATCH_BLOCKS : need;
+		// Find the blocks covered by this batch, extending the file as needed
+		int n, prev = last;
+		for (n = 0; n < want; n++) {
+			int cur = last;
+			if (n > 0 || in_block == 0) {
+				cur = (prev == FAT_EOC) ? root_first(rootindex) :
+					fat_get(prev);
+				// Allocate the rest of the write at once, so that it is
+				// laid out contiguously
+				if (cur == FAT_EOC) {
+					// If we have no space left, write what fits
+					if (extend_file(rootindex, prev, need - n) == 0) break;
+					cur = (prev == FAT_EOC) ? root_first(rootindex) :
+						fat_get(prev);
+				}
+			}
+			blocks[n] = cur;
+			prev = cur;
+		}
+		if (n == 0) break;
+		size_t num_bytes_to_copy = (size_t)n * bs - in_block;
+		if (num_bytes_to_copy > left) num_bytes_to_copy = left;
+		if (fs->mapped) {
+			// Mapped blocks are modified in place
+			mapped_copy(blocks, in_block, it, num_bytes_to_copy, 1);
+		} else {
+			size_t end = in_block + num_bytes_to_copy;
+			int nbounce = 0;
+			for (int b = 0; b < n; b++) {
+				// Range of bytes of block b covered by the write
+				size_t lo = (b == 0) ? in_block : 0;
+				size_t hi = (b == n - 1 && end % bs != 0) ?
+					end % bs : bs;
+				uint8_t *src = iter_span(it, bs);
+				if (lo == 0 && hi == bs && src) {
+					// Fully overwritten blocks need no read
+					bufs[b] = src;
+					iter_copy(it, NULL, bs, 0);
+					continue;
+				}
+				// The batch stops short once out of bounce buffers
+				if (nbounce == max_bounce) {
+					n = b;
+					end = (size_t)n * bs;
+					num_bytes_to_copy = end - in_block;
+					break;
+				}
+				bufs[b] = &bounce_buffer[nbounce++ * bs];
+				// Partially written blocks must keep the rest of their
+				// content, unless they were just added to the file
+				size_t block_start = *offset - in_block + b * bs;
+				if (lo != 0 || hi != bs) {
+					if (block_start >= og_filesize) {
+						memset(bufs[b], 0, bs);
+					} else if (block_read(FAT_to_abs(blocks[b]), bufs[b])) {
+						// A block that cannot be read, corrupted for
+						// instance, is left as it is and ends the write
+						failed = 1;
+						n = b;
+						break;
+					}
+				}
+				iter_copy(it, &bufs[b][lo], hi - lo, 0);
+			}
+			if (failed && n == 0) break;
+			if (failed) num_bytes_to_copy = (size_t)n * bs - in_block;
+			// Now write back to the disk. A batch that cannot be written
+			// ends the write, after the blocks before the first one that
+			// fails. They are written through, as the cache would only
+			// fail to write them back later
+			if (batch_io(blocks, n, bufs, 1)) {
+				int good = 0;
+				struct iovec one = { NULL, bs };
+				for (; good < n; good++) {
+					one.iov_base = bufs[good];
+					if (block_writev(FAT_to_abs(blocks[good]), 1, &one)) break;
+				}
+				if (good < n) failed = 1;
+				if (good == 0) break;
+				if (good < n) {
+					n = good;
+					num_bytes_to_copy = (size_t)n * bs - in_block;
+				}
+			}
+		}
+		// The next batch starts where this one stopped
+		set_cursor(fdes, *offset / bs + n - 1, blocks[n - 1]);
+		// Adjust indicators
+		num_bytes_written += num_bytes_to_copy;
+		*offset += num_bytes_to_copy;
+		last = blocks[n - 1];
+		if (failed) break;
+	}
+	// Grow the file if we wrote past its end
+	if (*offset > root_size(rootindex)) {
+		pthread_mutex_lock(&fs->alloc_lock);
+		root_set_size(rootindex, *offset);
+		mark_root(rootindex);
+		pthread_mutex_unlock(&fs->alloc_lock);
+	}
+	if (failed && num_bytes_written == 0) return -1;
+	return num_bytes_written;
+}
+
+// Write @count bytes from @buf at *@offset in the file open at @fdes, and
+// advance *@offset past them. Return the number of bytes written. Called
+// with the file locked for writing
+static ssize_t write_at(filedes *fdes, size_t *offset, uint8_t *buf,
+	size_t count)
+{
+	struct iovec iov = { buf, count };
+	struct iov_iter it = { &iov, 1, 0 };
+	return writev_at(fdes, offset, &it, count);
+}
+
+// Write out the bytes buffered by @fd. Return -1 if some could not be
+// written, in which case they are dropped. Called with its file locked for
+// writing
+static int wb_flush(int fd) {
+	filedes *fdes = &fs->filedes_table[fd];
+	if (fdes->wb_len == 0) return 0;
+	size_t offset = fdes->wb_start;
+	size_t len = fdes->wb_len;
+	fdes->wb_len = 0;
+	if (write_at(fdes, &offset, fdes->wb_buf, len) == (ssize_t)len) return 0;
+	// Writes resume at the end of what made it to the disk
+	size_t filesize = root_size(fdes->root_index);
+	if (fdes->file_offset > filesize) fdes->file_offset = filesize;
+	fdes->wb_error = 1;
+	return -1;
+}
+
+// Write out the bytes buffered by the descriptors open on the file at
+// @rootindex, but @fd
+static void wb_flush_file(int rootindex, int fd) {
+	int fds[FS_OPEN_MAX_COUNT], n = 0;
+	pthread_mutex_lock(&fs->table_lock);
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		filedes *fdes = &fs->filedes_table[i];
+		if (i == fd || !fdes->open || fdes->root_index != rootindex) continue;
+		if (fdes->wb_len) fds[n++] = i;
+	}
+	pthread_mutex_unlock(&fs->table_lock);
+	// They cannot be closed meanwhile, closing takes the file's lock
+	for (int k = 0; k < n; k++) wb_flush(fds[k]);
+}
+
+// Whether a descriptor open on the file at @rootindex has buffered bytes
+static int file_pending(int rootindex) {
+	int pending = 0;
+	pthread_mutex_lock(&fs->table_lock);
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		filedes *fdes = &fs->filedes_table[i];
+		if (fdes->open && fdes->root_index == rootindex && fdes->wb_len)
+			pending = 1;
+	}
+	pthread_mutex_unlock(&fs->table_lock);
+	return pending;
+}
+
+// Size of the file at @rootindex, counting the bytes still buffered
+static size_t file_size(int rootindex) {
+	size_t size = root_size(rootindex);
+	pthread_mutex_lock(&fs->table_lock);
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		filedes *fdes = &fs->filedes_table[i];
+		if (!fdes->open || fdes->root_index != rootindex) continue;
+		if (fdes->wb_len && fdes->wb_start + fdes->wb_len > size)
+			size = fdes->wb_start + fdes->wb_len;
+	}
+	pthread_mutex_unlock(&fs->table_lock);
+	return size;
+}
+
+static int do_setbuf(int fd, size_t size)
+{
+	filedes *fdes = fd_get(fd);
+	if (!fdes) return -1;
+	pthread_rwlock_wrlock(&fs->file_locks[fdes->root_index]);
+	wb_flush(fd);
+	pthread_rwlock_unlock(&fs->file_locks[fdes->root_index]);
+	free(fdes->wb_buf);
+	fdes->wb_buf = NULL;
+	fdes->wb_size = 0;
+	int ret = 0;
+	if (size) {
+		// Whole blocks are buffered
+		size = (size + fs->block_size - 1) / fs->block_size * fs->block_size;
+		fdes->wb_buf = malloc(size);
+		if (fdes->wb_buf) fdes->wb_size = size;
+		else ret = -1;
+	}
+	fd_put(fdes);
+	return ret;
+}
+
+static int do_flush(int fd)
+{
+	filedes *fdes = fd_get(fd);
+	if (!fdes) return -1;
+	pthread_rwlock_wrlock(&fs->file_locks[fdes->root_index]);
+	int ret = wb_flush(fd);
+	// Report earlier failures once
+	if (fdes->wb_error) ret = -1;
+	fdes->wb_error = 0;
+	pthread_rwlock_unlock(&fs->file_locks[fdes->root_index]);
+	fd_put(fdes);
+	return ret;
+}
+
+static ssize_t do_write(int fd, void *buf, size_t count)
+{
+	if (buf == NULL) return -1;
+	filedes *fdes = fd_get(fd);
+	if (!fdes) return -1;
+	if (count == 0) {
+		fd_put(fdes);
+		return 0;
+	}
+	pthread_rwlock_t *lock = &fs->file_locks[fdes->root_index];
+	pthread_rwlock_wrlock(lock);
+	// Bytes buffered by other descriptors of the file go first
+	wb_flush_file(fdes->root_index, fd);
+	ssize_t ret = -1;
+	if (fdes->wb_size) {
+		// Only a write following the buffered bytes can join them
+		if (fdes->wb_len && fdes->wb_start + fdes->wb_len != fdes->file_offset)
+			wb_flush(fd);
+		// Spill once the buffer is full, blocks are then allocated for
+		// the whole of it at once
+		if (fdes->wb_len + count > fdes->wb_size) wb_flush(fd);
+		if (count < fdes->wb_size) {
+			if (fdes->wb_len == 0) fdes->wb_start = fdes->file_offset;
+			memcpy(&fdes->wb_buf[fdes->wb_len], buf, count);
+			fdes->wb_len += count;
+			fdes->file_offset += count;
+			ret = count;
+		}
+	}
+	if (ret < 0) ret = write_at(fdes, &fdes->file_offset, buf, count);
+	pthread_rwlock_unlock(lock);
+	fd_put(fdes);
+	return ret;
+}
+
+// Readahead window bounds, in blocks
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 64
+
+// Prefetch the blocks following the last read of @fdes into the block cache,
+// so that a sequential reader finds them there
+static void readahead(filedes *fdes) {
+	int next = fdes->ra_next / fs->block_size;
+	if (fdes->ra_window == 0 || fdes->cursor_block < 0) return;
+	if (fdes->ra_block < next) fdes->ra_block = next;
+	// Top the window up once less than half of it is left ahead
+	if (fdes->ra_block - next >= fdes->ra_window / 2) return;
+	int stop = next + fdes->ra_window;
+	// Walk the chain from the cursor to the first block to prefetch
+	int lblock = fdes->cursor_block;
+	int fat = fdes->cursor_fat;
+	while (lblock < fdes->ra_block && fat != FAT_EOC) {
+		fat = fat_get(fat);
+		lblock++;
+	}
+	// Each run of contiguous blocks is prefetched with a single read
+	while (lblock < stop && fat != FAT_EOC) {
+		int run = 1;
+		while (lblock + run < stop && fat_get(fat + run - 1) == fat + run)
+			run++;
+		if (block_prefetch(FAT_to_abs(fat), run)) break;
+		lblock += run;
+		fat = fat_get(fat + run - 1);
+	}
+	fdes->ra_block = lblock;
+}
+
+// Read up to @count bytes at *@offset in the file open at @fdes into the
+// buffers of @it, and advance *@offset past them. Return the number of bytes
+// read, which stops short of a block that cannot be read, or -1 if the first
+// one cannot. Called with the file locked for reading
+static ssize_t readv_at(filedes *fdes, size_t *offset, struct iov_iter *it,
+	size_t count)
+{
+	// Quick reference to root index
+	int rootindex = fdes->root_index;
+	// Never read past the end of the file
+	size_t filesize = root_size(rootindex);
+	if (*offset >= filesize) return 0;
+	if (count > filesize - *offset) count = filesize - *offset;
+	// The readahead window grows while reads follow each other, and
+	// shrinks on random access
+	int sequential = (*offset == fdes->ra_next);
+	if (sequential) {
+		fdes->ra_window = fdes->ra_window ? 2 * fdes->ra_window :
+			RA_MIN_BLOCKS;
+		if (fdes->ra_window > RA_MAX_BLOCKS) fdes->ra_window = RA_MAX_BLOCKS;
+	} else {
+		fdes->ra_window /= 2;
+		fdes->ra_block = 0;
+	}
+	// Size of the blocks of the volume
+	size_t bs = fs->block_size;
+	// Bounce buffers for the blocks of a batch that are partially read, or
+	// that go to several buffers. Other blocks are read straight into the
+	// buffers
+	uint8_t *bounce_buffer = fdes->bounce;
+	int max_bounce = fdes->bounce_size / bs;
+	int blocks[MAX_BATCH_BLOCKS];
+	uint8_t *bufs[MAX_BATCH_BLOCKS];
+	// A packed file is read from its fragment block
+	if (root_frag(rootindex)) {
+		if (pack_read(rootindex, *offset, it, count, bounce_buffer)) return -1;
+		*offset += count;
+		fdes->ra_next = *offset;
+		return count;
+	}
+	// And so are the clusters of a compressed file system
+	if (fs->features & FEATURE_COMPRESSED)
+		return cluster_readv(fdes, offset, it, count, bounce_buffer);
+	// Return value
+	size_t num_bytes_copied = 0;
+	int failed = 0;
+	while (num_bytes_copied < count && !failed) {
+		size_t in_block = *offset % bs;
+		size_t left = count - num_bytes_copied;
+		size_t span = (in_block + left + bs - 1) / bs;
+		int n = span > MAX_BATCH_BLOCKS ? MAX_BATCH_BLOCKS : span;
+		// Follow the FAT over the blocks covered by this batch
+		blocks[0] = offset_to_block(fdes, *offset);
+		for (int b = 1; b < n; b++)
+			blocks[b] = fat_get(blocks[b - 1]);
+		size_t num_bytes_to_copy = (size_t)n * bs - in_block;
+		if (num_bytes_to_copy > left) num_bytes_to_copy = left;
+		if (fs->mapped) {
+			// Mapped blocks are copied straight from the disk
+			mapped_copy(blocks, in_block, it, num_bytes_to_copy, 0);
+		} else {
+			size_t end = in_block + num_bytes_to_copy;
+			struct iov_iter start = *it;
+			int nbounce = 0;
+			for (int b = 0; b < n; b++) {
+				size_t lo = (b == 0) ? in_block : 0;
+				size_t hi = (b == n - 1 && end % bs != 0) ?
+					end % bs : bs;
+				uint8_t *dst = iter_span(it, bs);
+				if (lo == 0 && hi == bs && dst) {
+					bufs[b] = dst;
+				} else if (nbounce < max_bounce) {
+					bufs[b] = &bounce_buffer[nbounce++ * bs];
+				} else {
+					// The batch stops short once out of bounce buffers
+					n = b;
+					end = (size_t)n * bs;
+					num_bytes_to_copy = end - in_block;
+					break;
+				}
+				iter_copy(it, NULL, hi - lo, 0);
+			}
+			// Contiguous blocks are read with a single vectored call. A
+			// batch that cannot be read ends the read, after the blocks
+			// before the first one that fails
+			if (batch_io(blocks, n, bufs, 0)) {
+				int good = 0;
+				while (good < n &&
+					!batch_io(&blocks[good], 1, &bufs[good], 0))
+					good++;
+				if (good == 0)
+					return num_bytes_copied ? (ssize_t)num_bytes_copied : -1;
+				failed = good < n;
+				if (failed) {
+					n = good;
+					end = (size_t)n * bs;
+					num_bytes_to_copy = end - in_block;
+				}
+			}
+			// Copy the relevant part of the bounced blocks
+			*it = start;
+			for (int b = 0; b < n; b++) {
+				size_t lo = (b == 0) ? in_block : 0;
+				size_t hi = (b == n - 1 && end % bs != 0) ?
+					end % bs : bs;
+				int bounced = bufs[b] >= bounce_buffer &&
+					bufs[b] < bounce_buffer + fdes->bounce_size;
+				iter_copy(it, bounced ? &bufs[b][lo] : NULL, hi - lo, 1);
+			}
+		}
+		// The next batch starts where this one stopped
+		set_cursor(fdes, *offset / bs + n - 1, blocks[n - 1]);
+		// Adjust indicators
+		num_bytes_copied += num_bytes_to_copy;
+		*offset += num_bytes_to_copy;
+	}
+	fdes->ra_next = *offset;
+	// A mapped disk needs no readahead of ours. Neither do reads of several
+	// blocks, already read in runs: going through the cache would only add
+	// copies made under its lock, which concurrent readers wait for
+	if (sequential && !fs->mapped && count < RA_MIN_BLOCKS * bs)
+		readahead(fdes);
+	return num_bytes_copied;
+}
+
+// Read up to @count bytes at *@offset in the file open at @fdes into @buf,
+// and advance *@offset past them. Return the number of bytes read. Called
+// with the file locked for reading
+static ssize_t read_at(filedes *fdes, size_t *offset, uint8_t *buf,
+	size_t count)
+{
+	struct iovec iov = { buf, count };
+	struct iov_iter it = { &iov, 1, 0 };
+	return readv_at(fdes, offset, &it, count);
+}
+
+static ssize_t do_read(int fd, void *buf, size_t count)
+{
+	if (buf == NULL) return -1;
+	filedes *fdes = fd_get(fd);
+	if (!fdes) return -1;
+	pthread_rwlock_t *lock = &fs->file_locks[fdes->root_index];
+	pthread_rwlock_rdlock(lock);
+	// Buffered bytes must be on the disk to be read, which takes the file
+	// for writing
+	if (file_pending(fdes->root_index)) {
+		pthread_rwlock_unlock(lock);
+		pthread_rwlock_wrlock(lock);
+		wb_flush_file(fdes->root_index, -1);
+		pthread_rwlock_unlock(lock);
+		pthread_rwlock_rdlock(lock);
+	}
+	ssize_t ret = read_at(fdes, &fdes->file_offset, buf, count);
+	pthread_rwlock_unlock(lock);
+	fd_put(fdes);
+	return ret;
+}
+
+// Set up @pos for a positional access to the file at @rootindex: the walk
+// keeps a cursor of its own, and there is no readahead. It has buffers of its
+// own too, the descriptor being free for other calls meanwhile. Return -1 if
+// out of memory
+static int positional(filedes *pos, int rootindex) {
+	filedes init = { .open = 1, .root_index = rootindex, .cursor_block = -1,
+		.ra_next = SIZE_MAX };
+	*pos = init;
+	return fd_buffers(pos);
+}
+
+static ssize_t do_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	if (buf == NULL || offset < 0) return -1;
+	filedes *fdes = fd_get(fd);
+	if (!fdes) return -1;
+	filedes pos;
+	if (positional(&pos, fdes->root_index)) {
+		fd_put(fdes);
+		return -1;
+	}
+	pthread_rwlock_t *lock = &fs->file_locks[pos.root_index];
+	pthread_rwlock_rdlock(lock);
+	// Buffered bytes must be on the disk to be read
+	if (file_pending(pos.root_index)) {
+		pthread_rwlock_unlock(lock);
+		pthread_rwlock_wrlock(lock);
+		wb_flush_file(pos.root_index, -1);
+		pthread_rwlock_unlock(lock);
+		pthread_rwlock_rdlock(lock);
+	}
+	// The descriptor cannot be closed while the file is locked, other calls
+	// can use it meanwhile
+	fd_put(fdes);
+	size_t at = offset;
+	ssize_t ret = read_at(&pos, &at, buf, count);
+	pthread_rwlock_unlock(lock);
+	fd_buffers_free(&pos);
+	return ret;
+}
+
+static ssize_t do_pwrite(int fd, void *buf, size_t count, off_t offset)
+{
+	if (buf == NULL || offset < 0) return -1;
+	filedes *fdes = fd_get(fd);
+	if (!fdes) return -1;
+	filedes pos;
+	if (positional(&pos, fdes->root_index)) {
+		fd_put(fdes);
+		return -1;
+	}
+	pthread_rwlock_t *lock = &fs->file_locks[pos.root_index];
+	pthread_rwlock_wrlock(lock);
+	fd_put(fdes);
+	// Bytes buffered by all descriptors of the file go first
+	wb_flush_file(pos.root_index, -1);
+	ssize_t ret = -1;
+	size_t at = offset;
+	// Files have no holes
+	if (at <= root_size(pos.root_index))
+		ret = count ? write_at(&pos, &at, buf, count) : 0;
+	pthread_rwlock_unlock(lock);
+	fd_buffers_free(&pos);
+	return ret;
+}
+
+static ssize_t do_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	if (iov == NULL || iovcnt < 0 || iovcnt > FS_IOV_MAX) return -1;
+	ssize_t count = iov_total(iov, iovcnt);
+	if (count < 0) return -1;
+	filedes *fdes = fd_get(fd);
+	if (!fdes) return -1;
+	pthread_rwlock_t *lock = &fs->file_locks[fdes->root_index];
+	pthread_rwlock_rdlock(lock);
+	// Buffered bytes must be on the disk to be read
+	if (file_pending(fdes->root_index)) {
+		pthread_rwlock_unlock(lock);
+		pthread_rwlock_wrlock(lock);
+		wb_flush_file(fdes->root_index, -1);
+		pthread_rwlock_unlock(lock);
+		pthread_rwlock_rdlock(lock);
+	}
+	struct iov_iter it = { iov, iovcnt, 0 };
+	ssize_t ret = readv_at(fdes, &fdes->file_offset, &it, count);
+	pthread_rwlock_unlock(lock);
+	fd_put(fdes);
+	return ret;
+}
+
+static ssize_t do_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	if (iov == NULL || iovcnt < 0 || iovcnt > FS_IOV_MAX) return -1;
+	ssize_t count = iov_total(iov, iovcnt);
+	if (count < 0) return -1;
+	filedes *fdes = fd_get(fd);
+	if (!fdes) return -1;
+	if (count == 0) {
+		fd_put(fdes);
+		return 0;
+	}
+	pthread_rwlock_t *lock = &fs->file_locks[fdes->root_index];
+	pthread_rwlock_wrlock(lock);
+	// Bytes buffered by other descriptors of the file go first
+	wb_flush_file(fdes->root_index, fd);
+	struct iov_iter it = { iov, iovcnt, 0 };
+	ssize_t ret = -1;
+	if (fdes->wb_size) {
+		// Same as fs_write(), the buffers are gathered into the write
+		// buffer when they fit
+		if (fdes->wb_len && fdes->wb_start + fdes->wb_len != fdes->file_offset)
+			wb_flush(fd);
+		if (fdes->wb_len + count > fdes->wb_size) wb_flush(fd);
+		if ((size_t)count < fdes->wb_size) {
+			if (fdes->wb_len == 0) fdes->wb_start = fdes->file_offset;
+			iter_copy(&it, &fdes->wb_buf[fdes->wb_len], count, 0);
+			fdes->wb_len += count;
+			fdes->file_offset += count;
+			ret = count;
+		}
+	}
+	if (ret < 0) ret = writev_at(fdes, &fdes->file_offset, &it, count);
+	pthread_rwlock_unlock(lock);
+	fd_put(fdes);
+	return ret;
+}
+
+// -- Entry points -- //
+// Each entry point holds the lock of the handle, shared so that they run
+// concurrently, or exclusively when the file system comes and goes
+
+// State of the calling thread saved by fs_enter()
+struct fs_call {
+	struct fs_handle *h;
+	int exclusive;
+	struct filesystem *fs;
+	struct disk *disk;
+};
+
+// Make the calling thread work on the file system of @h until fs_leave()
+static void fs_enter(struct fs_call *c, struct fs_handle *h, int exclusive) {
+	c->h = h;
+	c->exclusive = exclusive;
+	c->fs = fs;
+	if (h && exclusive) pthread_rwlock_wrlock(&h->lock);
+	else if (h) pthread_rwlock_rdlock(&h->lock);
+	fs = h ? h->fs : NULL;
+	c->disk = block_disk_select(h ? h->disk : NULL);
+}
+
+static void fs_leave(struct fs_call *c) {
+	// Mounting and unmounting change the file system of the handle
+	if (c->h && c->exclusive) c->h->fs = fs;
+	if (c->h) pthread_rwlock_unlock(&c->h->lock);
+	fs = c->fs;
+	block_disk_select(c->disk);
+}
+
+static void handle_free(struct fs_handle *h) {
+	block_disk_free(h->disk);
+	pthread_rwlock_destroy(&h->lock);
+	free(h);
+}
+
+int fs_mount_flags_h(const char *diskname, int flags, struct fs_handle **h)
+{
+	if (!h) return -1;
+	*h = calloc(1, sizeof(struct fs_handle));
+	if (!*h) return -1;
+	(*h)->disk = block_disk_new();
+	if (!(*h)->disk) {
+		free(*h);
+		*h = NULL;
+		return -1;
+	}
+	pthread_rwlock_init(&(*h)->lock, NULL);
+	struct fs_call c;
+	fs_enter(&c, *h, 1);
+	int ret = do_mount(diskname, flags, (*h)->disk);
+	fs_leave(&c);
+	if (ret) {
+		handle_free(*h);
+		*h = NULL;
+	}
+	return ret;
+}
+
+int fs_mount_h(const char *diskname, struct fs_handle **h)
+{
+	return fs_mount_flags_h(diskname, 0, h);
+}
+
+int fs_umount_h(struct fs_handle *h)
+{
+	struct fs_call c;
+	if (!h) return -1;
+	fs_enter(&c, h, 1);
+	int ret = do_umount();
+	fs_leave(&c);
+	// The handle goes away with its file system
+	if (!h->fs) handle_free(h);
+	return ret;
+}
+
+int fs_mount_flags(const char *diskname, int flags)
+{
+	struct fs_call c;
+	fs_enter(&c, &default_handle, 1);
+	int ret = do_mount(diskname, flags, NULL);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_mount(const char *diskname)
+{
+	return fs_mount_flags(diskname, 0);
+}
+
+int fs_umount(void)
+{
+	struct fs_call c;
+	fs_enter(&c, &default_handle, 1);
+	int ret = do_umount();
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_sync_h(struct fs_handle *h)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_sync();
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_sync(void)
+{
+	return fs_sync_h(&default_handle);
+}
+
+int fs_sync_interval_h(struct fs_handle *h, unsigned int ms)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 1);
+	int ret = do_sync_interval(ms);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_sync_interval(unsigned int ms)
+{
+	return fs_sync_interval_h(&default_handle, ms);
+}
+
+int fs_info_h(struct fs_handle *h)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_info();
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_info(void)
+{
+	return fs_info_h(&default_handle);
+}
+
+int fs_create_h(struct fs_handle *h, const char *filename)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_create(filename);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_create(const char *filename)
+{
+	return fs_create_h(&default_handle, filename);
+}
+
+int fs_delete_h(struct fs_handle *h, const char *filename)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_delete(filename);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_delete(const char *filename)
+{
+	return fs_delete_h(&default_handle, filename);
+}
+
+int fs_ls_h(struct fs_handle *h)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_ls(NULL);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_ls(void)
+{
+	return fs_ls_h(&default_handle);
+}
+
+int fs_lsdir_h(struct fs_handle *h, const char *path)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_ls(path);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_lsdir(const char *path)
+{
+	return fs_lsdir_h(&default_handle, path);
+}
+
+int fs_mkdir_h(struct fs_handle *h, const char *path)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_mkdir(path);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_mkdir(const char *path)
+{
+	return fs_mkdir_h(&default_handle, path);
+}
+
+int fs_rmdir_h(struct fs_handle *h, const char *path)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_rmdir(path);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_rmdir(const char *path)
+{
+	return fs_rmdir_h(&default_handle, path);
+}
+
+int fs_open_h(struct fs_handle *h, const char *filename)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_open(filename);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_h(&default_handle, filename);
+}
+
+int fs_close_h(struct fs_handle *h, int fd)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_close(fd);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_close(int fd)
+{
+	return fs_close_h(&default_handle, fd);
+}
+
+off_t fs_stat_h(struct fs_handle *h, int fd)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	off_t ret = do_stat(fd);
+	fs_leave(&c);
+	return ret;
+}
+
+off_t fs_stat(int fd)
+{
+	return fs_stat_h(&default_handle, fd);
+}
+
+int fs_lseek_h(struct fs_handle *h, int fd, off_t offset)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_lseek(fd, offset);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_lseek(int fd, off_t offset)
+{
+	return fs_lseek_h(&default_handle, fd, offset);
+}
+
+int fs_setbuf_h(struct fs_handle *h, int fd, size_t size)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_setbuf(fd, size);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_setbuf(int fd, size_t size)
+{
+	return fs_setbuf_h(&default_handle, fd, size);
+}
+
+int fs_flush_h(struct fs_handle *h, int fd)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	int ret = do_flush(fd);
+	fs_leave(&c);
+	return ret;
+}
+
+int fs_flush(int fd)
+{
+	return fs_flush_h(&default_handle, fd);
+}
+
+ssize_t fs_write_h(struct fs_handle *h, int fd, void *buf, size_t count)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	ssize_t ret = do_write(fd, buf, count);
+	fs_leave(&c);
+	return ret;
+}
+
+ssize_t fs_write(int fd, void *buf, size_t count)
+{
+	return fs_write_h(&default_handle, fd, buf, count);
+}
+
+ssize_t fs_read_h(struct fs_handle *h, int fd, void *buf, size_t count)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	ssize_t ret = do_read(fd, buf, count);
+	fs_leave(&c);
+	return ret;
+}
+
+ssize_t fs_read(int fd, void *buf, size_t count)
+{
+	return fs_read_h(&default_handle, fd, buf, count);
+}
+
+ssize_t fs_pread_h(struct fs_handle *h, int fd, void *buf, size_t count,
+	off_t offset)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	ssize_t ret = do_pread(fd, buf, count, offset);
+	fs_leave(&c);
+	return ret;
+}
+
+ssize_t fs_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	return fs_pread_h(&default_handle, fd, buf, count, offset);
+}
+
+ssize_t fs_pwrite_h(struct fs_handle *h, int fd, void *buf, size_t count,
+	off_t offset)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	ssize_t ret = do_pwrite(fd, buf, count, offset);
+	fs_leave(&c);
+	return ret;
+}
+
+ssize_t fs_pwrite(int fd, void *buf, size_t count, off_t offset)
+{
+	return fs_pwrite_h(&default_handle, fd, buf, count, offset);
+}
+
+ssize_t fs_writev_h(struct fs_handle *h, int fd, const struct iovec *iov,
+	int iovcnt)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	ssize_t ret = do_writev(fd, iov, iovcnt);
+	fs_leave(&c);
+	return ret;
+}
+
+ssize_t fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fs_writev_h(&default_handle, fd, iov, iovcnt);
+}
+
+ssize_t fs_readv_h(struct fs_handle *h, int fd, const struct iovec *iov,
+	int iovcnt)
+{
+	struct fs_call c;
+	fs_enter(&c, h, 0);
+	ssize_t ret = do_readv(fd, iov, iovcnt);
+	fs_leave(&c);
+	return ret;
+}
+
+ssize_t fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fs_readv_h(&default_handle, fd, iov, iovcnt);
+}
+
+// -- Formatting -- //
+
+int fs_format(const char *diskname, size_t blocks, size_t block_size)
+{
+	return fs_format_flags(diskname, blocks, block_size, 0);
+}
+
+int fs_format_flags(const char *diskname, size_t blocks, size_t block_size,
+	int flags)
+{
+	int v1 = (flags & FS_FORMAT_V1) != 0;
+	int packed = (flags & FS_FORMAT_PACKED) != 0;
+	int compress = (flags & FS_FORMAT_COMPRESS) != 0;
+	int checksum = (flags & FS_FORMAT_CHECKSUM) != 0;
+	if (block_size == 0) block_size = BLOCK_SIZE;
+	// Version 1 only has blocks of the default size, and 16-bit block
+	// numbers. It does not pack, compress nor checksum
+	if (v1 && (block_size != BLOCK_SIZE || blocks > UINT16_MAX || packed ||
+		compress || checksum))
+		return -1;
+	// A cluster spans two blocks at least
+	if (compress && block_size > CLUSTER_BYTES / 2) return -1;
+	// The root directory spans several blocks when they are small
+	size_t root_blocks = (sizeof(struct root_dir) + block_size - 1) /
+		block_size;
+	// A superblock, a FAT block, the root directory and a data block at
+	// least. Block numbers are handled as int
+	if (!diskname || blocks < 3 + root_blocks || blocks > INT_MAX) return -1;
+	// The checksum area takes 4 bytes for each of the other blocks
+	size_t ncsum = checksum ? (blocks * 4 + block_size + 3) / (block_size + 4) :
+		0;
+	size_t nfs = blocks - ncsum;
+	if (nfs < 3 + root_blocks) return -1;
+	// As many data blocks as fit on the disk along with their FAT
+	size_t per_block = block_size / (v1 ? sizeof(uint16_t) : sizeof(uint32_t));
+	size_t nfat = (nfs - 1 - root_blocks + per_block) / (per_block + 1);
+	size_t ndata = nfs - 1 - root_blocks - nfat;
+	// The first fragment block comes after the reserved data block
+	if (packed && ndata <= FRAG_FIRST) return -1;
+	int mode = (flags & FS_FORMAT_PREALLOC) ? BLOCK_CREATE_PREALLOC :
+		BLOCK_CREATE_SPARSE;
+	// The disk is written through an instance of its own, so that a file
+	// system mounted by the caller is left alone
+	struct disk *d = block_disk_new();
+	if (!d) return -1;
+	struct disk *prev = block_disk_select(d);
+	if (block_size_set(block_size) ||
+		block_disk_create_mode(diskname, blocks, mode) ||
+		block_disk_open(diskname)) {
+		block_disk_select(prev);
+		block_disk_free(d);
+		return -1;
+	}
+	int ret = -1;
+	// Blocks written from now on get their checksum updated
+	uint8_t *buf = NULL;
+	if (!checksum || !block_checksum_create(nfs, ncsum))
+		buf = calloc(1, block_size);
+	if (buf) {
+		if (v1) {
+			struct superblock *sb = (struct superblock *)buf;
+			memcpy(sb->signature, FS_SIGNATURE, 8);
+			sb->total_blocks_on_disk = blocks;
+			sb->root_dir_index = nfat + 1;
+			sb->data_block_start_index = nfat + 2;
+			sb->amount_of_data_blocks = ndata;
+			sb->num_of_blocks_for_FAT = nfat;
+		} else {
+			struct superblock2 *sb = (struct superblock2 *)buf;
+			memcpy(sb->signature, FS_SIGNATURE2, 8);
+			sb->total_blocks_on_disk = blocks;
+			sb->root_dir_index = nfat + 1;
+			sb->data_block_start_index = nfat + 1 + root_blocks;
+			sb->amount_of_data_blocks = ndata;
+			sb->num_of_blocks_for_FAT = nfat;
+			sb->block_size = block_size;
+			sb->features = (packed ? FEATURE_PACKED : 0) |
+				(compress ? FEATURE_COMPRESSED : 0) |
+				(checksum ? FEATURE_CHECKSUM : 0);
+			sb->checksum_start = checksum ? nfs : 0;
+			sb->checksum_blocks = ncsum;
+		}
+		ret = block_write(0, buf);
+		// FAT entry 0 is reserved. The other entries are free and the root
+		// directory is empty: they are all zeroes, which is what a new disk
+		// file holds already
+		memset(buf, 0, block_size);
+		if (v1) ((uint16_t *)buf)[0] = FAT16_EOC;
+		else ((uint32_t *)buf)[0] = UINT32_MAX;
+		// But for the first fragment block, which is always there
+		if (packed) ((uint32_t *)buf)[FRAG_FIRST] = UINT32_MAX;
+		if (!ret) ret = block_write(1, buf);
+		if (!ret && packed) {
+			struct frag_header hdr = { FRAG_MAGIC, 0, 1 };
+			memset(buf, 0, block_size);
+			memcpy(buf, &hdr, sizeof(hdr));
+			ret = block_write(1 + nfat + root_blocks + FRAG_FIRST, buf);
+		}
+	}
+	free(buf);
+	if (block_disk_close()) ret = -1;
+	block_disk_select(prev);
+	block_disk_free(d);
+	return ret;
 }
@@ -2,6 +2,8 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/types.h> /* for ssize_t and off_t definitions */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -12,6 +14,105 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Maximum number of buffers in a vectored read or write */
+#define FS_IOV_MAX 1024
+
+/** Mount flags */
+/* Map the whole virtual disk file in memory instead of using file I/O */
+#define FS_MOUNT_MMAP 0x1
+/* Transfer the blocks of large reads and writes asynchronously */
+#define FS_MOUNT_ASYNC 0x2
+/* Create a metadata journal on the disk if it has none */
+#define FS_MOUNT_JOURNAL 0x4
+
+/** Format flags */
+/* Reserve the space of the whole virtual disk file when it is created */
+#define FS_FORMAT_PREALLOC 0x1
+/* Create a version 1 file system, as fs_make.x does */
+#define FS_FORMAT_V1 0x2
+/* Pack small files together instead of giving each a block */
+#define FS_FORMAT_PACKED 0x4
+/* Compress the content of files */
+#define FS_FORMAT_COMPRESS 0x8
+/* Checksum every block to detect corruption */
+#define FS_FORMAT_CHECKSUM 0x10
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @blocks: Size of the virtual disk, in blocks
+ * @block_size: Size of the blocks in bytes, or 0 for the default of 4096
+ *
+ * Create virtual disk file @diskname, replacing any existing file, and write an
+ * empty version 2 file system on it. Version 2 uses 32-bit FAT entries and
+ * 64-bit file sizes, so that a disk can hold up to %INT_MAX blocks, and a file
+ * as much of them as it likes. The file system is not mounted.
+ *
+ * The block size is recorded in the superblock and used whenever the file
+ * system is mounted. It is a power of two between 1024 and 65536: small blocks
+ * waste less space on small files, large ones move more data per request.
+ * Version 1 file systems always use blocks of 4096 bytes.
+ *
+ * Return: -1 if @block_size is not a valid block size, if @blocks is too small
+ * to hold a file system or larger than %INT_MAX, or if the virtual disk file
+ * cannot be created. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t blocks, size_t block_size);
+
+/**
+ * fs_format_flags - Create a file system with options
+ * @diskname: Name of the virtual disk file
+ * @blocks: Size of the virtual disk, in blocks
+ * @block_size: Size of the blocks in bytes, or 0 for the default of 4096
+ * @flags: Bitwise or of format flags, or 0
+ *
+ * Same as fs_format(), with options. The virtual disk file is sparse unless
+ * %FS_FORMAT_PREALLOC is given, in which case its whole space is reserved in
+ * the host file system right away. With %FS_FORMAT_V1, the file system is of
+ * version 1, which has blocks of 4096 bytes and at most 65535 of them.
+ *
+ * With %FS_FORMAT_PACKED, files of up to half a block are packed together in
+ * shared fragment blocks rather than each taking a block of its own: a 40-byte
+ * file then takes 64 bytes of a block of 4096 bytes, and is read or written
+ * with a single block transfer and no FAT lookup. A file moves to blocks of its
+ * own once it grows past half a block. Version 1 does not pack files.
+ *
+ * With %FS_FORMAT_COMPRESS, the content of files is cut in clusters of 64 KiB,
+ * each compressed on its own with a fast LZ codec and taking only the blocks
+ * the result needs. Logs and text typically take 3 to 5 times less room,
+ * blocks to transfer and room in the block cache; a read decompresses the
+ * clusters it touches only. Clusters that do not compress are stored as they
+ * are, and so is the last cluster of a file until it fills up. Overwriting
+ * part of a compressed cluster compresses it again. It takes blocks of at most
+ * 32768 bytes, and version 1 does not compress files.
+ *
+ * With %FS_FORMAT_CHECKSUM, the end of the disk holds the CRC32C of every
+ * other block, about 1 block in 1000 for blocks of 4096 bytes. Each block read
+ * from the virtual disk file is checked, metadata and file content alike, and
+ * one that does not match makes the call reading it fail rather than return
+ * corrupted data; mounting fails if the superblock, FAT or root directory is
+ * corrupted. Checksums are computed with the crc32 instruction of SSE4.2 when
+ * the processor has it, at several GB/s, so that they can be left on. They
+ * are made durable along with the blocks by fs_sync() and fs_umount(): after
+ * a crash, the blocks written since may not match them. On a disk with a
+ * journal, mounting then writes the metadata again, and only file content not
+ * made durable by fs_sync() can read as corrupted. The disk is accessed with
+ * file I/O even with %FS_MOUNT_MMAP. Version 1 does not checksum blocks.
+ *
+ * Only the superblock, the first FAT block, the first fragment block and the
+ * checksum area if any are written, the rest of the metadata of an empty file
+ * system being zeroes: formatting takes the same time whatever the size of the
+ * disk, apart from the reservation and the checksum area.
+ *
+ * Return: -1 if @block_size is not a valid block size, if @blocks is too small
+ * to hold a file system or too large for its version, if %FS_FORMAT_PACKED,
+ * %FS_FORMAT_COMPRESS or %FS_FORMAT_CHECKSUM is given with %FS_FORMAT_V1, if
+ * %FS_FORMAT_COMPRESS is given with blocks larger than 32768 bytes, or if the
+ * virtual disk file cannot be created. 0 otherwise.
+ */
+int fs_format_flags(const char *diskname, size_t blocks, size_t block_size,
+	int flags);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,22 +121,83 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * Both formats are mounted: version 1, with 16-bit FAT entries and 32-bit file
+ * sizes, and version 2 (see fs_format()).
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_flags - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of mount flags
+ *
+ * Same as fs_mount(), with the options given in @flags. With %FS_MOUNT_MMAP,
+ * the virtual disk file is mapped in memory: the metadata and the file content
+ * are accessed in place in the mapping, and the mapping is synchronized with
+ * the virtual disk file by fs_umount(). With %FS_MOUNT_ASYNC, fs_read() and
+ * fs_write() keep many blocks in flight at once through io_uring, or through a
+ * pool of I/O threads if io_uring is not available.
+ *
+ * With %FS_MOUNT_JOURNAL, a journal is reserved in the free space if the disk
+ * has none yet. On a disk with a journal, fs_sync() makes the metadata updated
+ * since the previous call durable with a single sequential write to the
+ * journal, and mounting replays the journal after a crash. The journal is
+ * ignored with %FS_MOUNT_MMAP, once it has been replayed.
+ *
+ * Once mounted, the file system can be used from several threads at once.
+ * Reads of different files, and reads of the same file through different file
+ * descriptors, run in parallel; writes to a file are serialized. A file
+ * descriptor is used by one call at a time.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid file
+ * system can be located, or if a journal cannot be replayed or created. 0
+ * otherwise.
+ */
+int fs_mount_flags(const char *diskname, int flags);
+
 /**
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. Only the metadata modified since the last fs_sync() is written
+ * back.
  *
- * Return: -1 if no underlying virtual disk was opened, or if the virtual disk
- * cannot be closed, or if there are still open file descriptors. 0 otherwise.
+ * Return: -1 if no underlying virtual disk was opened, or if there are still
+ * open file descriptors, or if the metadata cannot be written back or the
+ * virtual disk cannot be closed. The file system is unmounted in the last two
+ * cases all the same. 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Synchronize file system
+ *
+ * Write out the bytes buffered by all open file descriptors, then the file
+ * content and the metadata modified since the last call, so that the virtual
+ * disk file holds a consistent file system. File content is always written
+ * before the metadata that refers to it.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if some blocks could
+ * not be written. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_sync_interval - Synchronize file system periodically
+ * @ms: Period in milliseconds, or 0 to stop
+ *
+ * Start a background thread that calls fs_sync() every @ms milliseconds, which
+ * bounds the amount of work lost if the process dies. The thread is stopped by
+ * fs_umount(). Calling fs_sync_interval() again changes the period.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if the thread cannot
+ * be started. 0 otherwise.
+ */
+int fs_sync_interval(unsigned int ms);
+
 /**
  * fs_info - Display information about file system
  *
@@ -54,6 +216,13 @@ int fs_info(void);
  * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
  * character).
  *
+ * On a version 2 file system, @filename can also be a path such as "a/b/file",
+ * whose components are separated by '/' and are each at most
+ * %FS_FILENAME_LEN characters long (including the NULL character): the file is
+ * then created in subdirectory "a/b" (see fs_mkdir()). The same goes for all
+ * the functions that take a file name. On a version 1 file system, the name is
+ * taken as it is.
+ *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
  * or if string @filename is too long, or if the root directory already contains
  * %FS_FILE_MAX_COUNT files. 0 otherwise.
@@ -68,7 +237,8 @@ int fs_create(const char *filename);
  * system.
  *
  * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * delete, if it is a directory, or if file @filename is currently open. 0
+ * otherwise.
  */
 int fs_delete(const char *filename);
 
@@ -81,6 +251,43 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_mkdir - Create a directory
+ * @path: Path of the directory
+ *
+ * Create a new and empty directory at @path, on a version 2 file system. Unlike
+ * the root directory, which holds up to %FS_FILE_MAX_COUNT entries, a
+ * subdirectory grows as entries are added to it: its entries are spread over
+ * the blocks of a hash table, so that finding one of them reads a single
+ * block, however many there are.
+ *
+ * Return: -1 if @path is invalid, if something named @path already exists, if
+ * the file system is of version 1, or if there is no room left for the
+ * directory. 0 otherwise.
+ */
+int fs_mkdir(const char *path);
+
+/**
+ * fs_rmdir - Remove a directory
+ * @path: Path of the directory
+ *
+ * Return: -1 if @path is invalid, if there is no directory at @path, or if the
+ * directory is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *path);
+
+/**
+ * fs_lsdir - List files of a directory
+ * @path: Path of the directory
+ *
+ * Same as fs_ls(), for the directory at @path. Directories are listed along
+ * with the files.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if there is no
+ * directory at @path. 0 otherwise.
+ */
+int fs_lsdir(const char *path);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -94,8 +301,8 @@ int fs_ls(void);
  * simultaneously.
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * if it is a directory, if there are already %FS_OPEN_MAX_COUNT files
+ * currently open, or if out of memory. Otherwise, return the file descriptor.
  */
 int fs_open(const char *filename);
 
@@ -103,10 +310,10 @@ int fs_open(const char *filename);
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd. Bytes still buffered by @fd are written out first.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if some buffered bytes could not be written out. 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -119,7 +326,7 @@ int fs_close(int fd);
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the current size of file.
  */
-int fs_stat(int fd);
+off_t fs_stat(int fd);
 
 /**
  * fs_lseek - Set file offset
@@ -131,10 +338,10 @@ int fs_stat(int fd);
  * fs_lseek(fd, fs_stat(fd));
  *
  * Return: -1 if file descriptor @fd is invalid (i.e., out of bounds, or not
- * currently open), or if @offset is larger than the current file size. 0
- * otherwise.
+ * currently open), or if @offset is negative or larger than the current file
+ * size. 0 otherwise.
  */
-int fs_lseek(int fd, size_t offset);
+int fs_lseek(int fd, off_t offset);
 
 /**
  * fs_write - Write to a file
@@ -155,7 +362,7 @@ int fs_lseek(int fd, size_t offset);
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually written.
  */
-int fs_write(int fd, void *buf, size_t count);
+ssize_t fs_write(int fd, void *buf, size_t count);
 
 /**
  * fs_read - Read from a file
@@ -172,9 +379,188 @@ int fs_write(int fd, void *buf, size_t count);
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
  *
+ * It is also smaller if part of the data cannot be read from the disk, for
+ * instance because it does not match its checksum (see fs_format_flags()):
+ * the bytes read until then are returned, and reading from there fails.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if no data can be read from the disk. Otherwise return the number
+ * of bytes actually read.
+ */
+ssize_t fs_read(int fd, void *buf, size_t count);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: Offset in the file to read from
+ *
+ * Same as fs_read(), but read from @offset instead of the file's offset,
+ * which is left unchanged. Several threads can read through the same file
+ * descriptor at once.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if no data can be read from the disk, or if out of memory. Otherwise
+ * return the number of bytes actually read.
+ */
+ssize_t fs_pread(int fd, void *buf, size_t count, off_t offset);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes to be written
+ * @offset: Offset in the file to write at
+ *
+ * Same as fs_write(), but write at @offset instead of the file's offset, which
+ * is left unchanged. The write is not buffered (see fs_setbuf()).
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @offset is past the end of the file, or if out of memory.
+ * Otherwise return the number of bytes actually written.
+ */
+ssize_t fs_pwrite(int fd, void *buf, size_t count, off_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to write in the file, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write(), with the data gathered from the @iovcnt buffers of
+ * @iov. The buffers are written as one range of the file: blocks are
+ * allocated and transferred once for all of them, rather than once per
+ * buffer.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @iovcnt is negative or greater than %FS_IOV_MAX, or if the buffers
+ * add up to more than %SSIZE_MAX bytes. Otherwise return the number of bytes
+ * actually written.
+ */
+ssize_t fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read(), with the data scattered into the @iovcnt buffers of @iov.
+ * Each buffer is filled up before the next one is used.
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually read.
+ * open), if @iovcnt is negative or greater than %FS_IOV_MAX, if the buffers
+ * add up to more than %SSIZE_MAX bytes, or if no data can be read from the
+ * disk. Otherwise return the number of bytes actually read.
  */
-int fs_read(int fd, void *buf, size_t count);
+ssize_t fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_setbuf - Set the write buffer of a file descriptor
+ * @fd: File descriptor
+ * @size: Size of the buffer in bytes, or 0 to disable buffering
+ *
+ * Give file descriptor @fd a write-behind buffer of @size bytes, rounded up to
+ * a whole number of blocks. Consecutive writes smaller than the buffer are then
+ * gathered in memory, and blocks are only allocated and written when the
+ * buffer fills up, when @fd writes elsewhere in the file, when the file is read
+ * or written through another descriptor, or on fs_flush() and fs_close().
+ * Buffering is disabled by default. Any buffered bytes are written out before
+ * the buffer is replaced.
+ *
+ * Since blocks are allocated late, a write into the buffer always succeeds:
+ * running out of space on disk is only reported by fs_flush() or fs_close().
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if the buffer cannot be allocated. 0 otherwise.
+ */
+int fs_setbuf(int fd, size_t size);
+
+/**
+ * fs_flush - Write out buffered bytes
+ * @fd: File descriptor
+ *
+ * Write out the bytes buffered by file descriptor @fd (see fs_setbuf()).
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if some buffered bytes could not be written out since the last call
+ * to fs_flush(). 0 otherwise.
+ */
+int fs_flush(int fd);
+
+/** File system handle */
+struct fs_handle;
+
+/**
+ * fs_mount_h - Mount a file system behind a handle
+ * @diskname: Name of the virtual disk file
+ * @h: Set to the handle of the mounted file system
+ *
+ * Same as fs_mount(), but the file system gets its own handle, with its own
+ * file descriptors and disk state, instead of being the one used by the
+ * functions above. Any number of file systems can be mounted this way at once,
+ * each on a different virtual disk file, and used from any thread.
+ *
+ * Each function above has a counterpart taking the handle as first argument,
+ * named with an _h suffix, such as fs_open_h(h, filename) or fs_read_h(h, fd,
+ * buf, count). File descriptors are only valid with the handle they were
+ * opened through.
+ *
+ * Return: -1 if @h is NULL or if the file system cannot be mounted, in which
+ * case *@h is set to NULL. 0 otherwise.
+ */
+int fs_mount_h(const char *diskname, struct fs_handle **h);
+
+/**
+ * fs_mount_flags_h - Mount a file system behind a handle, with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of mount flags
+ * @h: Set to the handle of the mounted file system
+ *
+ * Same as fs_mount_h(), with the options of fs_mount_flags().
+ *
+ * Return: -1 if @h is NULL or if the file system cannot be mounted. 0
+ * otherwise.
+ */
+int fs_mount_flags_h(const char *diskname, int flags, struct fs_handle **h);
+
+/**
+ * fs_umount_h - Unmount a file system mounted behind a handle
+ * @h: Handle of the file system
+ *
+ * Same as fs_umount(). Once the file system is unmounted, @h is released and
+ * must not be used anymore.
+ *
+ * Return: -1 if @h is NULL, or in the cases listed for fs_umount(). 0
+ * otherwise.
+ */
+int fs_umount_h(struct fs_handle *h);
+
+int fs_sync_h(struct fs_handle *h);
+int fs_sync_interval_h(struct fs_handle *h, unsigned int ms);
+int fs_info_h(struct fs_handle *h);
+int fs_create_h(struct fs_handle *h, const char *filename);
+int fs_delete_h(struct fs_handle *h, const char *filename);
+int fs_ls_h(struct fs_handle *h);
+int fs_mkdir_h(struct fs_handle *h, const char *path);
+int fs_rmdir_h(struct fs_handle *h, const char *path);
+int fs_lsdir_h(struct fs_handle *h, const char *path);
+int fs_open_h(struct fs_handle *h, const char *filename);
+int fs_close_h(struct fs_handle *h, int fd);
+off_t fs_stat_h(struct fs_handle *h, int fd);
+int fs_lseek_h(struct fs_handle *h, int fd, off_t offset);
+ssize_t fs_write_h(struct fs_handle *h, int fd, void *buf, size_t count);
+ssize_t fs_read_h(struct fs_handle *h, int fd, void *buf, size_t count);
+ssize_t fs_pread_h(struct fs_handle *h, int fd, void *buf, size_t count,
+	off_t offset);
+ssize_t fs_pwrite_h(struct fs_handle *h, int fd, void *buf, size_t count,
+	off_t offset);
+ssize_t fs_writev_h(struct fs_handle *h, int fd, const struct iovec *iov,
+	int iovcnt);
+ssize_t fs_readv_h(struct fs_handle *h, int fd, const struct iovec *iov,
+	int iovcnt);
+int fs_setbuf_h(struct fs_handle *h, int fd, size_t size);
+int fs_flush_h(struct fs_handle *h, int fd);
 
 #endif /* _FS_H */
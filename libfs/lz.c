@@ -0,0 +1,174 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Shortest match worth a copy */
+#define LZ_MIN_MATCH 4
+
+/* Size of the table of candidate matches, in bits */
+#define LZ_HASH_BITS 12
+
+/* Lengths of a token, 4 bits each, then in bytes of their own */
+#define LZ_TOKEN_MAX 15
+
+static uint32_t load32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Bucket of the table for the 4 bytes @v (Knuth's multiplicative hash) */
+static unsigned int lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Append the part of length @n that does not fit its token */
+static size_t put_length(uint8_t *dst, size_t out, size_t n)
+{
+	for (n -= LZ_TOKEN_MAX; n >= 255; n -= 255)
+		dst[out++] = 255;
+	dst[out++] = n;
+	return out;
+}
+
+/*
+ * Append a sequence at @out: @nlit literals from @lit, then a match of @mlen
+ * bytes @off bytes back, none if @mlen is 0. Return where the sequence ends,
+ * or 0 if it may not fit in @cap bytes
+ */
+static size_t emit(uint8_t *dst, size_t out, size_t cap, const uint8_t *lit,
+		   size_t nlit, size_t off, size_t mlen)
+{
+	size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+	/* Token, literals, offset, and both lengths at their longest */
+	if (out > cap || cap - out < 1 + nlit + 2 + (nlit + ml) / 255 + 2)
+		return 0;
+
+	dst[out++] = (nlit < LZ_TOKEN_MAX ? nlit : LZ_TOKEN_MAX) << 4 |
+		(ml < LZ_TOKEN_MAX ? ml : LZ_TOKEN_MAX);
+	if (nlit >= LZ_TOKEN_MAX)
+		out = put_length(dst, out, nlit);
+	memcpy(&dst[out], lit, nlit);
+	out += nlit;
+	if (!mlen)
+		return out;
+
+	dst[out++] = off & 0xff;
+	dst[out++] = off >> 8;
+	if (ml >= LZ_TOKEN_MAX)
+		out = put_length(dst, out, ml);
+	return out;
+}
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+	/* Last position each bucket was seen at, input fits 16 bits */
+	uint16_t table[1 << LZ_HASH_BITS];
+	size_t pos = 0, anchor = 0, out = 0;
+
+	if (len > LZ_MAX_INPUT)
+		return 0;
+	memset(table, 0, sizeof(table));
+
+	while (len >= LZ_MIN_MATCH && pos <= len - LZ_MIN_MATCH) {
+		uint32_t seq = load32(&src[pos]);
+		unsigned int h = lz_hash(seq);
+		size_t cand = table[h];
+		size_t mlen = LZ_MIN_MATCH;
+
+		table[h] = pos;
+		if (cand >= pos || load32(&src[cand]) != seq) {
+			/* Data that does not compress is skipped ever faster */
+			pos += 1 + ((pos - anchor) >> 6);
+			continue;
+		}
+
+		while (pos + mlen < len && src[cand + mlen] == src[pos + mlen])
+			mlen++;
+		out = emit(dst, out, cap, &src[anchor], pos - anchor, pos - cand,
+			   mlen);
+		if (!out)
+			return 0;
+		pos += mlen;
+		anchor = pos;
+	}
+
+	/* The last sequence holds the remaining literals only */
+	return emit(dst, out, cap, &src[anchor], len - anchor, 0, 0);
+}
+
+/* Add to *@n the part of a length that did not fit its token */
+static int get_length(const uint8_t *src, size_t len, size_t *in, size_t *n)
+{
+	uint8_t b;
+
+	do {
+		if (*in >= len)
+			return -1;
+		b = src[(*in)++];
+		*n += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t want)
+{
+	size_t in = 0, out = 0;
+
+	while (out < want) {
+		size_t nlit, mlen, off, n, step, from;
+		uint8_t token;
+
+		if (in >= len)
+			return -1;
+		token = src[in++];
+
+		nlit = token >> 4;
+		if (nlit == LZ_TOKEN_MAX && get_length(src, len, &in, &nlit))
+			return -1;
+		if (nlit > len - in)
+			return -1;
+		n = nlit < want - out ? nlit : want - out;
+		memcpy(&dst[out], &src[in], n);
+		out += n;
+		in += nlit;
+		if (out == want)
+			return 0;
+
+		/* The input ends with literals, too early if we get here */
+		if (len - in < 2)
+			return -1;
+		off = src[in] | src[in + 1] << 8;
+		in += 2;
+		mlen = token & LZ_TOKEN_MAX;
+		if (mlen == LZ_TOKEN_MAX && get_length(src, len, &in, &mlen))
+			return -1;
+		mlen += LZ_MIN_MATCH;
+		if (off == 0 || off > out)
+			return -1;
+
+		/*
+		 * A match may overlap the bytes it produces, it then repeats them:
+		 * copy a period at a time, doubling it as the output grows
+		 */
+		n = mlen < want - out ? mlen : want - out;
+		from = out - off;
+		for (step = off; n; ) {
+			size_t c = n < step ? n : step;
+
+			memcpy(&dst[out], &dst[out - step], c);
+			out += c;
+			n -= c;
+			if (2 * step <= out - from)
+				step *= 2;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint8_t definition */
+
+/** Largest input of lz_compress(), matches reach back that far at most */
+#define LZ_MAX_INPUT 65536
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Length of @src in bytes, at most %LZ_MAX_INPUT
+ * @dst: Buffer receiving the compressed data
+ * @cap: Size of @dst in bytes
+ *
+ * Compress @src with a byte-oriented LZ77 codec: a sequence of runs of
+ * literals each followed by a copy of earlier output, in the layout of LZ4
+ * blocks. Speed comes first, a single candidate match is looked at per
+ * position.
+ *
+ * Return: Number of bytes written to @dst, or 0 if the compressed data does
+ * not fit in @cap bytes or @len is too large.
+ */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Data produced by lz_compress()
+ * @len: Length of @src in bytes
+ * @dst: Buffer receiving the decompressed data
+ * @want: Number of bytes to decompress
+ *
+ * Decompress the first @want bytes of what @src holds into @dst, and stop
+ * there. The input is checked, so that corrupted data never makes it read or
+ * write out of bounds.
+ *
+ * Return: -1 if @src is corrupted or holds less than @want bytes. 0
+ * otherwise.
+ */
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t want);
+
+#endif /* _LZ_H */
@@ -0,0 +1,325 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Size of the transfers of the sequential passes */
+#define BENCH_CHUNK		(1024 * 1024)
+/* Size and number of the transfers of the random pass */
+#define BENCH_SMALL		4096
+#define BENCH_SMALL_COUNT	20000
+
+static const size_t block_sizes[] = { 1024, 4096, 16384, 65536 };
+
+/* Block size of the compression pass */
+#define BENCH_COMPRESS_BLOCK	4096
+
+/* Block size and runs, the fastest being kept, of the checksum pass */
+#define BENCH_CHECKSUM_BLOCK	4096
+#define BENCH_CHECKSUM_RUNS	5
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double rate(size_t bytes, double secs)
+{
+	return (double)bytes / (1 << 20) / secs;
+}
+
+/*
+ * Format @diskname with blocks of @block_size bytes, and time a file of
+ * @file_size bytes being written, read back, and read at random offsets
+ */
+static void bench(const char *diskname, size_t block_size, size_t file_size)
+{
+	uint8_t *buf = malloc(BENCH_CHUNK);
+	unsigned int seed = 1;
+	double start, write_secs, read_secs, small_secs;
+
+	if (!buf)
+		die("out of memory");
+	for (size_t i = 0; i < BENCH_CHUNK; i++)
+		buf[i] = (uint8_t)i;
+
+	/* Room for the file, its FAT and the root directory */
+	size_t blocks = file_size / block_size;
+	blocks += blocks / (block_size / 4) + 128;
+	if (fs_format(diskname, blocks, block_size))
+		die("cannot format %s", diskname);
+	if (fs_mount(diskname) || fs_create("bench"))
+		die("cannot create file on %s", diskname);
+
+	int fd = fs_open("bench");
+	start = now();
+	for (size_t done = 0; done < file_size; done += BENCH_CHUNK)
+		if (fs_write(fd, buf, BENCH_CHUNK) != BENCH_CHUNK)
+			die("short write");
+	if (fs_close(fd) || fs_umount())
+		die("cannot unmount %s", diskname);
+	write_secs = now() - start;
+
+	/* Each pass starts with the cache of a fresh mount */
+	if (fs_mount(diskname) || (fd = fs_open("bench")) < 0)
+		die("cannot open file on %s", diskname);
+	start = now();
+	for (size_t done = 0; done < file_size; done += BENCH_CHUNK)
+		if (fs_read(fd, buf, BENCH_CHUNK) != BENCH_CHUNK)
+			die("short read");
+	read_secs = now() - start;
+	if (fs_close(fd) || fs_umount())
+		die("cannot unmount %s", diskname);
+
+	if (fs_mount(diskname) || (fd = fs_open("bench")) < 0)
+		die("cannot open file on %s", diskname);
+	start = now();
+	for (int i = 0; i < BENCH_SMALL_COUNT; i++) {
+		off_t off = rand_r(&seed) % (file_size / BENCH_SMALL) * BENCH_SMALL;
+		if (fs_pread(fd, buf, BENCH_SMALL, off) != BENCH_SMALL)
+			die("short read");
+	}
+	small_secs = now() - start;
+	if (fs_close(fd) || fs_umount())
+		die("cannot unmount %s", diskname);
+
+	printf("%6zu  %9.1f  %9.1f  %9.1f\n", block_size,
+		   rate(file_size, write_secs), rate(file_size, read_secs),
+		   rate((size_t)BENCH_SMALL_COUNT * BENCH_SMALL, small_secs));
+	free(buf);
+}
+
+/* Lines of a web server log, which compress well */
+static void fill_log(uint8_t *buf, size_t size)
+{
+	char line[128];
+	size_t len = 0;
+
+	for (int i = 0; len < size; i++) {
+		int n = snprintf(line, sizeof(line), "2026-10-18T%02d:%02d:%02d "
+				 "GET /api/v1/items/%d HTTP/1.1 %d %d\n",
+				 i / 3600 % 24, i / 60 % 60, i % 60, i * 7919 % 100000,
+				 i % 17 ? 200 : 404, i * 31 % 20000);
+		if ((size_t)n > size - len)
+			n = size - len;
+		memcpy(&buf[len], line, n);
+		len += n;
+	}
+}
+
+/* Bytes that do not compress */
+static void fill_random(uint8_t *buf, size_t size)
+{
+	unsigned int seed = 1;
+
+	for (size_t i = 0; i < size; i++)
+		buf[i] = rand_r(&seed);
+}
+
+/*
+ * Format @diskname with @flags, write a file of @file_size bytes of what @fill
+ * gives, and read it back. Along with their speed, report how many times
+ * fewer bytes than the file holds the read took from the disk
+ */
+static void bench_compress(const char *diskname, const char *content,
+			   void (*fill)(uint8_t *, size_t), int flags,
+			   size_t file_size)
+{
+	uint8_t *buf = malloc(BENCH_CHUNK);
+	struct block_cache_stats stats;
+	double start, write_secs, read_secs;
+
+	if (!buf)
+		die("out of memory");
+	fill(buf, BENCH_CHUNK);
+
+	size_t blocks = file_size / BENCH_COMPRESS_BLOCK;
+	blocks += blocks / (BENCH_COMPRESS_BLOCK / 4) + 128;
+	if (fs_format_flags(diskname, blocks, BENCH_COMPRESS_BLOCK, flags))
+		die("cannot format %s", diskname);
+	if (fs_mount(diskname) || fs_create("bench"))
+		die("cannot create file on %s", diskname);
+
+	int fd = fs_open("bench");
+	start = now();
+	for (size_t done = 0; done < file_size; done += BENCH_CHUNK)
+		if (fs_write(fd, buf, BENCH_CHUNK) != BENCH_CHUNK)
+			die("short write");
+	if (fs_close(fd) || fs_umount())
+		die("cannot unmount %s", diskname);
+	write_secs = now() - start;
+
+	/* Blocks brought in by the read, whether asked for or read ahead */
+	if (fs_mount(diskname) || (fd = fs_open("bench")) < 0)
+		die("cannot open file on %s", diskname);
+	start = now();
+	for (size_t done = 0; done < file_size; done += BENCH_CHUNK)
+		if (fs_read(fd, buf, BENCH_CHUNK) != BENCH_CHUNK)
+			die("short read");
+	read_secs = now() - start;
+	if (block_cache_stats(&stats))
+		die("no cache statistics");
+	if (fs_close(fd) || fs_umount())
+		die("cannot unmount %s", diskname);
+
+	size_t disk_bytes = (stats.misses + stats.readahead) *
+		BENCH_COMPRESS_BLOCK;
+	printf("%-7s  %8s  %6.2f  %9.1f  %9.1f\n", content,
+		   (flags & FS_FORMAT_COMPRESS) ? "yes" : "no",
+		   (double)file_size / disk_bytes, rate(file_size, write_secs),
+		   rate(file_size, read_secs));
+	free(buf);
+}
+
+/* Push @diskname to the storage, and drop it from the page cache */
+static void drop_cache(const char *diskname)
+{
+	int fd = open(diskname, O_RDONLY);
+
+	if (fd < 0 || fdatasync(fd) ||
+	    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED))
+		die("cannot drop %s from the page cache", diskname);
+	close(fd);
+}
+
+/* Time the reading of @file_size bytes of file @fd into @buf, from its start */
+static double read_pass(int fd, uint8_t *buf, size_t file_size)
+{
+	double start = now();
+
+	if (fs_lseek(fd, 0))
+		die("cannot seek");
+	for (size_t done = 0; done < file_size; done += BENCH_CHUNK)
+		if (fs_read(fd, buf, BENCH_CHUNK) != BENCH_CHUNK)
+			die("short read");
+	return now() - start;
+}
+
+/* Keep @secs in @best if it beats it (0 if none yet) */
+static void keep_best(double *best, double secs)
+{
+	if (*best == 0 || secs < *best)
+		*best = secs;
+}
+
+/*
+ * Format @diskname with @flags, time a file of @file_size bytes written from
+ * @buf, read back from the storage, then read again from the page cache, and
+ * keep the best times so far in @best
+ */
+static void checksum_run(const char *diskname, int flags, size_t file_size,
+			 uint8_t *buf, double best[3])
+{
+	double start;
+
+	/* Room for the checksums too */
+	size_t blocks = file_size / BENCH_CHECKSUM_BLOCK;
+	blocks += blocks / (BENCH_CHECKSUM_BLOCK / 4) * 2 + 128;
+	if (fs_format_flags(diskname, blocks, BENCH_CHECKSUM_BLOCK, flags))
+		die("cannot format %s", diskname);
+	if (fs_mount(diskname) || fs_create("bench"))
+		die("cannot create file on %s", diskname);
+
+	int fd = fs_open("bench");
+	start = now();
+	for (size_t done = 0; done < file_size; done += BENCH_CHUNK)
+		if (fs_write(fd, buf, BENCH_CHUNK) != BENCH_CHUNK)
+			die("short write");
+	if (fs_close(fd) || fs_umount())
+		die("cannot unmount %s", diskname);
+	keep_best(&best[0], now() - start);
+
+	drop_cache(diskname);
+	if (fs_mount(diskname) || (fd = fs_open("bench")) < 0)
+		die("cannot open file on %s", diskname);
+	keep_best(&best[1], read_pass(fd, buf, file_size));
+	keep_best(&best[2], read_pass(fd, buf, file_size));
+	if (fs_close(fd) || fs_umount())
+		die("cannot unmount %s", diskname);
+}
+
+/*
+ * Compare the speed of a file of @file_size bytes written to @diskname and read
+ * back, with and without checksums, the best of BENCH_CHECKSUM_RUNS runs each.
+ * The runs alternate, so that both see the same machine. Checksums cost about
+ * the same time whether blocks come from the storage or from the page cache:
+ * next to the storage it is little, next to copies out of memory it is not.
+ */
+static void bench_checksum(const char *diskname, size_t file_size)
+{
+	uint8_t *buf = malloc(BENCH_CHUNK);
+	double best[2][3] = { { 0 } };
+
+	if (!buf)
+		die("out of memory");
+	fill_random(buf, BENCH_CHUNK);
+
+	for (int run = 0; run < BENCH_CHECKSUM_RUNS; run++)
+		for (int sum = 0; sum < 2; sum++)
+			checksum_run(diskname, sum ? FS_FORMAT_CHECKSUM : 0,
+				     file_size, buf, best[sum]);
+
+	printf("\n%-8s  %9s  %9s  %9s  (MB/s)\n", "checksum", "write",
+		   "read", "cached");
+	for (int sum = 0; sum < 2; sum++)
+		printf("%-8s  %9.1f  %9.1f  %9.1f\n", sum ? "yes" : "no",
+			   rate(file_size, best[sum][0]),
+			   rate(file_size, best[sum][1]),
+			   rate(file_size, best[sum][2]));
+	printf("%-8s  %8.1f%%  %8.1f%%  %8.1f%%\n", "overhead",
+		   100 * (best[1][0] / best[0][0] - 1),
+		   100 * (best[1][1] / best[0][1] - 1),
+		   100 * (best[1][2] / best[0][2] - 1));
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	size_t file_size = 64 * BENCH_CHUNK;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskname> [file_size_MB]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 2)
+		file_size = (size_t)atoi(argv[2]) * BENCH_CHUNK;
+	if (file_size == 0)
+		die("file size of 1MB at least");
+
+	/* The disk is formatted again for each block size */
+	printf("%6s  %9s  %9s  %9s  (MB/s)\n", "block", "write", "read",
+		   "4k rand");
+	for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++)
+		bench(argv[1], block_sizes[i], file_size);
+
+	/* Then with and without compression, on data that compresses or not */
+	printf("\n%-7s  %8s  %6s  %9s  %9s  (MB/s)\n", "content", "compress",
+		   "ratio", "write", "read");
+	bench_compress(argv[1], "log", fill_log, 0, file_size);
+	bench_compress(argv[1], "log", fill_log, FS_FORMAT_COMPRESS, file_size);
+	bench_compress(argv[1], "random", fill_random, 0, file_size);
+	bench_compress(argv[1], "random", fill_random, FS_FORMAT_COMPRESS,
+		       file_size);
+
+	/* Last, what checking every block read and written costs */
+	bench_checksum(argv[1], file_size);
+	return 0;
+}
@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Size of an entry of the root directory */
+#define ROOT_ENTRY_SIZE	32
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-1] [-b block_size] [-p] [-j] [-s] [-z] [-c] "
+			"<diskname> <data block count>\n"
+			"  -1  version 1 file system, as fs_make.x creates\n"
+			"  -b  size of the blocks in bytes (version 2 only)\n"
+			"  -p  reserve the whole disk file instead of a sparse one\n"
+			"  -j  create a metadata journal\n"
+			"  -s  pack small files together (version 2 only)\n"
+			"  -z  compress the content of files (version 2 only)\n"
+			"  -c  checksum every block (version 2 only)\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	size_t block_size = 4096;
+	int flags = 0, journal = 0, opt;
+
+	while ((opt = getopt(argc, argv, "1b:pjszc")) != -1) {
+		switch (opt) {
+		case '1':
+			flags |= FS_FORMAT_V1;
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			flags |= FS_FORMAT_PREALLOC;
+			break;
+		case 'j':
+			journal = 1;
+			break;
+		case 's':
+			flags |= FS_FORMAT_PACKED;
+			break;
+		case 'z':
+			flags |= FS_FORMAT_COMPRESS;
+			break;
+		case 'c':
+			flags |= FS_FORMAT_CHECKSUM;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+	const char *diskname = argv[optind];
+	long long data = atoll(argv[optind + 1]);
+	if (data < 1)
+		die("data block count invalid");
+
+	/*
+	 * The disk holds the superblock, the FAT, the root directory and the
+	 * data blocks, as fs_make.x lays them out
+	 */
+	size_t per_fat = block_size / ((flags & FS_FORMAT_V1) ? 2 : 4);
+	size_t root = (FS_FILE_MAX_COUNT * ROOT_ENTRY_SIZE + block_size - 1) /
+		block_size;
+	size_t blocks = data + (data + per_fat - 1) / per_fat + 1 + root;
+	/* Followed by the checksums of all of them */
+	size_t per_csum = block_size / 4;
+	if (flags & FS_FORMAT_CHECKSUM)
+		blocks += (blocks + per_csum - 1) / per_csum;
+	if (fs_format_flags(diskname, blocks, block_size, flags))
+		die("cannot create virtual disk '%s'", diskname);
+
+	/* The journal is reserved by the first mount asking for one */
+	if (journal && (fs_mount_flags(diskname, FS_MOUNT_JOURNAL) || fs_umount()))
+		die("cannot create the journal of '%s'", diskname);
+
+	printf("Created virtual disk '%s' with '%lld' data blocks\n", diskname,
+		   data);
+	return 0;
+}
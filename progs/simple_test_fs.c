@@ -1,9 +1,16 @@
+#include <crc32c.h>
+#include <disk.h>
 #include <fs.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 // File created by Cameron Fitzpatrick and Hunter Kennedy
 static void test_mount_unmount(void){
@@ -30,6 +37,8 @@ static void test_create() {
 	fs_mount("disk.fs");
 	assert(-1 == fs_create(NULL));
 	assert(-1 == fs_create("This is far too long of a filename for our program to work"));
+	// Version 1 has no directories
+	assert(-1 == fs_mkdir("dir"));
 	char buffer[11] = "file_x.txt";
 	for(int i = 0; i < FS_FILE_MAX_COUNT - 1; i++) {
 		char newbuffer[11];
@@ -148,6 +157,1130 @@ static void test_read() {
 	return;
 }
 
+static void test_cache() {
+	struct block_cache_stats stats;
+	char buf[10];
+	// The previous tests leave the disk mounted
+	fs_umount();
+	assert(-1 == block_cache_stats(&stats));
+	assert(-1 == block_cache_flush());
+	fs_mount("disk.fs");
+	assert(-1 == block_cache_set_size(16));
+	int fd = fs_open("asyoulik.txt");
+	assert(10 == fs_read(fd, buf, 10));
+	assert(0 == block_cache_stats(&stats));
+	size_t hits = stats.hits;
+	assert(0 == fs_lseek(fd, 0));
+	assert(10 == fs_read(fd, buf, 10));
+	assert(0 == block_cache_stats(&stats));
+	assert(stats.hits > hits);
+	assert(0 == block_cache_flush());
+	fs_close(fd);
+	fs_umount();
+	return;
+}
+
+static void test_write_no_read() {
+	struct block_cache_stats before, after;
+	char buf[100] = "fresh";
+	fs_mount("disk.fs");
+	assert(0 == fs_create("fresh.txt"));
+	int fd = fs_open("fresh.txt");
+	// A new block is written without reading it first
+	assert(0 == block_cache_stats(&before));
+	assert(100 == fs_write(fd, buf, 100));
+	assert(0 == block_cache_stats(&after));
+	assert(after.misses == before.misses + 1);
+	assert(after.hits == before.hits);
+	fs_close(fd);
+	assert(0 == fs_delete("fresh.txt"));
+	fs_umount();
+	return;
+}
+
+static void test_write_buffer() {
+	struct block_cache_stats before, after;
+	char line[100], readbuf[20000];
+	fs_mount("disk.fs");
+	assert(0 == fs_create("log.txt"));
+	int fd = fs_open("log.txt");
+	int reader = fs_open("log.txt");
+	assert(0 == fs_setbuf(fd, 10000));
+	// Small appends stay in the buffer until it fills up
+	assert(0 == block_cache_stats(&before));
+	for (int i = 0; i < 100; i++) {
+		memset(line, 'a' + i % 26, sizeof(line));
+		assert(100 == fs_write(fd, line, 100));
+	}
+	assert(0 == block_cache_stats(&after));
+	assert(after.misses == before.misses);
+	assert(10000 == fs_stat(fd));
+	assert(10000 == fs_stat(reader));
+	for (int i = 100; i < 200; i++) {
+		memset(line, 'a' + i % 26, sizeof(line));
+		assert(100 == fs_write(fd, line, 100));
+	}
+	// Reading through another descriptor sees the buffered bytes
+	assert(20000 == fs_read(reader, readbuf, sizeof(readbuf)));
+	for (int i = 0; i < 20000; i++) assert(readbuf[i] == 'a' + i / 100 % 26);
+	// A write elsewhere in the file lands after the buffered ones
+	assert(100 == fs_write(fd, line, 100));
+	assert(0 == fs_lseek(fd, 0));
+	assert(5 == fs_write(fd, "start", 5));
+	assert(0 == fs_flush(fd));
+	assert(0 == fs_setbuf(fd, 0));
+	fs_close(reader);
+	assert(0 == fs_close(fd));
+	fs_umount();
+	fs_mount("disk.fs");
+	fd = fs_open("log.txt");
+	assert(20100 == fs_stat(fd));
+	assert(5 == fs_read(fd, readbuf, 5));
+	assert(0 == memcmp(readbuf, "start", 5));
+	fs_close(fd);
+	assert(0 == fs_delete("log.txt"));
+	fs_umount();
+	return;
+}
+
+static void test_many_files() {
+	char name[FS_FILENAME_LEN];
+	fs_mount("disk.fs");
+	// Names must fit in FS_FILENAME_LEN bytes with their NULL character
+	assert(-1 == fs_create(""));
+	assert(-1 == fs_create("sixteen_chars_xx"));
+	assert(0 == fs_create("fifteen_chars_x"));
+	assert(0 == fs_delete("fifteen_chars_x"));
+	// Fill the root directory, asyoulik.txt is already there
+	for (int i = 1; i < FS_FILE_MAX_COUNT; i++) {
+		sprintf(name, "f%d", i);
+		assert(0 == fs_create(name));
+	}
+	assert(-1 == fs_create("onemore"));
+	assert(-1 == fs_create("f7"));
+	for (int i = 1; i < FS_FILE_MAX_COUNT; i += 3) {
+		sprintf(name, "f%d", i);
+		assert(0 == fs_delete(name));
+		assert(-1 == fs_delete(name));
+	}
+	// The remaining files are still found after the deletions
+	for (int i = 1; i < FS_FILE_MAX_COUNT; i++) {
+		sprintf(name, "f%d", i);
+		int fd = fs_open(name);
+		assert((i % 3 == 1) == (fd == -1));
+		if (fd != -1) fs_close(fd);
+	}
+	fs_umount();
+	// The index is rebuilt from the root directory on mount
+	fs_mount("disk.fs");
+	for (int i = 1; i < FS_FILE_MAX_COUNT; i++) {
+		sprintf(name, "f%d", i);
+		assert((i % 3 == 1) == (fs_delete(name) == -1));
+	}
+	assert(0 == fs_info());
+	fs_umount();
+	return;
+}
+
+// Write @name in a child process that dies without unmounting, after
+// fs_sync() if @interval is 0, or with the background flusher otherwise
+static void write_and_die(const char *name, unsigned int interval) {
+	char buf[6000];
+	memset(buf, 'z', sizeof(buf));
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		fs_mount("disk.fs");
+		fs_create(name);
+		int fd = fs_open(name);
+		if (interval) fs_sync_interval(interval);
+		fs_write(fd, buf, sizeof(buf));
+		if (interval) usleep(200 * 1000);
+		else fs_sync();
+		_exit(0);
+	}
+	int status;
+	assert(pid == waitpid(pid, &status, 0));
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void test_sync() {
+	struct block_cache_stats before, after;
+	char buf[6000];
+	assert(-1 == fs_sync());
+	write_and_die("synced.txt", 0);
+	write_and_die("flushed.txt", 50);
+	fs_mount("disk.fs");
+	const char *names[] = { "synced.txt", "flushed.txt" };
+	for (int i = 0; i < 2; i++) {
+		int fd = fs_open(names[i]);
+		assert(fd >= 0);
+		assert(6000 == fs_read(fd, buf, sizeof(buf)));
+		for (int j = 0; j < 6000; j++) assert(buf[j] == 'z');
+		fs_close(fd);
+		assert(0 == fs_delete(names[i]));
+	}
+	// Nothing is written when nothing changed
+	assert(0 == fs_sync());
+	assert(0 == block_cache_stats(&before));
+	assert(0 == fs_sync());
+	assert(0 == block_cache_stats(&after));
+	assert(after.writebacks == before.writebacks);
+	fs_umount();
+	return;
+}
+
+// Size of the root directory entry of @name, read from the disk without
+// mounting it, or -1 if there is no such entry
+static int raw_file_size(const char *name) {
+	uint8_t super[4096], root[4096];
+	int size = -1;
+	assert(0 == block_disk_open("disk.fs"));
+	assert(0 == block_read(0, super));
+	assert(0 == block_read(super[10] | super[11] << 8, root));
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (!strcmp((char *)&root[32 * i], name))
+			memcpy(&size, &root[32 * i + 16], 4);
+	}
+	block_disk_close();
+	return size;
+}
+
+static void test_journal() {
+	char name[FS_FILENAME_LEN], buf[100];
+	assert(0 == fs_mount_flags("disk.fs", FS_MOUNT_JOURNAL));
+	fs_umount();
+	// Many small transactions, so that the journal wraps around
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		fs_mount("disk.fs");
+		for (int i = 0; i < 40; i++) {
+			sprintf(name, "j%d", i);
+			fs_create(name);
+			int fd = fs_open(name);
+			memset(buf, i, sizeof(buf));
+			fs_write(fd, buf, i + 1);
+			fs_close(fd);
+			fs_sync();
+		}
+		// Not synced, lost in the crash
+		fs_create("lost");
+		_exit(0);
+	}
+	int status;
+	assert(pid == waitpid(pid, &status, 0));
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	// The last updates are only in the journal, until it is replayed
+	assert(-1 == raw_file_size("j39"));
+	fs_mount("disk.fs");
+	fs_umount();
+	assert(40 == raw_file_size("j39"));
+	fs_mount("disk.fs");
+	assert(-1 == fs_delete("lost"));
+	for (int i = 0; i < 40; i++) {
+		sprintf(name, "j%d", i);
+		int fd = fs_open(name);
+		assert(fd >= 0);
+		assert(i + 1 == fs_read(fd, buf, sizeof(buf)));
+		for (int k = 0; k <= i; k++) assert(buf[k] == i);
+		fs_close(fd);
+		assert(0 == fs_delete(name));
+	}
+	fs_umount();
+	// Unmounting writes the metadata in place
+	fs_mount("disk.fs");
+	assert(0 == fs_create("kept"));
+	fs_umount();
+	assert(0 == raw_file_size("kept"));
+	fs_mount("disk.fs");
+	assert(0 == fs_delete("kept"));
+	fs_umount();
+	return;
+}
+
+static void test_readahead() {
+	struct block_cache_stats stats;
+	size_t size = 20 * 4096;
+	char *buf = malloc(size), *readbuf = malloc(size);
+	for (size_t i = 0; i < size; i++) buf[i] = i % 7;
+	fs_mount("disk.fs");
+	assert(0 == fs_create("stream.bin"));
+	int fd = fs_open("stream.bin");
+	assert((int)size == fs_write(fd, buf, size));
+	fs_close(fd);
+	fs_umount();
+	// Small sequential reads get the following blocks prefetched
+	fs_mount("disk.fs");
+	fd = fs_open("stream.bin");
+	for (size_t done = 0; done < size; done += 512)
+		assert(512 == fs_read(fd, readbuf + done, 512));
+	assert(0 == memcmp(buf, readbuf, size));
+	assert(0 == block_cache_stats(&stats));
+	assert(stats.readahead > 0);
+	// Large ones are read in runs, around the cache
+	size_t prefetched = stats.readahead;
+	assert(0 == fs_lseek(fd, 0));
+	for (size_t done = 0; done < size; done += 4 * 4096)
+		assert(4 * 4096 == fs_read(fd, readbuf + done, 4 * 4096));
+	assert(0 == memcmp(buf, readbuf, size));
+	assert(0 == block_cache_stats(&stats));
+	assert(stats.readahead == prefetched);
+	assert(0 == block_prefetch(0, 4));
+	assert(-1 == block_prefetch(block_disk_count(), 1));
+	fs_close(fd);
+	assert(0 == fs_delete("stream.bin"));
+	fs_umount();
+	free(buf);
+	free(readbuf);
+	return;
+}
+
+// A write stops at the first block that cannot be written, here past the
+// limit set on the size of the files of the process
+static void test_write_error(int flags) {
+	size_t size = 640 * 4096;
+	char *buf = malloc(size), *readbuf = malloc(size);
+	assert(buf && readbuf);
+	for (size_t i = 0; i < size; i++) buf[i] = i % 253;
+	assert(0 == fs_format("err.fs", 2000, 4096));
+	assert(0 == fs_mount_flags("err.fs", flags));
+	assert(0 == fs_create("f"));
+	int fd = fs_open("f");
+	struct rlimit old, lim;
+	assert(0 == getrlimit(RLIMIT_FSIZE, &old));
+	lim = old;
+	lim.rlim_cur = 1 << 20;
+	signal(SIGXFSZ, SIG_IGN);
+	assert(0 == setrlimit(RLIMIT_FSIZE, &lim));
+	int n = fs_write(fd, buf, size);
+	// Nothing more can be written once there. A single block would go to
+	// the cache, and fail to be written back later
+	int again = fs_write(fd, buf, 8192);
+	assert(0 == setrlimit(RLIMIT_FSIZE, &old));
+	signal(SIGXFSZ, SIG_DFL);
+	assert(n > 0 && n <= (1 << 20));
+	assert(-1 == again);
+	assert(n == fs_stat(fd));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount());
+	// What was reported written is on the disk, and nothing more
+	assert(0 == fs_mount_flags("err.fs", flags));
+	fd = fs_open("f");
+	assert(n == fs_stat(fd));
+	assert(n == fs_read(fd, readbuf, size));
+	assert(0 == memcmp(buf, readbuf, n));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount());
+	unlink("err.fs");
+	free(buf);
+	free(readbuf);
+}
+
+static void test_large_rw(int flags) {
+	size_t size = 5 * 4096 + 123;
+	char *buf = malloc(size), *readbuf = malloc(size);
+	for (size_t i = 0; i < size; i++) buf[i] = i % 251;
+	assert(0 == fs_mount_flags("disk.fs", flags));
+	if (flags & FS_MOUNT_ASYNC)
+		assert(BLOCK_ENGINE_SYNC != block_engine());
+	assert(0 == fs_create("large.bin"));
+	int fd = fs_open("large.bin");
+	assert((int)size == fs_write(fd, buf, size));
+	assert(0 == fs_lseek(fd, 0));
+	assert((int)size == fs_read(fd, readbuf, size));
+	assert(0 == memcmp(buf, readbuf, size));
+	// Read it again sequentially in small pieces, then seek back and forth
+	assert(0 == fs_lseek(fd, 0));
+	memset(readbuf, 0, size);
+	for (size_t done = 0; done < size; done += 1000)
+		assert(0 < fs_read(fd, readbuf + done, 1000));
+	assert(0 == memcmp(buf, readbuf, size));
+	assert(0 == fs_lseek(fd, 3 * 4096 + 7));
+	assert(10 == fs_read(fd, readbuf, 10));
+	assert(0 == memcmp(buf + 3 * 4096 + 7, readbuf, 10));
+	assert(0 == fs_lseek(fd, 4096 + 1));
+	assert(10 == fs_read(fd, readbuf, 10));
+	assert(0 == memcmp(buf + 4096 + 1, readbuf, 10));
+	// Overwrite across a block boundary, then read past the end of file
+	memset(buf + 4000, 'x', 200);
+	assert(0 == fs_lseek(fd, 4000));
+	assert(200 == fs_write(fd, buf + 4000, 200));
+	assert(0 == fs_lseek(fd, 0));
+	assert((int)size == fs_read(fd, readbuf, size + 100));
+	assert(0 == memcmp(buf, readbuf, size));
+	fs_close(fd);
+	assert(0 == fs_delete("large.bin"));
+	fs_umount();
+	free(buf);
+	free(readbuf);
+	return;
+}
+
+static void test_two_descriptors() {
+	char buf[3 * 4096], readbuf[3 * 4096];
+	for (size_t i = 0; i < sizeof(buf); i++) buf[i] = i % 13;
+	fs_mount("disk.fs");
+	assert(0 == fs_create("shared.bin"));
+	int writer = fs_open("shared.bin");
+	int reader = fs_open("shared.bin");
+	// Blocks appended through one descriptor are visible through the other
+	for (int i = 0; i < 3; i++) {
+		assert(4096 == fs_write(writer, buf + i * 4096, 4096));
+		assert(0 == fs_lseek(reader, i * 4096 + 100));
+		assert(10 == fs_read(reader, readbuf, 10));
+		assert(0 == memcmp(buf + i * 4096 + 100, readbuf, 10));
+	}
+	fs_close(writer);
+	// Random access after the writer is gone
+	assert(0 == fs_lseek(reader, 2 * 4096 + 5));
+	assert(4091 == fs_read(reader, readbuf, sizeof(readbuf)));
+	assert(0 == memcmp(buf + 2 * 4096 + 5, readbuf, 4091));
+	fs_close(reader);
+	assert(0 == fs_delete("shared.bin"));
+	fs_umount();
+	return;
+}
+
+static void test_mount_mmap() {
+	char buf[10], mapped_buf[10];
+	fs_mount("disk.fs");
+	int fd = fs_open("asyoulik.txt");
+	assert(10 == fs_read(fd, buf, 10));
+	fs_close(fd);
+	fs_umount();
+	assert(-1 == fs_mount_flags("notafile.txt", FS_MOUNT_MMAP));
+	assert(0 == fs_mount_flags("disk.fs", FS_MOUNT_MMAP));
+	assert(NULL != block_ptr(0));
+	fd = fs_open("asyoulik.txt");
+	assert(10 == fs_read(fd, mapped_buf, 10));
+	assert(0 == memcmp(buf, mapped_buf, 10));
+	fs_close(fd);
+	assert(0 == fs_umount());
+	assert(NULL == block_ptr(0));
+	return;
+}
+
+static void test_engines() {
+	static char queued[4096], direct[4096], saved[4096];
+	assert(-1 == block_engine());
+	assert(-1 == block_engine_set(42));
+	for (int engine = BLOCK_ENGINE_SYNC; engine <= BLOCK_ENGINE_AUTO; engine++) {
+		assert(0 == block_engine_set(engine));
+		int opened = block_disk_open("disk.fs");
+		// io_uring may be disabled by the kernel
+		if (engine == BLOCK_ENGINE_IO_URING && opened) continue;
+		assert(0 == opened);
+		assert(-1 == block_engine_set(BLOCK_ENGINE_SYNC));
+		assert(BLOCK_ENGINE_AUTO != block_engine());
+		assert(0 == block_queue_read(0, queued));
+		assert(-1 == block_queue_read(block_disk_count(), queued));
+		assert(0 == block_submit());
+		assert(0 == block_read(0, direct));
+		assert(0 == memcmp(queued, direct, sizeof(direct)));
+		// A miss cached before a queued write lands does not outlive it
+		size_t last = block_disk_count() - 1;
+		assert(0 == block_queue_read(last, saved));
+		assert(0 == block_submit());
+		memset(queued, engine + 1, sizeof(queued));
+		assert(0 == block_queue_write(last, queued));
+		assert(0 == block_read(last, direct));
+		assert(0 == block_submit());
+		assert(0 == block_read(last, direct));
+		assert(0 == memcmp(queued, direct, sizeof(direct)));
+		assert(0 == block_write(last, saved));
+		assert(0 == block_disk_close());
+	}
+	assert(0 == block_engine_set(BLOCK_ENGINE_SYNC));
+	return;
+}
+
+static void test_positional() {
+	char buf[3 * 4096], readbuf[3 * 4096];
+	for (size_t i = 0; i < sizeof(buf); i++) buf[i] = i % 17;
+	assert(0 == fs_mount("disk.fs"));
+	assert(0 == fs_create("pos.bin"));
+	int fd = fs_open("pos.bin");
+	assert(-1 == fs_pwrite(fd, buf, 10, 1));
+	assert((int)sizeof(buf) == fs_pwrite(fd, buf, sizeof(buf), 0));
+	// The offset of the descriptor did not move
+	assert(1 == fs_write(fd, "x", 1));
+	assert(1 == fs_pread(fd, readbuf, 1, 0));
+	assert('x' == readbuf[0]);
+	assert(100 == fs_pread(fd, readbuf, 100, 5000));
+	assert(0 == memcmp(buf + 5000, readbuf, 100));
+	assert(0 == fs_pread(fd, readbuf, 100, sizeof(buf)));
+	// Appending at the end of the file, buffered bytes go first
+	assert(0 == fs_setbuf(fd, 4096));
+	assert(1 == fs_write(fd, "y", 1));
+	assert(10 == fs_pwrite(fd, buf, 10, sizeof(buf)));
+	assert((int)sizeof(buf) + 10 == fs_stat(fd));
+	assert(2 == fs_pread(fd, readbuf, 2, 0));
+	assert(0 == memcmp("xy", readbuf, 2));
+	assert(-1 == fs_pread(fd, NULL, 1, 0));
+	assert(-1 == fs_pread(33, readbuf, 1, 0));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_delete("pos.bin"));
+	fs_umount();
+}
+
+// Copy disk image @from to @to
+static void copy_disk(const char *from, const char *to) {
+	char buf[4096];
+	size_t n;
+	FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+	assert(in && out);
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+		assert(n == fwrite(buf, 1, n, out));
+	fclose(in);
+	fclose(out);
+}
+
+static void test_handles() {
+	struct fs_handle *h, *bad;
+	char buf[5000], readbuf[5000];
+	for (size_t i = 0; i < sizeof(buf); i++) buf[i] = i % 7;
+	copy_disk("disk.fs", "disk2.fs");
+	assert(-1 == fs_mount_h("missing.fs", &bad));
+	assert(NULL == bad);
+	assert(0 == fs_mount("disk.fs"));
+	assert(0 == fs_mount_h("disk2.fs", &h));
+	// Files and descriptors belong to one file system
+	assert(0 == fs_create_h(h, "only2"));
+	assert(-1 == fs_open("only2"));
+	int fd2 = fs_open_h(h, "only2");
+	int fd = fs_open("asyoulik.txt");
+	assert(fd == fd2);
+	int size = fs_stat(fd);
+	assert((int)sizeof(buf) == fs_write_h(h, fd2, buf, sizeof(buf)));
+	assert((int)sizeof(buf) == fs_stat_h(h, fd2));
+	assert(size == fs_stat(fd));
+	assert(0 == fs_close_h(h, fd2));
+	assert(-1 == fs_close_h(h, fd2));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount_h(h));
+	assert(0 == fs_umount());
+	// The file is still there once mounted again
+	assert(0 == fs_mount_h("disk2.fs", &h));
+	fd2 = fs_open_h(h, "only2");
+	assert((int)sizeof(buf) == fs_read_h(h, fd2, readbuf, sizeof(readbuf)));
+	assert(0 == memcmp(buf, readbuf, sizeof(buf)));
+	assert(-1 == fs_umount_h(h));
+	assert(0 == fs_close_h(h, fd2));
+	assert(0 == fs_umount_h(h));
+	unlink("disk2.fs");
+}
+
+static void test_vectored(int flags) {
+	// A header and trailer around a payload crossing block boundaries, then
+	// pieces that do not line up with blocks, more of them than a batch
+	// can bounce
+	static char payload[2 * 4096 + 5], pieces[20][4000], readbuf[100000];
+	char header[12] = "header", trailer[7] = "trailer";
+	struct iovec iov[23], riov[3];
+	for (size_t i = 0; i < sizeof(payload); i++) payload[i] = i % 13;
+	for (int i = 0; i < 20; i++) memset(pieces[i], 'a' + i, sizeof(pieces[i]));
+	iov[0] = (struct iovec){ header, sizeof(header) };
+	iov[1] = (struct iovec){ payload, sizeof(payload) };
+	iov[2] = (struct iovec){ trailer, sizeof(trailer) };
+	for (int i = 0; i < 20; i++)
+		iov[3 + i] = (struct iovec){ pieces[i], sizeof(pieces[i]) };
+	int total = sizeof(header) + sizeof(payload) + sizeof(trailer) +
+		sizeof(pieces);
+	assert(0 == fs_mount_flags("disk.fs", flags));
+	assert(0 == fs_create("vec.bin"));
+	int fd = fs_open("vec.bin");
+	assert(-1 == fs_writev(fd, NULL, 1));
+	assert(-1 == fs_writev(fd, iov, -1));
+	assert(0 == fs_writev(fd, iov, 0));
+	assert(total == fs_writev(fd, iov, 23));
+	assert(total == fs_stat(fd));
+	// Read back in pieces of other sizes
+	assert(0 == fs_lseek(fd, 0));
+	riov[0] = (struct iovec){ readbuf, 1 };
+	riov[1] = (struct iovec){ readbuf + 1, 4200 };
+	riov[2] = (struct iovec){ readbuf + 4201, sizeof(readbuf) - 4201 };
+	assert(total == fs_readv(fd, riov, 3));
+	assert(0 == memcmp(header, readbuf, sizeof(header)));
+	assert(0 == memcmp(payload, readbuf + sizeof(header), sizeof(payload)));
+	char *p = readbuf + sizeof(header) + sizeof(payload);
+	assert(0 == memcmp(trailer, p, sizeof(trailer)));
+	assert(0 == memcmp(pieces, p + sizeof(trailer), sizeof(pieces)));
+	// Overwrite in the middle of the file through the write buffer
+	assert(0 == fs_setbuf(fd, 4096));
+	assert(0 == fs_lseek(fd, 3));
+	assert(12 == fs_writev(fd, iov, 1));
+	assert(0 == fs_lseek(fd, 0));
+	assert(4201 == fs_readv(fd, riov, 2));
+	assert(0 == memcmp("hea", readbuf, 3));
+	assert(0 == memcmp(header, readbuf + 3, sizeof(header)));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_delete("vec.bin"));
+	fs_umount();
+}
+
+static void test_format() {
+	char buf[3 * 4096 + 10], readbuf[sizeof(buf)];
+	for (size_t i = 0; i < sizeof(buf); i++) buf[i] = i % 11;
+	assert(-1 == fs_format("v2.fs", 3, 0));
+	assert(0 == fs_format("v2.fs", 5000, 0));
+	assert(0 == fs_mount("v2.fs"));
+	assert(0 == fs_create("v2.bin"));
+	int fd = fs_open("v2.bin");
+	assert((ssize_t)sizeof(buf) == fs_write(fd, buf, sizeof(buf)));
+	assert((off_t)sizeof(buf) == fs_stat(fd));
+	assert(-1 == fs_lseek(fd, -1));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount());
+	// Version 2 metadata is found again once mounted
+	assert(0 == fs_mount_flags("v2.fs", FS_MOUNT_MMAP));
+	fd = fs_open("v2.bin");
+	assert((ssize_t)sizeof(buf) == fs_read(fd, readbuf, sizeof(readbuf)));
+	assert(0 == memcmp(buf, readbuf, sizeof(buf)));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_delete("v2.bin"));
+	assert(0 == fs_umount());
+	// Version 1 layout, in a file whose space is reserved
+	assert(-1 == fs_format_flags("v2.fs", 70000, 0, FS_FORMAT_V1));
+	assert(-1 == fs_format_flags("v2.fs", 100, 1024, FS_FORMAT_V1));
+	assert(0 == fs_format_flags("v2.fs", 4004, 0,
+		FS_FORMAT_V1 | FS_FORMAT_PREALLOC));
+	struct stat st;
+	assert(0 == stat("v2.fs", &st));
+	assert(4004 * 4096 == st.st_size && st.st_blocks * 512 >= st.st_size);
+	assert(0 == fs_mount("v2.fs"));
+	assert(0 == fs_create("v1.bin"));
+	fd = fs_open("v1.bin");
+	assert((ssize_t)sizeof(buf) == fs_write(fd, buf, sizeof(buf)));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount());
+	unlink("v2.fs");
+}
+
+static void test_block_size(size_t block_size, int flags) {
+	// Files span several blocks of any size, and fill the root directory
+	static char buf[3 * 65536 + 10], readbuf[sizeof(buf)];
+	char name[FS_FILENAME_LEN];
+	for (size_t i = 0; i < sizeof(buf); i++) buf[i] = i % 13;
+	assert(-1 == fs_format("bs.fs", 100, block_size + 1));
+	assert(0 == fs_format("bs.fs", 3 * sizeof(buf) / block_size + 64,
+		block_size));
+	assert(0 == fs_mount_flags("bs.fs", flags));
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		sprintf(name, "f%d", i);
+		assert(0 == fs_create(name));
+	}
+	int fd = fs_open("f127");
+	assert((ssize_t)sizeof(buf) == fs_write(fd, buf, sizeof(buf)));
+	assert(0 == fs_lseek(fd, block_size - 3));
+	assert(6 == fs_write(fd, "abcdef", 6));
+	memcpy(&buf[block_size - 3], "abcdef", 6);
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount());
+	// The block size comes from the superblock
+	assert(0 == fs_mount_flags("bs.fs", flags));
+	fd = fs_open("f127");
+	assert((ssize_t)sizeof(buf) == fs_read(fd, readbuf, sizeof(readbuf)));
+	assert(0 == memcmp(buf, readbuf, sizeof(buf)));
+	assert(0 == fs_close(fd));
+	assert(-1 == fs_create("full"));
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		sprintf(name, "f%d", i);
+		assert(0 == fs_delete(name));
+	}
+	assert(0 == fs_umount());
+	unlink("bs.fs");
+}
+
+// Flip a bit of the first byte of @marker found in disk file @diskname
+static void flip_bit(const char *diskname, const char *marker) {
+	FILE *f = fopen(diskname, "r+b");
+	assert(f);
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	char *image = malloc(size);
+	assert(image);
+	rewind(f);
+	assert(1 == fread(image, size, 1, f));
+	long at = 0, len = strlen(marker);
+	while (at + len <= size && memcmp(&image[at], marker, len)) at++;
+	assert(at + len <= size);
+	fseek(f, at, SEEK_SET);
+	fputc(image[at] ^ 1, f);
+	fclose(f);
+	free(image);
+}
+
+static void test_directories(size_t block_size, int flags) {
+	char name[64], buf[10000], readbuf[sizeof(buf)];
+	for (size_t i = 0; i < sizeof(buf); i++) buf[i] = i % 7;
+	assert(0 == fs_format("dir.fs", 20000, block_size));
+	assert(0 == fs_mount_flags("dir.fs", flags));
+	assert(0 == fs_mkdir("d"));
+	assert(-1 == fs_mkdir("d"));
+	assert(-1 == fs_mkdir("x/y"));
+	assert(0 == fs_mkdir("/d/e/"));
+	assert(0 == fs_create("d/e/f"));
+	assert(-1 == fs_create("d/e/f"));
+	assert(-1 == fs_create("d/e/f/g"));
+	assert(-1 == fs_open("d/e"));
+	assert(-1 == fs_delete("d/e"));
+	// A file stays open while its directory grows and its entry moves
+	int fd = fs_open("d/e/f");
+	assert(fd >= 0);
+	for (int i = 0; i < 3000; i++) {
+		sprintf(name, "d/e/n%d", i);
+		assert(0 == fs_create(name));
+	}
+	assert((ssize_t)sizeof(buf) == fs_write(fd, buf, sizeof(buf)));
+	assert(-1 == fs_delete("d/e/f"));
+	int fd2 = fs_open("d/e/f");
+	assert((off_t)sizeof(buf) == fs_stat(fd2));
+	assert(0 == fs_close(fd2));
+	assert(0 == fs_close(fd));
+	assert(-1 == fs_rmdir("d/e"));
+	assert(0 == fs_umount());
+	// Everything is found again once mounted
+	assert(0 == fs_mount_flags("dir.fs", flags));
+	fd = fs_open("d/e/f");
+	assert((ssize_t)sizeof(buf) == fs_read(fd, readbuf, sizeof(readbuf)));
+	assert(0 == memcmp(buf, readbuf, sizeof(buf)));
+	assert(0 == fs_close(fd));
+	for (int i = 0; i < 3000; i++) {
+		sprintf(name, "d/e/n%d", i);
+		fd = fs_open(name);
+		assert(fd >= 0 && 0 == fs_stat(fd));
+		assert(0 == fs_close(fd));
+		assert(0 == fs_delete(name));
+		assert(-1 == fs_open(name));
+	}
+	assert(0 == fs_delete("d/e/f"));
+	assert(0 == fs_rmdir("d/e"));
+	assert(-1 == fs_rmdir("d/e"));
+	assert(0 == fs_rmdir("d"));
+	assert(0 == fs_create("d"));
+	assert(0 == fs_delete("d"));
+	assert(0 == fs_umount());
+	// A directory with a bucket that cannot be read does not grow, and the
+	// bucket is left as it is
+	assert(0 == fs_format_flags("dir.fs", 2000, 1024, FS_FORMAT_CHECKSUM));
+	assert(0 == fs_mount_flags("dir.fs", flags));
+	assert(0 == fs_mkdir("d"));
+	for (int i = 0; i < 100; i++) {
+		sprintf(name, "d/e%03d", i);
+		assert(0 == fs_create(name));
+	}
+	assert(0 == fs_umount());
+	flip_bit("dir.fs", "e007");
+	assert(0 == fs_mount_flags("dir.fs", flags));
+	int created[400] = { 0 }, failed = 0;
+	for (int i = 100; i < 400; i++) {
+		sprintf(name, "d/e%03d", i);
+		created[i] = fs_create(name) == 0;
+		failed += !created[i];
+	}
+	assert(failed > 0);
+	assert(0 == fs_umount());
+	// Still failing its checksum, rather than overwritten by another one
+	struct block_cache_stats stats;
+	assert(0 == fs_mount_flags("dir.fs", flags));
+	assert(-1 == fs_open("d/e007"));
+	assert(0 == block_cache_stats(&stats));
+	assert(stats.corrupt > 0);
+	for (int i = 100; i < 400; i++) {
+		sprintf(name, "d/e%03d", i);
+		fd = fs_open(name);
+		assert(created[i] ? fd >= 0 : fd == -1);
+		if (fd >= 0) assert(0 == fs_close(fd));
+	}
+	assert(0 == fs_umount());
+	unlink("dir.fs");
+}
+
+static void test_directory_journal(size_t block_size) {
+	char name[16], buf[30000], readbuf[sizeof(buf)];
+	for (size_t i = 0; i < sizeof(buf); i++) buf[i] = i % 13;
+	assert(0 == fs_format("dir.fs", 20000, block_size));
+	assert(0 == fs_mount_flags("dir.fs", FS_MOUNT_JOURNAL));
+	assert(0 == fs_mkdir("d"));
+	assert(0 == fs_umount());
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		// A small cache writes directory blocks back early
+		block_cache_set_size(8);
+		fs_mount("dir.fs");
+		fs_mkdir("d/t");
+		for (int i = 0; i < 100; i++) {
+			sprintf(name, "d/t/n%d", i);
+			fs_create(name);
+		}
+		fs_create("d/a");
+		int fd = fs_open("d/a");
+		fs_write(fd, buf, sizeof(buf));
+		fs_close(fd);
+		fs_sync();
+		// The blocks of the removed directory are taken by a file
+		for (int i = 0; i < 100; i++) {
+			sprintf(name, "d/t/n%d", i);
+			fs_delete(name);
+		}
+		fs_rmdir("d/t");
+		fs_create("d/b");
+		fd = fs_open("d/b");
+		fs_write(fd, buf, sizeof(buf));
+		fs_close(fd);
+		fs_sync();
+		// Not synced, lost in the crash along with the blocks it took
+		fs_create("d/lost");
+		fd = fs_open("d/lost");
+		fs_write(fd, buf, sizeof(buf));
+		fs_close(fd);
+		// Small reads go through the cache and evict what it holds
+		fd = fs_open("d/a");
+		while (fs_read(fd, readbuf, 100) > 0)
+			;
+		fs_close(fd);
+		_exit(0);
+	}
+	int status;
+	assert(pid == waitpid(pid, &status, 0));
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	assert(0 == fs_mount_flags("dir.fs", FS_MOUNT_JOURNAL));
+	assert(-1 == fs_open("d/lost"));
+	assert(-1 == fs_open("d/t/n0"));
+	assert(0 == fs_mkdir("d/t"));
+	// The blocks that the lost file took are free, and taken once only
+	assert(0 == fs_create("d/c"));
+	int fd = fs_open("d/c");
+	memset(readbuf, 1, sizeof(readbuf));
+	assert((int)sizeof(readbuf) == fs_write(fd, readbuf, sizeof(readbuf)));
+	assert(0 == fs_close(fd));
+	const char *kept[] = { "d/a", "d/b" };
+	for (int k = 0; k < 2; k++) {
+		fd = fs_open(kept[k]);
+		assert(fd >= 0);
+		assert((int)sizeof(buf) == fs_read(fd, readbuf, sizeof(readbuf)));
+		assert(0 == memcmp(buf, readbuf, sizeof(buf)));
+		assert(0 == fs_close(fd));
+		assert(0 == fs_delete(kept[k]));
+	}
+	assert(0 == fs_delete("d/c"));
+	assert(0 == fs_rmdir("d/t"));
+	assert(0 == fs_rmdir("d"));
+	assert(0 == fs_umount());
+	unlink("dir.fs");
+}
+
+static void test_packed(size_t block_size, int flags) {
+	char name[16], buf[3100], readbuf[sizeof(buf)];
+	for (size_t i = 0; i < sizeof(buf); i++) buf[i] = i % 251;
+	assert(-1 == fs_format_flags("pack.fs", 30, 0,
+		FS_FORMAT_PACKED | FS_FORMAT_V1));
+	assert(0 == fs_format_flags("pack.fs", 30, block_size, FS_FORMAT_PACKED));
+	assert(0 == fs_mount_flags("pack.fs", flags));
+	// A hundred small files fit on a disk of 30 blocks
+	for (int i = 0; i < 100; i++) {
+		sprintf(name, "f%d", i);
+		assert(0 == fs_create(name));
+		int fd = fs_open(name);
+		assert(40 == fs_write(fd, &buf[i], 40));
+		assert(0 == fs_close(fd));
+	}
+	assert(0 == fs_mkdir("d"));
+	assert(0 == fs_create("d/s"));
+	int fd = fs_open("d/s");
+	assert(300 == fs_write(fd, buf, 300));
+	assert(0 == fs_close(fd));
+	// A file grows while packed, then gets a block of its own
+	fd = fs_open("f7");
+	int fd2 = fs_open("f7");
+	assert(0 == fs_lseek(fd, 40));
+	assert(200 == fs_write(fd, &buf[47], 200));
+	assert(10 == fs_pwrite(fd2, &buf[17], 10, 10));
+	assert(240 == fs_read(fd2, readbuf, sizeof(readbuf)));
+	assert(0 == memcmp(&buf[7], readbuf, 240));
+	assert(2760 == fs_write(fd, &buf[247], 2760));
+	assert(3000 == fs_stat(fd2));
+	assert(3000 == fs_pread(fd2, readbuf, sizeof(readbuf), 0));
+	assert(0 == memcmp(&buf[7], readbuf, 3000));
+	assert(0 == fs_close(fd2));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount());
+	// Everything is found again once mounted
+	assert(0 == fs_mount_flags("pack.fs", flags));
+	for (int i = 0; i < 100; i++) {
+		sprintf(name, "f%d", i);
+		fd = fs_open(name);
+		size_t size = i == 7 ? 3000 : 40;
+		assert((ssize_t)size == fs_read(fd, readbuf, sizeof(readbuf)));
+		assert(0 == memcmp(&buf[i], readbuf, size));
+		assert(0 == fs_close(fd));
+		assert(0 == fs_delete(name));
+	}
+	fd = fs_open("d/s");
+	assert(300 == fs_read(fd, readbuf, sizeof(readbuf)));
+	assert(0 == memcmp(buf, readbuf, 300));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_delete("d/s"));
+	assert(0 == fs_rmdir("d"));
+	// Fragment blocks left empty are freed
+	char *big = calloc(20, block_size);
+	assert(0 == fs_create("big"));
+	fd = fs_open("big");
+	assert((ssize_t)(20 * block_size) == fs_write(fd, big, 20 * block_size));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount());
+	free(big);
+	unlink("pack.fs");
+}
+
+// Text that compresses, like a log
+static void log_text(char *buf, size_t size) {
+	size_t len = 0;
+	for (int i = 0; len < size; i++) {
+		char line[128];
+		int n = snprintf(line, sizeof(line), "12:%02d:%02d GET /items/%d "
+			"status=%d bytes=%d\n", i / 60 % 60, i % 60, i * 7 % 1000,
+			i % 13 ? 200 : 404, i * 31 % 5000);
+		memcpy(&buf[len], line, (size_t)n < size - len ? (size_t)n : size - len);
+		len += n;
+	}
+}
+
+static void test_compressed(size_t block_size, int flags, int format) {
+	size_t size = 1 << 20;
+	char *model = malloc(size + 20000), *readbuf = malloc(size + 20000);
+	assert(model && readbuf);
+	log_text(model, size);
+	assert(-1 == fs_format_flags("zip.fs", 300, 0,
+		FS_FORMAT_COMPRESS | FS_FORMAT_V1));
+	assert(-1 == fs_format_flags("zip.fs", 300, 65536, FS_FORMAT_COMPRESS));
+	// The disk is too small for the file unless it is compressed
+	size_t blocks = size / 2 / block_size + 40;
+	assert(0 == fs_format_flags("zip.fs", blocks, block_size,
+		FS_FORMAT_COMPRESS | format));
+	assert(0 == fs_mount_flags("zip.fs", flags));
+	assert(0 == fs_create("log"));
+	int fd = fs_open("log");
+	for (size_t off = 0; off < size; off += 3000) {
+		size_t n = size - off < 3000 ? size - off : 3000;
+		assert((ssize_t)n == fs_write(fd, &model[off], n));
+	}
+	assert((ssize_t)size == fs_stat(fd));
+	// A second descriptor keeps a decompressed cluster, which the writes of
+	// the first one make out of date
+	int fd2 = fs_open("log");
+	assert(100 == fs_pread(fd2, readbuf, 100, 100000));
+	for (size_t i = 0; i < 65536; i++) model[6 * 65536 + i] = rand();
+	assert(65536 == fs_pwrite(fd, &model[6 * 65536], 65536, 6 * 65536));
+	memset(&model[100000], 'x', 5000);
+	assert(5000 == fs_pwrite(fd, &model[100000], 5000, 100000));
+	memset(&model[131000], 'y', 200);
+	assert(200 == fs_pwrite(fd, &model[131000], 200, 131000));
+	// Clusters that do not compress are updated in place
+	memset(&model[6 * 65536 + 5000], 'z', 10000);
+	assert(10000 == fs_pwrite(fd, &model[6 * 65536 + 5000], 10000,
+		6 * 65536 + 5000));
+	assert(0 == fs_lseek(fd, size));
+	assert(20000 == fs_write(fd, model, 20000));
+	memcpy(&model[size], model, 20000);
+	assert(5000 == fs_pread(fd2, readbuf, 5000, 100000));
+	assert(0 == memcmp(readbuf, &model[100000], 5000));
+	for (size_t off = 0; off < size + 20000; off += 3000) {
+		size_t n = size + 20000 - off < 3000 ? size + 20000 - off : 3000;
+		assert((ssize_t)n == fs_read(fd2, &readbuf[off], 3000));
+	}
+	assert(0 == memcmp(readbuf, model, size + 20000));
+	for (int i = 0; i < 200; i++) {
+		size_t off = rand() % (size + 20000), n = rand() % 70000;
+		if (n > size + 20000 - off) n = size + 20000 - off;
+		assert((ssize_t)n == fs_pread(fd, readbuf, n, off));
+		assert(0 == memcmp(readbuf, &model[off], n));
+	}
+	assert(0 == fs_close(fd2));
+	assert(0 == fs_close(fd));
+	// Files of subdirectories are compressed as well
+	assert(0 == fs_mkdir("d"));
+	assert(0 == fs_create("d/s"));
+	fd = fs_open("d/s");
+	assert(200000 == fs_write(fd, &model[1000], 200000));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount());
+	// Everything is found again once mounted
+	assert(0 == fs_mount_flags("zip.fs", flags));
+	fd = fs_open("log");
+	assert((ssize_t)(size + 20000) == fs_read(fd, readbuf, size + 20000));
+	assert(0 == memcmp(readbuf, model, size + 20000));
+	assert(0 == fs_close(fd));
+	fd = fs_open("d/s");
+	assert(200000 == fs_read(fd, readbuf, size));
+	assert(0 == memcmp(readbuf, &model[1000], 200000));
+	assert(0 == fs_close(fd));
+	// Deleting the file gives its blocks back
+	assert(0 == fs_delete("log"));
+	assert(0 == fs_create("log"));
+	fd = fs_open("log");
+	assert((ssize_t)size == fs_write(fd, model, size));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount());
+	free(model);
+	free(readbuf);
+	unlink("zip.fs");
+}
+
+static void test_crc32c() {
+	size_t size = 70000;
+	uint8_t *buf = malloc(size);
+	assert(buf);
+	for (size_t i = 0; i < size; i++) buf[i] = (i * 131 + i / 251) & 0xff;
+	assert(0xe3069283 == crc32c(0, "123456789", 9));
+	// Long buffers, folded by whatever the processor has, get the CRC that
+	// extending it a few bytes at a time gives
+	size_t lens[] = { 255, 256, 300, 4096, 4100, 65536 + 77 };
+	for (size_t k = 0; k < sizeof(lens) / sizeof(lens[0]); k++) {
+		for (size_t off = 0; off < 3; off++) {
+			uint32_t crc = 0x1234;
+			for (size_t at = 0; at < lens[k]; at += 7) {
+				size_t n = lens[k] - at < 7 ? lens[k] - at : 7;
+				crc = crc32c(crc, &buf[off + at], n);
+			}
+			assert(crc == crc32c(0x1234, &buf[off], lens[k]));
+		}
+	}
+	free(buf);
+}
+
+static void test_checksum(size_t block_size, int flags, int format) {
+	struct block_cache_stats stats;
+	size_t size = 6 * block_size + 100;
+	char *model = malloc(size), *readbuf = malloc(size);
+	assert(model && readbuf);
+	for (size_t i = 0; i < size; i++) model[i] = 'a' + i % 23;
+	memcpy(&model[2 * block_size + 10], "second block marker", 19);
+	assert(-1 == fs_format_flags("sum.fs", 300, 0,
+		FS_FORMAT_CHECKSUM | FS_FORMAT_V1));
+	assert(0 == fs_format_flags("sum.fs", 2000, block_size,
+		FS_FORMAT_CHECKSUM | format));
+	assert(0 == fs_mount_flags("sum.fs", flags));
+	assert(0 == fs_create("big"));
+	assert(0 == fs_create("small"));
+	int fd = fs_open("big");
+	assert((ssize_t)size == fs_write(fd, model, size));
+	assert(0 == fs_close(fd));
+	fd = fs_open("small");
+	assert(15 == fs_write(fd, "a small file...", 15));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_sync());
+	// Rewritten blocks get their checksum updated
+	fd = fs_open("big");
+	assert(100 == fs_pwrite(fd, model, 100, 4 * block_size - 50));
+	memcpy(&model[4 * block_size - 50], model, 100);
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount());
+	// Nothing was corrupted so far
+	assert(0 == fs_mount_flags("sum.fs", flags));
+	fd = fs_open("big");
+	assert((ssize_t)size == fs_read(fd, readbuf, size));
+	assert(0 == memcmp(readbuf, model, size));
+	assert(0 == fs_close(fd));
+	assert(0 == block_cache_stats(&stats));
+	assert(0 == stats.corrupt);
+	assert(0 == fs_umount());
+	// A bit flipped behind the file system's back fails the reads of its
+	// block, and of that block only. A read across it returns what comes
+	// before, which on a compressed file system is the clusters before
+	flip_bit("sum.fs", "second block marker");
+	assert(0 == fs_mount_flags("sum.fs", flags));
+	fd = fs_open("big");
+	if (format & FS_FORMAT_COMPRESS) {
+		assert(-1 == fs_read(fd, readbuf, size));
+	} else {
+		assert((ssize_t)(2 * block_size) == fs_read(fd, readbuf, size));
+		assert(0 == memcmp(readbuf, model, 2 * block_size));
+		assert(-1 == fs_read(fd, readbuf, size));
+	}
+	assert(-1 == fs_pread(fd, readbuf, 100, 2 * block_size + 5));
+	assert((ssize_t)block_size == fs_pread(fd, readbuf, block_size, 0));
+	assert(0 == memcmp(readbuf, model, block_size));
+	assert(100 == fs_pread(fd, readbuf, 100, 5 * block_size));
+	assert(0 == memcmp(readbuf, &model[5 * block_size], 100));
+	assert(0 == block_cache_stats(&stats));
+	assert(stats.corrupt > 0);
+	assert(0 == fs_close(fd));
+	fd = fs_open("small");
+	assert(15 == fs_read(fd, readbuf, 100));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount());
+	// So does a corrupted directory entry, for the whole file system
+	flip_bit("sum.fs", "small");
+	assert(-1 == fs_mount_flags("sum.fs", flags));
+	free(model);
+	free(readbuf);
+	unlink("sum.fs");
+}
+
+// A crash can leave blocks on the disk without their checksums: mounting
+// recovers from it with the journal
+static void test_checksum_crash(size_t block_size) {
+	struct block_cache_stats stats;
+	char name[16], buf[30000], readbuf[sizeof(buf)];
+	for (size_t i = 0; i < sizeof(buf); i++) buf[i] = i % 17;
+	assert(0 == fs_format_flags("crash.fs", 20000, block_size,
+		FS_FORMAT_CHECKSUM));
+	assert(0 == fs_mount_flags("crash.fs", FS_MOUNT_JOURNAL));
+	assert(0 == fs_mkdir("d"));
+	assert(0 == fs_create("a"));
+	int fd = fs_open("a");
+	assert((int)sizeof(buf) == fs_write(fd, buf, sizeof(buf)));
+	assert(0 == fs_close(fd));
+	assert(0 == fs_umount());
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		block_cache_set_size(8);
+		fs_mount("crash.fs");
+		for (int i = 0; i < 50; i++) {
+			sprintf(name, "d/n%d", i);
+			fs_create(name);
+		}
+		fs_create("d/f");
+		fd = fs_open("d/f");
+		fs_write(fd, buf, sizeof(buf));
+		fs_close(fd);
+		// The directory blocks go in place once committed, and are written
+		// back early by small reads through the cache, ahead of the
+		// checksums that the next sync would write
+		fs_sync();
+		fd = fs_open("a");
+		while (fs_read(fd, readbuf, 100) > 0)
+			;
+		fs_close(fd);
+		_exit(0);
+	}
+	int status;
+	assert(pid == waitpid(pid, &status, 0));
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	for (int pass = 0; pass < 2; pass++) {
+		// Once recovered, the disk mounts without the journal as well
+		assert(0 == fs_mount_flags("crash.fs", pass ? 0 : FS_MOUNT_JOURNAL));
+		for (int i = 0; i < 50; i++) {
+			sprintf(name, "d/n%d", i);
+			fd = fs_open(name);
+			assert(fd >= 0);
+			assert(0 == fs_close(fd));
+		}
+		fd = fs_open("d/f");
+		assert((int)sizeof(buf) == fs_read(fd, readbuf, sizeof(readbuf)));
+		assert(0 == memcmp(buf, readbuf, sizeof(buf)));
+		assert(0 == fs_close(fd));
+		assert(0 == block_cache_stats(&stats));
+		assert(stats.corrupt == 0);
+		assert(0 == fs_umount());
+	}
+	unlink("crash.fs");
+}
+
 int main() {
 	test_mount_unmount();
 	test_info();
@@ -160,5 +1293,44 @@ int main() {
 	test_lseek();
 	test_write();
 	test_read();
+	test_cache();
+	test_write_no_read();
+	test_readahead();
+	test_many_files();
+	test_sync();
+	test_journal();
+	test_write_buffer();
+	test_large_rw(0);
+	test_large_rw(FS_MOUNT_MMAP);
+	test_large_rw(FS_MOUNT_ASYNC);
+	test_write_error(0);
+	test_write_error(FS_MOUNT_ASYNC);
+	test_engines();
+	test_two_descriptors();
+	test_mount_mmap();
+	test_handles();
+	test_positional();
+	test_vectored(0);
+	test_vectored(FS_MOUNT_MMAP);
+	test_format();
+	test_block_size(1024, 0);
+	test_block_size(1024, FS_MOUNT_JOURNAL);
+	test_block_size(65536, 0);
+	test_block_size(65536, FS_MOUNT_MMAP);
+	test_directories(0, 0);
+	test_directories(1024, FS_MOUNT_JOURNAL);
+	test_directories(4096, FS_MOUNT_MMAP);
+	test_directory_journal(1024);
+	test_packed(1024, 0);
+	test_packed(4096, FS_MOUNT_JOURNAL);
+	test_packed(1024, FS_MOUNT_MMAP);
+	test_compressed(4096, 0, 0);
+	test_compressed(1024, FS_MOUNT_JOURNAL, FS_FORMAT_PACKED);
+	test_compressed(4096, FS_MOUNT_MMAP, 0);
+	test_crc32c();
+	test_checksum(4096, FS_MOUNT_ASYNC, 0);
+	test_checksum(1024, FS_MOUNT_JOURNAL, FS_FORMAT_PACKED);
+	test_checksum(4096, FS_MOUNT_MMAP, FS_FORMAT_COMPRESS);
+	test_checksum_crash(1024);
 	return 0;
 }
@@ -0,0 +1,294 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Size of the files each thread works on */
+#define STRESS_FILE_SIZE	(256 * 1024)
+#define STRESS_ITERATIONS	2000
+#define BENCH_FILE_SIZE		(2 * 1024 * 1024)
+/* Amount of data each thread reads per measure */
+#define BENCH_READ_TOTAL	(32 * 1024 * 1024)
+/* Block cache size during the measures, far below the files read */
+#define BENCH_CACHE_BLOCKS	64
+
+struct worker {
+	pthread_t thread;
+	int id;
+	/* Descriptor shared by the positional readers */
+	int fd;
+	unsigned int seed;
+	int nthreads;
+	char filename[FS_FILENAME_LEN];
+};
+
+/* Byte @offset of the content a thread writes in pass @pass */
+static uint8_t pattern(int id, int pass, size_t offset)
+{
+	return (uint8_t)(id * 31 + pass * 7 + offset % 251);
+}
+
+/* Byte @offset of the file every thread reads */
+static uint8_t shared_pattern(size_t offset)
+{
+	return (uint8_t)(offset * 13 + offset / 4096);
+}
+
+/*
+ * Each thread rewrites its own file, checks it back, and reads the shared
+ * file, while one of them creates and deletes files in the root directory
+ */
+static void *stress_main(void *arg)
+{
+	struct worker *w = arg;
+	uint8_t *model = calloc(1, STRESS_FILE_SIZE);
+	uint8_t *buf = malloc(STRESS_FILE_SIZE);
+	size_t size = 0;
+	char tmpname[FS_FILENAME_LEN];
+
+	if (!model || !buf)
+		die("out of memory");
+	int fd = fs_open(w->filename);
+	int shared = fs_open("shared");
+	if (fd < 0 || shared < 0)
+		die("thread %d: cannot open files", w->id);
+	if (w->id % 2)
+		fs_setbuf(fd, 3 * 4096);
+
+	for (int it = 0; it < STRESS_ITERATIONS; it++) {
+		int op = rand_r(&w->seed) % 8;
+		size_t off = size ? rand_r(&w->seed) % (size + 1) : 0;
+		size_t len = rand_r(&w->seed) % 20000;
+
+		if (op < 3) {
+			if (off + len > STRESS_FILE_SIZE)
+				len = STRESS_FILE_SIZE - off;
+			for (size_t i = 0; i < len; i++)
+				buf[i] = pattern(w->id, it, off + i);
+			if (fs_lseek(fd, off) || fs_write(fd, buf, len) != (int)len)
+				die("thread %d: write failed", w->id);
+			memcpy(&model[off], buf, len);
+			if (off + len > size)
+				size = off + len;
+		} else if (op < 5) {
+			size_t exp = off + len > size ? size - off : len;
+			if (fs_lseek(fd, off) || fs_read(fd, buf, len) != (int)exp)
+				die("thread %d: short read", w->id);
+			if (memcmp(buf, &model[off], exp))
+				die("thread %d: data mismatch at %zu", w->id, off);
+		} else if (op < 7) {
+			off = rand_r(&w->seed) % STRESS_FILE_SIZE;
+			size_t exp = off + len > STRESS_FILE_SIZE ?
+				STRESS_FILE_SIZE - off : len;
+			if (fs_lseek(shared, off) || fs_read(shared, buf, len) != (int)exp)
+				die("thread %d: short read of shared file", w->id);
+			for (size_t i = 0; i < exp; i++)
+				if (buf[i] != shared_pattern(off + i))
+					die("thread %d: shared file mismatch", w->id);
+		} else {
+			if (fs_stat(fd) != (int)size)
+				die("thread %d: wrong size", w->id);
+			if (w->id == 0) {
+				snprintf(tmpname, sizeof(tmpname), "tmp%d", it % 8);
+				if (fs_create(tmpname) == 0 && fs_delete(tmpname))
+					die("cannot delete %s", tmpname);
+				fs_sync();
+			}
+			/* Reopen the file, its content must not change */
+			if (fs_close(fd) || (fd = fs_open(w->filename)) < 0)
+				die("thread %d: cannot reopen", w->id);
+		}
+	}
+
+	if (fs_close(fd) || fs_close(shared))
+		die("thread %d: close failed", w->id);
+	free(model);
+	free(buf);
+	return NULL;
+}
+
+/* Read the whole of a file over and over */
+static void *bench_main(void *arg)
+{
+	struct worker *w = arg;
+	uint8_t *buf = malloc(64 * 1024);
+	int fd = fs_open(w->filename);
+
+	if (!buf || fd < 0)
+		die("thread %d: cannot open %s", w->id, w->filename);
+	for (size_t done = 0; done < BENCH_READ_TOTAL; ) {
+		int n = fs_read(fd, buf, 64 * 1024);
+		if (n < 0)
+			die("thread %d: read failed", w->id);
+		if (n == 0)
+			fs_lseek(fd, 0);
+		done += n;
+	}
+	fs_close(fd);
+	free(buf);
+	return NULL;
+}
+
+/* Read a slice of a file shared with the other threads, over and over */
+static void *pread_main(void *arg)
+{
+	struct worker *w = arg;
+	uint8_t *buf = malloc(64 * 1024);
+	size_t slice = BENCH_FILE_SIZE / w->nthreads;
+	size_t start = w->id * slice;
+
+	if (!buf)
+		die("out of memory");
+	for (size_t done = 0; done < BENCH_READ_TOTAL; ) {
+		size_t off = done % slice;
+		size_t len = slice - off < 64 * 1024 ? slice - off : 64 * 1024;
+		if (fs_pread(w->fd, buf, len, start + off) != (int)len)
+			die("thread %d: short read", w->id);
+		if (buf[0] != (uint8_t)(start + off))
+			die("thread %d: data mismatch", w->id);
+		done += len;
+	}
+	free(buf);
+	return NULL;
+}
+
+static void fill_file(const char *filename, size_t size, int shared)
+{
+	uint8_t *buf = malloc(size);
+
+	if (!buf)
+		die("out of memory");
+	for (size_t i = 0; i < size; i++)
+		buf[i] = shared ? shared_pattern(i) : (uint8_t)i;
+	if (fs_create(filename))
+		die("cannot create %s", filename);
+	int fd = fs_open(filename);
+	if (fd < 0 || fs_write(fd, buf, size) != (int)size || fs_close(fd))
+		die("cannot write %s", filename);
+	free(buf);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = 4;
+	struct worker *workers;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskname> [max_threads]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	if (max_threads < 1 || max_threads > FS_OPEN_MAX_COUNT / 2)
+		die("between 1 and %d threads", FS_OPEN_MAX_COUNT / 2);
+	workers = calloc(max_threads, sizeof(*workers));
+	if (!workers)
+		die("out of memory");
+
+	if (fs_mount(argv[1]))
+		die("cannot mount diskname");
+
+	/* Concurrent operations, checked against what each thread wrote */
+	fill_file("shared", STRESS_FILE_SIZE, 1);
+	for (int i = 0; i < max_threads; i++) {
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		snprintf(workers[i].filename, FS_FILENAME_LEN, "stress%d", i);
+		if (fs_create(workers[i].filename))
+			die("cannot create %s", workers[i].filename);
+	}
+	for (int i = 0; i < max_threads; i++)
+		pthread_create(&workers[i].thread, NULL, stress_main, &workers[i]);
+	for (int i = 0; i < max_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	for (int i = 0; i < max_threads; i++)
+		fs_delete(workers[i].filename);
+	fs_delete("shared");
+	/* On a checksummed disk, blocks read while written are not corrupt */
+	struct block_cache_stats stats;
+	if (block_cache_stats(&stats) || stats.corrupt)
+		die("blocks reported corrupt");
+	printf("stress: %d threads OK\n", max_threads);
+
+	/*
+	 * Read throughput, each thread reading its own file. The files are
+	 * remounted with a cache much smaller than any of them, so that the
+	 * reads go to the disk file instead of being copied out of the cache
+	 * under its lock. What the threads still share is the cache lock, taken
+	 * once per run of blocks to look them up, the file system lock, taken
+	 * shared by every call, and the disk file in the kernel's page cache.
+	 */
+	for (int i = 0; i < max_threads; i++) {
+		snprintf(workers[i].filename, FS_FILENAME_LEN, "bench%d", i);
+		fill_file(workers[i].filename, BENCH_FILE_SIZE, 0);
+	}
+	if (fs_umount() || block_cache_set_size(BENCH_CACHE_BLOCKS) ||
+	    fs_mount(argv[1]))
+		die("cannot remount diskname");
+	double base = 0;
+	for (int n = 1; n <= max_threads; n++) {
+		struct block_cache_stats before, after;
+		block_cache_stats(&before);
+		double start = now();
+		for (int i = 0; i < n; i++)
+			pthread_create(&workers[i].thread, NULL, bench_main, &workers[i]);
+		for (int i = 0; i < n; i++)
+			pthread_join(workers[i].thread, NULL);
+		double secs = now() - start;
+		block_cache_stats(&after);
+		double rate = (double)n * BENCH_READ_TOTAL / (1 << 20) / secs;
+		size_t hits = after.hits - before.hits;
+		size_t misses = after.misses - before.misses;
+		if (n == 1)
+			base = rate;
+		printf("read: %d threads, %.1f MB/s (x%.2f), %.1f%% cache hits\n",
+			 n, rate, rate / base,
+			 hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+	}
+
+	/* Same, with all threads reading one file through a single descriptor */
+	int fd = fs_open(workers[0].filename);
+	for (int n = 1; n <= max_threads; n++) {
+		double start = now();
+		for (int i = 0; i < n; i++) {
+			workers[i].fd = fd;
+			workers[i].nthreads = n;
+			pthread_create(&workers[i].thread, NULL, pread_main, &workers[i]);
+		}
+		for (int i = 0; i < n; i++)
+			pthread_join(workers[i].thread, NULL);
+		double secs = now() - start;
+		printf("pread: %d threads, %.1f MB/s\n", n,
+			 (double)n * BENCH_READ_TOTAL / (1 << 20) / secs);
+	}
+	fs_close(fd);
+	for (int i = 0; i < max_threads; i++)
+		fs_delete(workers[i].filename);
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+	free(workers);
+	return 0;
+}